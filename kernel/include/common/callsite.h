@@ -0,0 +1,28 @@
+#ifndef CALLSITE_H
+#define CALLSITE_H
+
+#include <stdint.h>
+
+#define CALLSITE_NONE 0xFFFFFFFF ///< No entry: the caller was dropped or there's nothing left to visit
+
+/**
+ * @brief An open addressing table of callers, an entry is claimed the first time and never removed
+ * Entries are structs whose first field is the return address of the call (void *caller),
+ * NULL while the entry is free. The rest of the entry belongs to the user of the table
+ */
+struct callsite_table {
+    void *entries; ///< The entries, 2^shift of them
+    uint32_t entry_size; ///< The size of an entry in bytes
+    uint32_t shift; ///< log2 of the number of entries
+    uint32_t probes; ///< How many entries a caller looks at before it's dropped
+};
+
+#define CALLSITE_TABLE_INIT(array, table_shift, table_probes) { \
+    .entries = (array), .entry_size = sizeof((array)[0]), .shift = (table_shift), .probes = (table_probes) }
+
+uint32_t callsite_slot(struct callsite_table *table, void *caller);
+void *callsite_entry(struct callsite_table *table, uint32_t slot);
+uint32_t callsite_count(struct callsite_table *table);
+uint32_t callsite_next_top(struct callsite_table *table, int64_t (*key)(const void *entry), uint32_t previous);
+
+#endif // CALLSITE_H
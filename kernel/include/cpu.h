@@ -4,8 +4,11 @@
 #include <stdint.h>
 
 #define CR4_PGE_BIT (1ULL << 7)
+#define RFLAGS_IF   (1ULL << 9) ///< Interrupts are enabled
 
 __attribute__((noreturn)) void hcf(void);
+__attribute__((noreturn)) void cpu_switch_stack(uint64_t stack_top, void (*entry)(void));
+void cpu_flush_caches(void);
 void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
 inline uint64_t cpu_rdmsr(uint32_t msr_index);
 inline void cpu_wrmsr(uint32_t msr_index, uint64_t value);
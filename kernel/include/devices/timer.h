@@ -27,6 +27,8 @@ struct cpu_status* timer_handler(struct cpu_status* context);
 
 uint64_t timer_get_uptime_ms();
 uint64_t timer_get_uptime_ticks();
+uint64_t timer_read_tsc(void);
+uint64_t timer_tsc_to_us(uint64_t cycles);
 
 void timer_sleep();
 
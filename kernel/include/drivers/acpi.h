@@ -5,6 +5,8 @@
 #include <stdint.h>
 
 #define RSDP_SIGNATURE "RSD PTR "
+#define SRAT_SIGNATURE "SRAT"
+#define SLIT_SIGNATURE "SLIT"
 
 /**
  * @brief The RSDP structure v1.0 with a 32 bit address for RSDT
@@ -58,7 +60,71 @@ struct XSDT {
     uint64_t sdtAddresses[];
 } __attribute__((packed));
 
+/**
+ * @brief System Resource Affinity Table, ties CPUs and memory to proximity domains
+ * 
+ */
+struct SRAT {
+    struct ACPISDTHeader sdtHeader; //signature "SRAT"
+    uint32_t Reserved1;
+    uint64_t Reserved2;
+    uint8_t entries[]; // Variable length entries, each starting with a SRATEntryHeader
+} __attribute__((packed));
+
+#define SRAT_TYPE_LAPIC_AFFINITY    0
+#define SRAT_TYPE_MEMORY_AFFINITY   1
+#define SRAT_TYPE_X2APIC_AFFINITY   2
+
+#define SRAT_AFFINITY_ENABLED       (1 << 0)
+
+struct SRATEntryHeader {
+    uint8_t Type;
+    uint8_t Length;
+} __attribute__((packed));
+
+struct SRATLapicAffinity {
+    struct SRATEntryHeader header;
+    uint8_t ProximityDomainLow;
+    uint8_t ApicID;
+    uint32_t Flags;
+    uint8_t SapicEID;
+    uint8_t ProximityDomainHigh[3];
+    uint32_t ClockDomain;
+} __attribute__((packed));
+
+struct SRATMemoryAffinity {
+    struct SRATEntryHeader header;
+    uint32_t ProximityDomain;
+    uint16_t Reserved1;
+    uint64_t BaseAddress;
+    uint64_t Length;
+    uint32_t Reserved2;
+    uint32_t Flags;
+    uint64_t Reserved3;
+} __attribute__((packed));
+
+struct SRATX2ApicAffinity {
+    struct SRATEntryHeader header;
+    uint16_t Reserved1;
+    uint32_t ProximityDomain;
+    uint32_t X2ApicID;
+    uint32_t Flags;
+    uint32_t ClockDomain;
+    uint32_t Reserved2;
+} __attribute__((packed));
+
+/**
+ * @brief System Locality Information Table, the relative distance between proximity domains
+ * 
+ */
+struct SLIT {
+    struct ACPISDTHeader sdtHeader; //signature "SLIT"
+    uint64_t NumberOfLocalities;
+    uint8_t Entries[]; // NumberOfLocalities * NumberOfLocalities distances, row major
+} __attribute__((packed));
+
 void acpi_init(void);
 void *acpi_find_table(const char *signature);
+void acpi_copy_tables(void);
 
 #endif // ACPI_H
\ No newline at end of file
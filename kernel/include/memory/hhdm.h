@@ -3,6 +3,7 @@
 
 #include <limine.h>
 
+void hhdm_init(void);
 void* hhdm_physToVirt(void *physical_addr);
 void* hhdm_virtToPhys(void *virtual_addr);
 
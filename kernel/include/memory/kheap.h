@@ -4,29 +4,100 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <memory/slab.h>
 
 #define KHEAP_STARTING_SIZE 0x100000 ///< The starting size of our kernel heap (1MB)
-#define KHEAP_MIN_SPLITTING_SIZE 16 ///< How much memory does a block need to be splitted
+#define KHEAP_MIN_SPLITTING_SIZE 16 ///< How much memory does a block need to be splitted, also the smallest payload
 #define KHEAP_BLOCK_SIZE 16 ///< An alignment made to each size request
 #define KHEAP_EXTENDING_AMOUNT 0x100000 ///< How much memory to extend our heap
+#define KHEAP_NR_LISTS 32 ///< Free lists, list i holds the blocks from 2^(i+4) bytes to 2^(i+5) excluded
+#define KHEAP_FIT_PROBES 8 ///< How many blocks of the smallest fitting list kmalloc looks at before taking a bigger one
+#define KHEAP_LARGE_SIZE 0x20000 ///< From this size up kmalloc maps an area of the vmm instead of using the list (128KB)
+#define KHEAP_TRIM_THRESHOLD 0x400000 ///< The free regions are trimmed every time this many bytes are freed (4MB)
+#define KHEAP_PROFILE 0 ///< Set to 1 to record the size histograms and the call sites of kmalloc
+#define KHEAP_PROFILE_SHIFT 9 ///< The call site table has 2^9 entries
+#define KHEAP_PROFILE_SITES (1U << KHEAP_PROFILE_SHIFT)
+#define KHEAP_PROFILE_PROBES 16 ///< How many entries a call site looks at before it's dropped from the profile
+#define KHEAP_PROFILE_TOP 16 ///< How many call sites kheap_profile_dump prints
+#define KHEAP_HIST_BUCKETS 32 ///< Bucket i of the histograms counts the sizes from 2^i to 2^(i+1) excluded
+#define KHEAP_PROFILE_MAGIC 0x50504548 ///< "HEPP", starts the blob of kheap_profile_export
+#define KHEAP_PROFILE_VERSION 1
+#define KHEAP_BENCH_LIVE 4096 ///< How many objects kheap_benchmark keeps allocated at most
+#define KHEAP_BENCH_STEP 512 ///< kheap_benchmark prints the latency every time this many objects are added
 
 /**
  * @brief This struct describes a single region of the kernel heap
- * The kernel heap is an ordered linked list of those nodes,
- * each node can be free or used. Different nodes describe
- * different non-overlapping memory regions
+ * The regions follow each other in memory, every one starts with this header
+ * and ends with a copy of it (the footer) so a region finds both its neighbours in O(1).
+ * Free regions are also linked in a free list chosen by their size, the whole pages
+ * between their links and their footer can be given back to the pmm
  */
 struct kheap_node
 {
-    uint64_t size; ///< The size of the region EXCLUDING its header size
+    uint64_t size; ///< The size of the region EXCLUDING its header and footer
     bool isFree; ///< Is this region free?
-    struct kheap_node *next; ///< A pointer to the next node 
+    bool trimmed; ///< Some pages of the free region may be unmapped, they're mapped again when it's allocated
 };
 
+/**
+ * @brief The links of a free region in its free list
+ * They live in the first bytes of the region, right after the header
+ */
+struct kheap_free_links
+{
+    struct kheap_node *next; ///< The next free region of the same list
+    struct kheap_node *prev; ///< The previous free region of the same list
+};
+
+/**
+ * @brief The allocations made from a single call site, recorded when KHEAP_PROFILE is on
+ */
+struct kheap_site
+{
+    void *caller; ///< The return address of the allocation call, NULL for a free entry. First, as the callsite table wants
+    uint64_t allocs; ///< How many allocations it made
+    uint64_t bytes; ///< How many bytes it asked for overall
+};
+
+/**
+ * @brief The start of the blob kheap_profile_export sends over the serial port
+ * It's followed by the allocation histogram and the live histogram (nr_buckets uint64_t each),
+ * then by nr_sites struct kheap_site. Every field is little endian
+ */
+struct kheap_profile_header
+{
+    uint32_t magic; ///< KHEAP_PROFILE_MAGIC, finds the blob among the log lines
+    uint16_t version; ///< KHEAP_PROFILE_VERSION
+    uint16_t nr_buckets; ///< How many buckets every histogram has, 0 if KHEAP_PROFILE is off
+    uint32_t nr_sites; ///< How many call sites follow the histograms
+    uint32_t fragmentation; ///< External fragmentation of the list in thousandths, 1 - largest free region / free bytes
+    uint64_t heap_bytes; ///< The virtual size of the list heap
+    uint64_t mapped_bytes; ///< How much of it is backed by memory
+    uint64_t live_bytes; ///< Bytes allocated from the list
+    uint64_t live_objects; ///< Regions allocated from the list
+    uint64_t free_bytes; ///< Bytes in the free regions of the list
+    uint64_t free_regions; ///< How many free regions the list has
+    uint64_t largest_free; ///< The biggest allocation the list can serve without growing
+    uint64_t slab_resident; ///< Bytes of the slabs
+    uint64_t slab_live; ///< Bytes of the objects allocated from the slabs
+    uint64_t large_bytes; ///< Bytes of the vmm areas of large allocations
+    uint64_t large_objects; ///< How many large allocations are live
+    uint64_t sites_dropped; ///< Allocations that found no free entry in the call site table
+} __attribute__((packed));
+
 void kheap_init(void);
 bool kheap_extend(size_t size);
-void* kmalloc(size_t size);
+void *kmalloc(size_t size);
+void *kmalloc_atomic(size_t size);
+void *kmalloc_flags(size_t size, uint64_t flags);
+void *kmalloc_aligned(size_t size, size_t align);
+void *krealloc(void *ptr, size_t size);
 void kfree(void *ptr);
 void kheap_print_nodes();
+uint64_t kheap_trim(void);
+void kheap_print_usage(void);
+void kheap_benchmark(uint64_t iterations);
+void kheap_profile_dump(void);
+void kheap_profile_export(void);
 
 #endif // KHEAP_H
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdint.h>
+
+#define NUMA_MAX_NODES          8   ///< How many nodes we can manage, the others are folded into node 0
+#define NUMA_MAX_MEMBLOCKS      32  ///< How many memory affinity ranges we keep track of
+#define NUMA_MAX_APIC_ID        256 ///< CPUs with an higher APIC ID are assumed on node 0
+
+#define NUMA_LOCAL_DISTANCE     10  ///< The SLIT distance of a node to itself
+#define NUMA_REMOTE_DISTANCE    20  ///< The distance we assume between two nodes without a SLIT
+
+/**
+ * @brief How a physical allocation picks its node
+ */
+enum numa_policy_mode {
+    NUMA_POLICY_LOCAL,      ///< The node of the CPU we're running on
+    NUMA_POLICY_INTERLEAVE, ///< Every allocation goes to the next node with memory
+    NUMA_POLICY_PREFERRED   ///< A fixed node
+};
+
+/**
+ * @brief A memory policy, every policy falls back to the nearest nodes when its node is full
+ */
+struct numa_policy {
+    enum numa_policy_mode mode; ///< How the node is chosen
+    uint32_t node; ///< The node for NUMA_POLICY_PREFERRED
+    uint32_t next; ///< The next node for NUMA_POLICY_INTERLEAVE
+};
+
+#define NUMA_POLICY_LOCAL_INIT      { NUMA_POLICY_LOCAL, 0, 0 }
+#define NUMA_POLICY_INTERLEAVE_INIT { NUMA_POLICY_INTERLEAVE, 0, 0 }
+
+/**
+ * @brief A range of physical memory that belongs to a node, [start_pfn, end_pfn)
+ */
+struct numa_memblock {
+    uint64_t start_pfn; ///< The first page of the range
+    uint64_t end_pfn; ///< The first page after the range
+    uint32_t node; ///< The node owning the range
+};
+
+void numa_init(void);
+uint32_t numa_node_count(void);
+uint32_t numa_current_node(void);
+uint32_t numa_pfn_to_node(uint64_t pfn);
+uint8_t numa_distance(uint32_t from, uint32_t to);
+
+#endif // NUMA_H
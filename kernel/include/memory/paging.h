@@ -75,6 +75,8 @@ void paging_map_page(uint64_t *pml4_root, uint64_t virt_addr, uint64_t phys_addr
 void paging_map_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags, bool isHugePage);
 void paging_unmap_page(uint64_t *pml4_root, uint64_t virt_addr, bool isHugePage, bool freePhysical);
 void paging_unmap_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size, bool isHugePage, bool freePhysical);
+uint64_t *paging_get_pte(uint64_t *pml4_root, uint64_t virt_addr);
+uint64_t *paging_get_pde(uint64_t *pml4_root, uint64_t virt_addr);
 void paging_change_page_flags(uint64_t *pml4_root, uint64_t virt_addr, uint64_t flags, bool isHugePage);
 inline void paging_switch_context(uint64_t *kernel_pml4_phys);
 uint64_t *paging_getKernelRoot(void);
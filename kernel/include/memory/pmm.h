@@ -1,34 +1,108 @@
 #ifndef PMM_H
 #define PMM_H
 
+#include <memory/numa.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <common/dll.h>
 
 #define PMM_PAGE_SIZE 4096 //< The initial size of each page
 
 #define PMM_MAX_ORDER       11 // Maximum buddy size 2^22 = 4MB
 
+#define PMM_PCP_BATCH       16 ///< How many pages a per-CPU cache refills/drains at once
+#define PMM_PCP_HIGH        64 ///< When a per-CPU cache holds this many pages we drain a batch
+#define PMM_PCP_MAX_CPUS    1  ///< Until SMP lands every context runs on the boot CPU
+
+#define PMM_ZONE_DMA_END    (16ULL * 1024 * 1024)         ///< ISA DMA can only reach the first 16MB
+#define PMM_ZONE_DMA32_END  (4ULL * 1024 * 1024 * 1024)   ///< 32 bit DMA can only reach the first 4GB
+
+#define PMM_NODE_MAP_SHIFT  (PMM_MAX_ORDER - 1) ///< The node of every page is recorded with the granularity of the biggest block
+
+#define PMM_WATERMARK_MIN_DIV   128 ///< A zone's min watermark is 1/128 of its pages
+#define PMM_WATERMARK_MIN_PAGES 32  ///< But never less than this many pages
+
+#define PMM_ZERO_POOL_HIGH  256 ///< How many pre-zeroed pages the idle thread keeps ready
+#define PMM_ZERO_POOL_BATCH 16  ///< How many pages the idle thread zeroes before checking for other work
+
+#define PMM_BENCH_BURST     64 ///< How many blocks pmm_benchmark keeps allocated at once
+#define PMM_BENCH_SCATTER   2048 ///< How many blocks pmm_benchmark frees in a scattered order on a cold memmap
+#define PMM_BENCH_SCATTER_ORDER 3 ///< Their order, the descriptors of two buddies sit on different cache lines
+#define PMM_BENCH_BULK      256 ///< How many pages pmm_benchmark allocates at once to measure bulk throughput (1MB)
+
+#define PMM_BULK_BATCH      64 ///< How many pages callers of pmm_alloc_bulk usually ask for at once
+
+#define PMM_PFN_NONE        0xFFFFFFFF ///< Marks the end of a page list, PFNs are 32 bits wide (16TB of RAM)
+
+#define PMM_MAX_RANGES      64 ///< How many distinct usable RAM ranges we keep track of
+
+#define PMM_DEFERRED_INIT   1     ///< Set to 0 to initialize the whole memmap inside pmm_init
+#define PMM_EARLY_INIT_MB   256   ///< How much of the memmap pmm_init sets up, the rest is initialized later
+#define PMM_SECTION_PAGES   65536 ///< The memmap is initialized in sections of 256MB, aligned to the biggest order
+#define PMM_MAX_SECTIONS    (((uint64_t)PMM_PFN_NONE + 1) / PMM_SECTION_PAGES)
+
+#define PMM_DEBUG           0 ///< Set to 1 to validate the head of every block that gets freed
+
+#define PMM_TRACE           0    ///< Set to 1 to account the live memory of every caller of the allocation functions
+#define PMM_TRACE_SHIFT     10   ///< The trace table has 2^10 callers
+#define PMM_TRACE_SLOTS     (1U << PMM_TRACE_SHIFT)
+#define PMM_TRACE_PROBES    16   ///< How many slots a caller looks at before it's dropped from the trace
+#define PMM_TRACE_DUMP_TOP  32   ///< How many callers pmm_trace_dump prints
+
+#define PMM_CONTIG_MAX_TRIES 4 ///< How many ranges pmm_alloc_contig tries to empty by migration before giving up
+
+#define PMM_COMPACT_THRESHOLD       500 ///< Zones are compacted only when their fragmentation index is above this
+#define PMM_COMPACT_MAX_DEFER_SHIFT 6   ///< After failures the idle thread skips up to 2^6 compaction attempts
+
+#define PMM_RECLAIM_BATCH       64  ///< How many pages a reclaim pass asks the shrinkers for
+#define PMM_RECLAIM_RETRIES     4   ///< How many reclaim passes an allocation that can sleep tries before failing
+#define PMM_RECLAIM_INTERVAL_MS 250 ///< How often the reclaim thread checks the watermarks when nobody wakes it
+
 /**
  * @name PMM page type
  * @{
  */
-#define PMM_FLAG_FREE       1
-#define PMM_FLAG_USED       1 << 1
-#define PMM_FLAG_RESERVED   1 << 2
+#define PMM_FLAG_FREE       (1 << 0)
+#define PMM_FLAG_USED       (1 << 1)
+#define PMM_FLAG_RESERVED   (1 << 2)
+#define PMM_FLAG_PCP        (1 << 3) ///< The page sits in a per-CPU cache
+#define PMM_FLAG_ZERO       (1 << 4) ///< The page sits zeroed in the zero pool
+#define PMM_FLAG_CONTIG     (1 << 5) ///< Head of a run from pmm_alloc_contig, next holds its length in pages
+#define PMM_FLAG_MOVABLE    (1 << 6) ///< Anonymous page mapped once, the migrator can move it
+#define PMM_FLAG_ISOLATED   (1 << 7) ///< Free page held by pmm_alloc_contig while it empties a range
+/** @} */
+
+/**
+ * @name PMM page info word layout
+ * Flags, order and reference count of a page share a single 32 bit word
+ * @{
+ */
+#define PMM_INFO_FLAGS_MASK     0xFF        ///< Bits 0-7: the page type flags
+#define PMM_INFO_ORDER_SHIFT    8           ///< Bits 8-11: the order of the block
+#define PMM_INFO_ORDER_MASK     (0xFu << PMM_INFO_ORDER_SHIFT)
+#define PMM_INFO_REF_SHIFT      12          ///< Bits 12-31: the reference count
+#define PMM_INFO_REF_MASK       (0xFFFFFu << PMM_INFO_REF_SHIFT)
 /** @} */
 
 /**
  * @brief A node that describes a physical memory region 
  * This region is 2^(12 + order) bytes long, it has a reference count
  * because multiple things can reference this page at once.
- * When the ref_count drops to zero we can safely free the region
+ * When the ref_count drops to zero we can safely free the region.
+ * There's one for every page of RAM so it's kept as small as possible:
+ * the list links are page frame numbers instead of pointers
  */
 struct pmm_page {
-    uint32_t flags; ///< The attributes of the page (free, occupied, etc..)
-    uint32_t ref_count; ///< The number of references to the page (once it hits zero we can free it)
-    uint32_t order; ///< The dimension of the page size
-    struct double_ll_node link; ///< The link to our free areas list
+    uint32_t info; ///< Flags, order and reference count packed together (look at PMM_INFO_*)
+    uint32_t next; ///< PFN of the next page in the list, PMM_PFN_NONE if it's the last
+    uint32_t prev; ///< PFN of the previous page in the list, PMM_PFN_NONE if it's the first
+};
+
+/**
+ * @brief A list of pages linked through their PFNs
+ */
+struct pmm_list {
+    uint32_t head; ///< PFN of the first page, PMM_PFN_NONE if the list is empty
+    uint32_t tail; ///< PFN of the last page, PMM_PFN_NONE if the list is empty
 };
 
 /**
@@ -36,17 +110,146 @@ struct pmm_page {
  * It provides an head to the first node and how many there are
  */
 struct free_area {
-    struct double_ll_node head; ///< List of free pages of x order
+    struct pmm_list list; ///< List of free pages of x order
     uint64_t nr_free; ///< How many free blocks do we have
 };
 
+/**
+ * @brief The physical memory zones, every zone can fall back to the ones below it
+ * The zone boundaries are aligned to the biggest buddy block so a block never straddles two zones
+ */
+enum pmm_zone_type {
+    PMM_ZONE_DMA,    ///< Below 16MB, for legacy ISA DMA
+    PMM_ZONE_DMA32,  ///< Below 4GB, for devices with 32 bit DMA
+    PMM_ZONE_NORMAL, ///< Everything else
+    PMM_NR_ZONES
+};
+
+/**
+ * @brief A zone of physical memory with its own buddy lists, watermarks and statistics
+ */
+struct pmm_zone {
+    const char *name; ///< Name of the zone, used for debugging
+    uint32_t node; ///< The NUMA node the zone belongs to
+    uint64_t start_pfn; ///< The first page the zone spans
+    uint64_t end_pfn; ///< The first page after the zone, pages of other nodes may sit in between
+
+    struct free_area free_areas[PMM_MAX_ORDER]; ///< The free lists of each order
+    uint32_t free_area_mask; ///< Bit x is set when free_areas[x] has at least one block
+
+    uint64_t present_pages; ///< Usable pages inside the zone
+    uint64_t free_pages; ///< Pages sitting in the free lists of the zone
+
+    uint64_t watermark_min; ///< Below this only allocations for this exact zone succeed
+    uint64_t watermark_low; ///< Allocations for this zone try to stay above it
+    uint64_t watermark_high; ///< Allocations falling back from a higher zone stay above it
+
+    uint64_t allocs; ///< Blocks allocated from this zone
+    uint64_t fallbacks; ///< Blocks allocated from this zone on behalf of a higher one
+    uint64_t failures; ///< Allocations for this zone that failed
+};
+
+/**
+ * @brief Per-node allocation statistics
+ */
+struct pmm_node {
+    uint64_t present_pages; ///< Usable pages on the node
+    uint64_t hits; ///< Allocations meant for this node that got memory from it
+    uint64_t misses; ///< Allocations served by this node that were meant for another one
+    uint64_t foreign; ///< Allocations meant for this node that got memory from another one
+    uint64_t interleave; ///< Allocations that picked this node by interleaving
+};
+
+/**
+ * @brief A per-CPU cache of order 0 pages in front of the buddy lists
+ * The head of the list holds hot pages (just freed, likely still in the CPU cache)
+ * while the tail holds cold ones. Refills append to the tail and drains take from it,
+ * so the single page alloc/free path never touches the buddy lock
+ */
+struct pmm_pcp {
+    struct pmm_list list; ///< The cached pages, hot at the head and cold at the tail
+    uint64_t count; ///< How many pages are cached
+    uint64_t hits; ///< Allocations served without touching the buddy lists
+    uint64_t refills; ///< How many batches took at least a page from the buddy lists
+    uint64_t drains; ///< How many batches gave at least a page back to the buddy lists
+};
+
+/**
+ * @brief Order 0 pages zeroed ahead of time while the CPU is idle
+ * so that page faults and page table allocations skip the memset
+ */
+struct pmm_zero_pool {
+    struct pmm_list list; ///< The zeroed pages
+    uint64_t count; ///< How many pages are in the pool
+    uint64_t hits; ///< Zeroed allocations served from the pool
+    uint64_t misses; ///< Zeroed allocations that had to memset on the spot
+    uint64_t zeroed; ///< How many pages the idle thread zeroed
+};
+
+/**
+ * @brief A range of usable RAM in page frame numbers, [start_pfn, end_pfn)
+ */
+struct pmm_range {
+    uint64_t start_pfn; ///< The first page of the range
+    uint64_t end_pfn; ///< The first page after the range
+};
+
+/**
+ * @brief The memory handed out to a single caller, recorded when PMM_TRACE is on
+ */
+struct pmm_trace_entry {
+    void *caller; ///< The return address of the allocation call, NULL for a free slot. First, as the callsite table wants
+    int64_t live_bytes; ///< How many bytes it holds right now
+    uint64_t allocs; ///< How many allocations it made
+    uint64_t frees; ///< How many of them were freed
+};
+
+/**
+ * @brief Something holding memory it can give back when the allocator runs low
+ * (heap trimming, caches...). The callbacks run from the reclaim thread, from an allocation
+ * that failed or from the page fault handler with interrupts disabled: they must not sleep
+ */
+struct pmm_shrinker {
+    const char *name; ///< Name of the shrinker, used for debugging
+    uint64_t (*count)(void); ///< How many pages it could free right now
+    uint64_t (*scan)(uint64_t nr_pages); ///< Frees up to nr_pages, returns how many it freed
+    uint64_t freed; ///< How many pages it gave back so far
+    struct pmm_shrinker *next; ///< The next registered shrinker
+};
+
 void pmm_init();
+uint64_t pmm_alloc_pages(uint32_t order);
+uint64_t pmm_alloc_pages_zone(uint32_t order, enum pmm_zone_type zone);
+uint64_t pmm_alloc_pages_policy(uint32_t order, enum pmm_zone_type zone, struct numa_policy *policy);
+void pmm_free_pages(uint64_t phys, uint32_t order);
+uint64_t pmm_alloc_bulk(uint64_t nr_pages, uint64_t *pages, struct numa_policy *policy);
+void pmm_free_bulk(uint64_t *pages, uint64_t nr_pages);
 uint64_t pmm_alloc(uint64_t size);
+uint64_t pmm_alloc_zeroed(struct numa_policy *policy);
+uint64_t pmm_zero_pool_refill(uint64_t max_pages);
 void pmm_free(uint64_t physAddr, uint64_t length);
+void pmm_free_addr(uint64_t phys);
+uint64_t pmm_alloc_contig(uint64_t nr_pages, uint64_t align_pages, enum pmm_zone_type zone);
+void pmm_free_contig(uint64_t phys);
+void pmm_register_migrator(uint64_t (*migrate)(uint64_t start_phys, uint64_t end_phys));
+void pmm_page_set_movable(uint64_t phys);
+bool pmm_page_is_movable(uint64_t phys);
+bool pmm_compact(uint32_t order, enum pmm_zone_type zone);
+bool pmm_compact_idle(void);
 uint64_t pmm_getHighestAddr(void);
 void pmm_page_inc_ref(uint64_t phys);
 void pmm_page_dec_ref(uint64_t phys);
 void pmm_dump_state(void);
 void pmm_printUsableRegions();
+void pmm_benchmark(uint64_t iterations);
+uint64_t pmm_get_init_cycles(void);
+void pmm_start_deferred_init(void);
+void pmm_reclaim_boot_memory(void);
+void pmm_register_shrinker(struct pmm_shrinker *shrinker);
+void pmm_unregister_shrinker(struct pmm_shrinker *shrinker);
+uint64_t pmm_reclaim(uint64_t nr_pages);
+uint64_t pmm_try_reclaim(uint64_t nr_pages);
+void pmm_start_reclaim_thread(void);
+void pmm_trace_dump(void);
 
 #endif // PMM_H
\ No newline at end of file
@@ -0,0 +1,129 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <common/dll.h>
+#include <scheduling/lock.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SLAB_ORDER          2 ///< Every slab is 2^2 pages (16KB) and aligned to its size, objects find their slab by masking
+#define SLAB_SIZE           (4096ULL << SLAB_ORDER)
+#define SLAB_ALIGN          16 ///< Objects are aligned at least to this, like the rest of the heap
+#define SLAB_MIN_SIZE       16 ///< The smallest size class
+#define SLAB_MAX_SIZE       2048 ///< Bigger requests go to the list allocator
+#define SLAB_NR_CLASSES     14 ///< 16, 32, 48, 64, 96 ... 1536, 2048
+#define SLAB_MAX_EMPTY      1 ///< How many empty slabs a cache keeps before giving pages back to the pmm
+#define SLAB_MAGIC          0x51AB51AB
+#define KMEM_CACHE_LINE     64 ///< Objects of named caches that don't ask for an alignment get a cache line each
+#define SLAB_MAX_CPUS       1 ///< CPUs with their own magazines, until SMP lands every context runs on the boot CPU
+#define SLAB_MAGAZINE_SIZE  14 ///< Objects in a magazine, so that a magazine is 128 bytes
+#define SLAB_RESERVE_BLOCKS  4 ///< Slab sized blocks every CPU keeps for atomic allocations when the pmm runs out
+#define SLAB_RESERVE_RETRY_MS 100 ///< How long a reserve that couldn't be filled waits before trying again
+#define SLAB_DEPOT_MAX_FULL  8 ///< How many full magazines a depot keeps, the others give their objects back to the slabs
+#define SLAB_DEPOT_MAX_EMPTY 4 ///< How many empty magazines a depot keeps, the others are freed
+
+/**
+ * @name Allocation flags
+ * Tell kmalloc and the caches whether the caller can sleep
+ * @{
+ */
+#define KMALLOC_FLAGS_SLEEP     (1ull << 0) ///< May sleep on the heap lock or to reclaim memory, what kmalloc does
+#define KMALLOC_FLAGS_ATOMIC    (1ull << 1) ///< Never sleeps, for interrupt handlers and spinlock holders. May use the emergency reserve
+/** @} */
+
+/**
+ * @brief The header at the start of every slab
+ * The objects follow it, the free ones are linked through a pointer at free_offset
+ */
+struct slab
+{
+    struct double_ll_node node; ///< Links the slab in the partial list of its cache, has to stay the first field
+    uint32_t magic; ///< SLAB_MAGIC, catches frees of pointers that aren't slab objects
+    uint32_t inuse; ///< How many objects are allocated
+    struct kmem_cache *cache; ///< The cache the slab belongs to
+    void *freelist; ///< The first free object
+};
+
+/**
+ * @brief A stack of free objects, loaded in a CPU or sitting in the depot of its cache
+ */
+struct slab_magazine
+{
+    uint64_t rounds; ///< How many objects are loaded
+    struct slab_magazine *next; ///< The next magazine in the depot
+    void *objects[SLAB_MAGAZINE_SIZE]; ///< The objects, the last one freed is the first one allocated
+};
+
+/**
+ * @brief The magazines of a cache for a single CPU
+ * Allocations and frees use them with interrupts disabled and without any lock,
+ * the depot is locked only to exchange a whole magazine
+ */
+struct kmem_cpu_cache
+{
+    struct slab_magazine *loaded; ///< Every allocation and free starts from this one
+    struct slab_magazine *previous; ///< Always full or empty, swapped with the loaded one before going to the depot
+    uint64_t hits; ///< Allocations and frees served by the magazines
+};
+
+/**
+ * @brief Slab sized blocks put aside for a CPU
+ * Atomic allocations can't wait for the pmm to reclaim memory, when it has none
+ * they build their slabs from here. Once it was used, a sleeping allocation fills it back up
+ */
+struct slab_reserve
+{
+    uint64_t blocks[SLAB_RESERVE_BLOCKS]; ///< Physical addresses of the blocks, aligned to SLAB_SIZE
+    uint64_t count; ///< How many blocks are left
+    uint64_t hits; ///< How many slabs were built from the reserve
+    bool used; ///< A block was taken (or a refill failed) since the reserve was last full
+    uint64_t retry_ms; ///< A refill that failed isn't tried again before this uptime
+};
+
+/**
+ * @brief A cache of objects of the same size
+ * Only slabs with at least a free object are linked, the ones that
+ * still have allocated objects come first so that empty slabs can be freed.
+ * The constructor runs once per object when its slab is created, not on every allocation:
+ * objects have to be given back in their constructed state.
+ * Freed objects go in the magazines of the CPU first, the slabs see them only
+ * when the magazines overflow or the cache is shrunk
+ */
+struct kmem_cache
+{
+    const char *name; ///< Name of the cache, used for debugging
+    uint32_t object_size; ///< The size asked by the creator of the cache
+    uint32_t stride; ///< Distance between two objects, the size rounded up to the alignment
+    uint32_t offset; ///< Where the first object starts, the header rounded up to the alignment
+    uint32_t free_offset; ///< Where the free list pointer lives inside a free object
+    uint32_t objects_per_slab; ///< How many objects fit in a slab
+    void (*ctor)(void *object); ///< Optional, initializes the objects of a new slab
+    struct double_ll_node partial; ///< Slabs with free objects, empty ones at the tail
+    uint64_t nr_slabs; ///< How many slabs the cache owns
+    uint64_t nr_empty; ///< How many of them have no allocated object
+    uint64_t allocs; ///< How many objects were allocated
+    uint64_t frees; ///< How many objects were freed
+    struct spinlock_irq lock; ///< Protects the slabs and the depot of the cache
+    bool use_magazines; ///< False only for the cache of the magazines themselves
+    struct kmem_cpu_cache cpu[SLAB_MAX_CPUS]; ///< The magazines of every CPU
+    struct slab_magazine *depot_full; ///< Full magazines given back by the CPUs
+    struct slab_magazine *depot_empty; ///< Empty magazines given back by the CPUs
+    uint64_t depot_nr_full; ///< How many full magazines are in the depot
+    uint64_t depot_nr_empty; ///< How many empty magazines are in the depot
+    struct kmem_cache *next; ///< Next cache in the list of every cache
+};
+
+void slab_init(void);
+void *slab_alloc(size_t size, uint64_t flags);
+void *slab_alloc_aligned(size_t size, size_t align, uint64_t flags);
+void slab_free(void *ptr);
+size_t slab_object_size(void *ptr);
+void slab_print_caches(void);
+void slab_get_usage(uint64_t *resident_bytes, uint64_t *live_bytes);
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *object));
+void *kmem_cache_alloc(struct kmem_cache *cache, uint64_t flags);
+void kmem_cache_free(struct kmem_cache *cache, void *object);
+
+#endif // SLAB_H
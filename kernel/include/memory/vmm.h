@@ -2,6 +2,7 @@
 #define VMM_H
 
 #include <interrupts/isr.h>
+#include <memory/numa.h>
 #include <scheduling/lock.h>
 #include <stdint.h>
 
@@ -17,6 +18,10 @@
 #define VMM_KERNEL_END (0xFFFFFFFF80000000 - 1)
 /** @} */
 
+#define VMM_HUGE_PAGE_ORDER 9 ///< A 2MB page is a block of this order in the pmm
+#define VMM_BENCH_BURST 64 ///< How many areas vmm_benchmark keeps allocated at once
+#define VMM_MIGRATE_SCAN 512 ///< How many ptes the migrator checks before it drops its locks for a moment
+
 /**
  * @name VMM Flags
  * Flags for each VAS area
@@ -31,6 +36,8 @@
 #define VMM_FLAGS_MMIO      (1ull << 5)     ///< Memory mapped I/O in this page
 #define VMM_FLAGS_WC        (1ull << 6)     ///< For write combine cache (useful for framebuffers)
 #define VMM_FLAGS_UC        (1ull << 7)     ///< For uncacheable pages (eg. MMIO)
+#define VMM_FLAGS_POPULATE  (1ull << 8)     ///< Anonymous pages are mapped right away instead of on the first fault
+#define VMM_FLAGS_HUGE      (1ull << 9)     ///< Anonymous area aligned to 2MB and backed by 2MB pages where possible, implies VMM_FLAGS_POPULATE
 /** @} */
 
 /**
@@ -53,6 +60,8 @@ struct vm_address_space {
     uint64_t *pml4_phys; ///< The pointer to the pml4 table for this VAS
     struct vm_area *region_list; ///< List of the regions
     struct spinlock_irq lock; ///< The lock of the address space
+    struct numa_policy policy; ///< Which NUMA node the pages of demand faults come from
+    struct vm_address_space *next; ///< The next address space, the migrator walks all of them
 };
 
 void vmm_init(void);
@@ -63,10 +72,13 @@ void vmm_switch_address_space(struct vm_address_space *space);
 
 void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, uint64_t arg);
 void vmm_free(struct vm_address_space *space, uint64_t addr);
+uint64_t vmm_get_area_size(struct vm_address_space *space, uint64_t addr);
 
 struct vm_address_space* vmm_get_kernel_vas(void);
 uint64_t vmm_generic_to_x86_flags(uint64_t genericFlags);
 
 void vmm_page_fault_handler(struct cpu_status *context);
 
+void vmm_benchmark(uint64_t iterations);
+
 #endif // VMM_H
\ No newline at end of file
@@ -4,6 +4,38 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/**
+ * @brief Disables interrupts on the current CPU
+ * @return uint64_t The previous RFLAGS, to be passed to interrupts_restore
+ */
+static inline uint64_t interrupts_save_and_disable(void)
+{
+    uint64_t flags;
+    asm volatile (
+        "pushfq\n\t"        // push RFLAGS
+        "pop %0\n\t"        // pop RFLAGS in flags
+        "cli"               // Disables interrupts
+        : "=r" (flags)
+        :
+        : "memory"
+    );
+    return flags;
+}
+
+/**
+ * @brief Restores the interrupt state saved by interrupts_save_and_disable
+ * @param flags The RFLAGS returned by interrupts_save_and_disable
+ */
+static inline void interrupts_restore(uint64_t flags)
+{
+    asm volatile (
+        "push %0\n\t"       // push the old RFLAGS
+        "popfq"             // pops into RFLAGS
+        :
+        : "r" (flags)
+        : "memory", "cc"
+    );
+}
 
 /**
  * @brief A ticket lock safe to use inside ISRs
@@ -39,6 +71,7 @@ struct mutex
 #define MUTEX_INIT {false, SPINLOCK_IRQ_INIT, NULL, NULL}
 
 void mutex_acquire(struct mutex *mutex);
+bool mutex_try_acquire(struct mutex *mutex);
 void mutex_release(struct mutex *mutex);
 
 #endif // LOCK_H
\ No newline at end of file
@@ -55,6 +55,7 @@ struct thread
     struct thread *next_waiter; ///< Pointer to the next blocked thread
 };
 
+void task_init_caches(void);
 struct task *task_create(const char *name);
 struct thread *task_create_thread(struct task *task, void (*entry_point)());
 
@@ -65,5 +66,6 @@ __attribute__((noreturn))
 void kernel_idle_thread();
 
 void thread_sleep(uint64_t ms);
+void thread_wake(struct thread *thread);
 
 #endif // TASK_H
\ No newline at end of file
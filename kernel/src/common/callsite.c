@@ -0,0 +1,95 @@
+#include <common/callsite.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Returns the entry at a slot
+ *
+ * @param table The table
+ * @param slot A slot returned by callsite_slot or callsite_next_top
+ * @return void* The entry, its first field is the caller
+ */
+void *callsite_entry(struct callsite_table *table, uint32_t slot)
+{
+    return (uint8_t *)table->entries + (uint64_t)slot * table->entry_size;
+}
+
+// The caller of an entry, NULL if the entry is free
+static inline void *callsite_caller(struct callsite_table *table, uint32_t slot)
+{
+    return __atomic_load_n((void **)callsite_entry(table, slot), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Finds the slot of a caller, claiming a free one the first time
+ * It doesn't take locks, so it can be used from any context
+ *
+ * @param table The table
+ * @param caller The return address of the call
+ * @return uint32_t The slot, CALLSITE_NONE if the neighbourhood of the caller is full
+ */
+uint32_t callsite_slot(struct callsite_table *table, void *caller)
+{
+    uint32_t mask = (1U << table->shift) - 1;
+    uint32_t slot = ((uint64_t)caller * 0x9E3779B97F4A7C15ULL) >> (64 - table->shift);
+
+    for(uint32_t i = 0; i < table->probes; i++, slot = (slot + 1) & mask)
+    {
+        void **entry = callsite_entry(table, slot);
+        void *current = __atomic_load_n(entry, __ATOMIC_RELAXED);
+        if(current == caller) return slot;
+
+        // Someone else may claim it first, maybe for the same caller
+        if(!current && (__atomic_compare_exchange_n(entry, &current, caller, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+            || current == caller)) return slot;
+    }
+
+    return CALLSITE_NONE;
+}
+
+/**
+ * @brief Counts the claimed entries
+ *
+ * @param table The table
+ * @return uint32_t How many callers the table holds
+ */
+uint32_t callsite_count(struct callsite_table *table)
+{
+    uint32_t callers = 0;
+    for(uint32_t i = 0; i < (1U << table->shift); i++) if(callsite_caller(table, i)) callers++;
+    return callers;
+}
+
+/**
+ * @brief Visits the claimed entries from the biggest key down, equal keys by slot
+ * Each call walks the whole table, it's meant for dumps of the top few callers
+ *
+ * @param table The table
+ * @param key Returns the value entries are sorted by
+ * @param previous The slot visited last, CALLSITE_NONE to start from the biggest
+ * @return uint32_t The next slot, CALLSITE_NONE when every entry was visited
+ * @note The counters keep changing while we read them, an entry may be skipped or seen twice
+ */
+uint32_t callsite_next_top(struct callsite_table *table, int64_t (*key)(const void *entry), uint32_t previous)
+{
+    int64_t previous_key = previous == CALLSITE_NONE ? 0 : key(callsite_entry(table, previous));
+    uint32_t best = CALLSITE_NONE;
+    int64_t best_key = 0;
+
+    for(uint32_t i = 0; i < (1U << table->shift); i++)
+    {
+        if(!callsite_caller(table, i)) continue;
+
+        // Only what comes after the previous entry in the order
+        int64_t current = key(callsite_entry(table, i));
+        if(previous != CALLSITE_NONE && (current > previous_key || (current == previous_key && i <= previous))) continue;
+
+        if(best == CALLSITE_NONE || current > best_key)
+        {
+            best = i;
+            best_key = current;
+        }
+    }
+
+    return best;
+}
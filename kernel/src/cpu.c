@@ -12,6 +12,25 @@ __attribute__((noreturn)) void hcf(void)
     }
 }
 
+/**
+ * @brief Moves execution to a new stack, the old one is abandoned
+ * 
+ * @param stack_top The top of the new stack, aligned to 16 bytes
+ * @param entry The function to continue in, it must never return
+ */
+__attribute__((noreturn)) void cpu_switch_stack(uint64_t stack_top, void (*entry)(void))
+{
+    asm volatile(
+        "mov %0, %%rsp\n\t"    // Switch to the new stack
+        "xor %%rbp, %%rbp\n\t" // Terminate the frame chain
+        "call *%1"
+        :
+        : "r" (stack_top), "r" (entry)
+        : "memory"
+    );
+    __builtin_unreachable();
+}
+
 // Reads from a Model Specific Register (MSR)
 inline uint64_t cpu_rdmsr(uint32_t msr_index) {
     uint32_t low, high;
@@ -56,6 +75,12 @@ void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, ui
     if (edx) *edx = rdx;
 }
 
+// Writes back and invalidates every cache, benchmarks use it to start cold
+void cpu_flush_caches(void)
+{
+    asm volatile("wbinvd" ::: "memory");
+}
+
 inline uint64_t read_cr4() 
 {
     uint64_t val;
@@ -124,6 +124,27 @@ uint64_t timer_get_uptime_ms()
     return diff / (tsc_freq_hz / 1000);
 }
 
+/**
+ * @brief Reads the raw TSC, usable even before timer_init calibrated it
+ * 
+ * @return uint64_t The current TSC value in cycles
+ */
+uint64_t timer_read_tsc(void)
+{
+    return rdtsc();
+}
+
+/**
+ * @brief Converts a TSC cycle count into microseconds
+ * 
+ * @param cycles The number of TSC cycles
+ * @return uint64_t The microseconds, 0 if the TSC is not calibrated yet
+ */
+uint64_t timer_tsc_to_us(uint64_t cycles)
+{
+    if(tsc_freq_hz < 1000000) return 0;
+    return cycles / (tsc_freq_hz / 1000000);
+}
 
 extern struct thread *thread_current;
 /**
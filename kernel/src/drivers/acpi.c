@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <drivers/acpi.h>
 #include <memory/hhdm.h>
+#include <memory/kheap.h>
 #include <libk/string.h>
 
 extern struct limine_rsdp_request rsdp_request;
@@ -13,6 +14,10 @@ static bool useXSDT = false;
 static struct RSDT *rsdt = NULL;
 static struct XSDT *xsdt = NULL;
 
+// Heap copies of the tables, filled by acpi_copy_tables
+static struct ACPISDTHeader **tables = NULL;
+static size_t nr_tables = 0;
+
 static bool validate_checksum(uint8_t *byte_array, size_t size) {
     uint32_t sum = 0;
     for(size_t i = 0; i < size; i++) {
@@ -75,7 +80,17 @@ void acpi_init()
  */
 void *acpi_find_table(const char *signature)
 {
-    if(!rsdt || !xsdt) return NULL;
+    if(tables)
+    {
+        for(size_t i = 0; i < nr_tables; i++)
+        {
+            if(strncmp(tables[i]->Signature, signature, 4) == 0) return tables[i];
+        }
+
+        return NULL;
+    }
+
+    if(!rsdt && !xsdt) return NULL;
 
     // Calculate the number of entries
     size_t numEntries;
@@ -98,4 +113,56 @@ void *acpi_find_table(const char *signature)
     }
 
     return NULL;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Copies every table listed in the RSDT/XSDT to the heap
+ * After this the firmware copies are never touched again, so the
+ * ACPI reclaimable memory can be given to the pmm
+ * @note The kernel heap has to be initialized, acpi_find_table returns the copies afterwards
+ */
+void acpi_copy_tables(void)
+{
+    if(!rsdt && !xsdt) return;
+
+    size_t numEntries;
+    if(useXSDT)
+        numEntries = (xsdt->sdtHeader.Length - sizeof(struct ACPISDTHeader)) / 8;
+    else 
+        numEntries = (rsdt->sdtHeader.Length - sizeof(struct ACPISDTHeader)) / 4;
+
+    if(numEntries == 0) return;
+
+    struct ACPISDTHeader **copies = kmalloc(numEntries * sizeof(struct ACPISDTHeader *));
+    if(!copies)
+    {
+        log_line(LOG_ERROR, "%s: Cannot allocate the table list", __FUNCTION__);
+        hcf();
+    }
+
+    size_t totalSize = 0;
+    for(size_t i = 0; i < numEntries; i++)
+    {
+        uint64_t physAddr = (useXSDT ? xsdt->sdtAddresses[i] : (uint64_t)rsdt->sdtAddresses[i]);
+        struct ACPISDTHeader *currentTable = hhdm_physToVirt((void *)physAddr);
+
+        copies[i] = kmalloc(currentTable->Length);
+        if(!copies[i])
+        {
+            log_line(LOG_ERROR, "%s: Cannot copy the %.4s table", __FUNCTION__, currentTable->Signature);
+            hcf();
+        }
+
+        memcpy(copies[i], currentTable, currentTable->Length);
+        totalSize += currentTable->Length;
+    }
+
+    tables = copies;
+    nr_tables = numEntries;
+
+    // From now on only the copies are used
+    rsdt = NULL;
+    xsdt = NULL;
+
+    log_line(LOG_SUCCESS, "%s: Copied %llu tables (%llu bytes)", __FUNCTION__, (uint64_t)numEntries, (uint64_t)totalSize);
+}
@@ -3,6 +3,7 @@
 #include <drivers/lapic.h>
 #include <flanterm.h>
 #include <memory/kheap.h>
+#include <memory/numa.h>
 #include <memory/paging.h>
 #include <memory/vmm.h>
 #include <scheduling/scheduler.h>
@@ -22,6 +23,8 @@
 #include <libk/stdio.h>
 #include <scheduling/lock.h>
 
+#define KERNEL_BENCHMARKS 0 ///< Set to 1 to run the allocator benchmarks at boot, they churn a lot of memory
+
 extern struct task *task_current;
 extern struct thread *thread_current;
 
@@ -73,16 +76,70 @@ void stress_test_worker()
     // L'Idle Thread si sveglierà e farà il Reaper testando un'ultima volta i Lock!
 }
 
+/**
+ * @brief The second half of the boot, running on a kernel owned stack
+ * Everything the bootloader left in reclaimable memory is gone from here on
+ */
+static __attribute__((noreturn)) void kmain_late(void)
+{
+    // The bootloader stack, page tables and responses aren't used anymore
+    pmm_reclaim_boot_memory();
+
+    scheduler_init();
+
+    // Frees memory in the background when a zone runs low
+    pmm_start_reclaim_thread();
+
+    // The rest of the memmap is initialized in the background
+    pmm_start_deferred_init();
+
+   /**************************** TEST ******************************/
+#if KERNEL_BENCHMARKS
+   pmm_benchmark(10000);
+   vmm_benchmark(10000);
+   kheap_benchmark(1000);
+#endif
+   kheap_print_usage();
+   kheap_profile_dump();
+
+   log_line(LOG_DEBUG, "Avvio Stress Test Concorrenza...");
+
+   // Creiamo il Processo A e gli diamo 3 thread
+   struct task *process_a = task_create("Processo A");
+   task_create_thread(process_a, stress_test_worker);
+   task_create_thread(process_a, stress_test_worker);
+   task_create_thread(process_a, stress_test_worker);
+
+   // Creiamo il Processo B e gli diamo 3 thread
+   struct task *process_b = task_create("Processo B");
+   task_create_thread(process_b, stress_test_worker);
+   task_create_thread(process_b, stress_test_worker);
+   task_create_thread(process_b, stress_test_worker);
+   /**************************** END TEST ******************************/
+    
+    asm volatile ("sti");
+
+    kernel_idle_thread();
+}
+
 // This is our kernel's entry point.
 void kmain(void) {
 
     limine_verify_requests();
+
+    // Cache what we need from the bootloader responses
+    hhdm_init();
     
     // Global descriptor table
     gdt_init();
     // Interrupt descriptor table
     idt_init();
 
+    // The ACPI tables are reachable through the bootloader HHDM,
+    // the PMM needs them to know which memory belongs to which NUMA node
+    acpi_init();
+    numa_init();
+
     // Physical memory manager initialization
     pmm_printUsableRegions();
     pmm_init();
@@ -99,30 +156,26 @@ void kmain(void) {
     
     console_init();
 
-    acpi_init();
     lapic_initialize();
 
     timer_init();
+    // The TSC is calibrated only now, so we can tell how long the PMM took to boot
+    log_line(LOG_DEBUG, "pmm_init took %llu us", timer_tsc_to_us(pmm_get_init_cycles()));
 
-    scheduler_init();
+    // Keep our own copy of the ACPI tables, the firmware ones are about to be reclaimed
+    acpi_copy_tables();
 
-   /**************************** TEST ******************************/
-   log_line(LOG_DEBUG, "Avvio Stress Test Concorrenza...");
+    // We're still on the stack the bootloader gave us, move to one of ours
+    void *boot_stack = vmm_alloc(vmm_get_kernel_vas(),
+        THREAD_INITIAL_STACK_SIZE,
+        VMM_FLAGS_READ | VMM_FLAGS_WRITE | VMM_FLAGS_ANON | VMM_FLAGS_POPULATE,
+        false);
 
-   // Creiamo il Processo A e gli diamo 3 thread
-   struct task *process_a = task_create("Processo A");
-   task_create_thread(process_a, stress_test_worker);
-   task_create_thread(process_a, stress_test_worker);
-   task_create_thread(process_a, stress_test_worker);
-
-   // Creiamo il Processo B e gli diamo 3 thread
-   struct task *process_b = task_create("Processo B");
-   task_create_thread(process_b, stress_test_worker);
-   task_create_thread(process_b, stress_test_worker);
-   task_create_thread(process_b, stress_test_worker);
-   /**************************** END TEST ******************************/
-    
-    asm volatile ("sti");
+    if(!boot_stack)
+    {
+        log_line(LOG_ERROR, "%s: Cannot allocate the kernel stack", __FUNCTION__);
+        hcf();
+    }
 
-    kernel_idle_thread();
-}
\ No newline at end of file
+    cpu_switch_stack((uint64_t)boot_stack + THREAD_INITIAL_STACK_SIZE, kmain_late);
+}
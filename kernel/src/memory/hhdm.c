@@ -5,6 +5,18 @@
 
 extern struct limine_hhdm_request hhdm_request;
 
+// The limine response lives in bootloader reclaimable memory, so we keep our own copy
+static uint64_t hhdm_offset = 0;
+
+/**
+ * @brief Caches the hhdm offset given by the bootloader
+ * @note Has to be called before any other hhdm function
+ */
+void hhdm_init(void)
+{
+    hhdm_offset = hhdm_request.response->offset;
+}
+
 /**
  * @brief Converts a physical address to a virtual one in the hhdm region
  * Essentially the full RAM is direct mapped into the VAS (since it's so large).
@@ -15,7 +27,7 @@ extern struct limine_hhdm_request hhdm_request;
  */
 void* hhdm_physToVirt(void *physical_addr)
 {
-    return (void *)((uint64_t )physical_addr + hhdm_request.response->offset);
+    return (void *)((uint64_t )physical_addr + hhdm_offset);
 }
 
 /**
@@ -26,5 +38,5 @@ void* hhdm_physToVirt(void *physical_addr)
  */
 void* hhdm_virtToPhys(void *virtual_addr)
 {
-    return (void *)((uint64_t )virtual_addr - hhdm_request.response->offset);
+    return (void *)((uint64_t )virtual_addr - hhdm_offset);
 }
\ No newline at end of file
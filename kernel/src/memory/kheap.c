@@ -1,21 +1,317 @@
+#include <common/callsite.h>
 #include <common/logging.h>
 #include <cpu.h>
+#include <devices/timer.h>
+#include <drivers/serial.h>
+#include <libk/string.h>
 #include <memory/hhdm.h>
 #include <memory/kheap.h>
 #include <memory/pmm.h>
 #include <memory/paging.h>
+#include <memory/slab.h>
+#include <memory/vmm.h>
 #include <scheduling/lock.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-// This is a basic implementation of a linked list allocator 
+// Small objects come from the slab caches, this linked list allocator serves the big ones
 
 static uint64_t kheap_start, kheap_end;
-static struct kheap_node *kheap_head;
+
+// The free regions by size, bit i of the bitmap is set if list i isn't empty
+static struct kheap_node *kheap_free_lists[KHEAP_NR_LISTS];
+static uint32_t kheap_free_bitmap;
 
 static struct mutex kheap_lock = MUTEX_INIT;
 
+// How many pages back the heap, and how much of it is allocated
+static uint64_t kheap_mapped_pages = 0, kheap_live_bytes = 0, kheap_live_objects = 0;
+
+// Bytes freed since the last trim, and how many pages trimming gave back overall
+static uint64_t kheap_untrimmed_bytes = 0, kheap_trimmed_pages = 0;
+
+// Large allocations are areas of the kernel address space, they don't take the heap lock
+static uint64_t kheap_large_bytes = 0, kheap_large_objects = 0;
+
+// Regions freed by callers that couldn't sleep while the heap lock was busy
+static void *volatile kheap_deferred = NULL;
+static struct spinlock_irq kheap_deferred_lock = SPINLOCK_IRQ_INIT;
+
+// What every region costs on top of its size
+#define KHEAP_OVERHEAD (2 * sizeof(struct kheap_node))
+
+// The links of a free region
+static inline struct kheap_free_links *kheap_links(struct kheap_node *node)
+{
+    return (struct kheap_free_links *)(node + 1);
+}
+
+// The copy of the header at the end of a region
+static inline struct kheap_node *kheap_footer(struct kheap_node *node)
+{
+    return (struct kheap_node *)((uint8_t *)(node + 1) + node->size);
+}
+
+// The region that follows in memory, NULL if it's the last one
+static inline struct kheap_node *kheap_next(struct kheap_node *node)
+{
+    uint64_t next = (uint64_t)node + node->size + KHEAP_OVERHEAD;
+    return next < kheap_end ? (struct kheap_node *)next : NULL;
+}
+
+// The region that ends at addr, found through its footer. NULL if addr is the start of the heap
+static inline struct kheap_node *kheap_region_before(uint64_t addr)
+{
+    if(addr <= kheap_start) return NULL;
+    struct kheap_node *footer = (struct kheap_node *)addr - 1;
+    return (struct kheap_node *)(addr - footer->size - KHEAP_OVERHEAD);
+}
+
+// Writes the header and the footer of a region
+static inline void kheap_set_region(struct kheap_node *node, uint64_t size, bool isFree, bool trimmed)
+{
+    node->size = size;
+    node->isFree = isFree;
+    node->trimmed = trimmed;
+    *kheap_footer(node) = *node;
+}
+
+// The free list of a size, the last one takes every bigger region
+static inline uint32_t kheap_list_index(uint64_t size)
+{
+    uint32_t index = 63 - __builtin_clzll(size | KHEAP_MIN_SPLITTING_SIZE) - 4;
+    return index < KHEAP_NR_LISTS ? index : KHEAP_NR_LISTS - 1;
+}
+
+// Puts a free region at the head of its list
+static void kheap_insert_free(struct kheap_node *node)
+{
+    uint32_t index = kheap_list_index(node->size);
+    struct kheap_free_links *links = kheap_links(node);
+
+    links->prev = NULL;
+    links->next = kheap_free_lists[index];
+    if(links->next) kheap_links(links->next)->prev = node;
+
+    kheap_free_lists[index] = node;
+    kheap_free_bitmap |= 1U << index;
+}
+
+// Takes a free region out of its list
+static void kheap_remove_free(struct kheap_node *node)
+{
+    uint32_t index = kheap_list_index(node->size);
+    struct kheap_free_links *links = kheap_links(node);
+
+    if(links->prev) kheap_links(links->prev)->next = links->next;
+    else kheap_free_lists[index] = links->next;
+    if(links->next) kheap_links(links->next)->prev = links->prev;
+
+    if(!kheap_free_lists[index]) kheap_free_bitmap &= ~(1U << index);
+}
+
+/**
+ * @brief Finds a free region big enough, without looking at the allocated ones
+ * The list of the size may have smaller regions so only a few of them are tried,
+ * then the first region of the next non empty list is taken since every one of them fits
+ * @param size The size we need
+ * @return struct kheap_node* The region, still in its list. NULL if none fits
+ */
+static struct kheap_node *kheap_find_free(uint64_t size)
+{
+    uint32_t index = kheap_list_index(size);
+
+    struct kheap_node *node = kheap_free_lists[index];
+    for(uint32_t i = 0; node && i < KHEAP_FIT_PROBES; i++, node = kheap_links(node)->next)
+    {
+        if(node->size >= size) return node;
+    }
+
+    uint32_t bigger = index + 1 < KHEAP_NR_LISTS ? kheap_free_bitmap & ~((2U << index) - 1) : 0;
+    if(bigger) return kheap_free_lists[__builtin_ctz(bigger)];
+
+    // The last list has no upper bound, all its regions may be too small
+    if(index == KHEAP_NR_LISTS - 1)
+    {
+        for(; node; node = kheap_links(node)->next)
+        {
+            if(node->size >= size) return node;
+        }
+    }
+
+    return NULL;
+}
+
+// Heap objects are shared by every CPU so its pages are spread over all the nodes
+static struct numa_policy kheap_policy = NUMA_POLICY_INTERLEAVE_INIT;
+
+// Is a page of the heap backed by physical memory?
+static inline bool kheap_page_present(uint64_t *kernel_pml4, uint64_t virtual)
+{
+    uint64_t *pte = paging_get_pte(kernel_pml4, virtual);
+    return pte && (*pte & PTE_FLAG_PRESENT);
+}
+
+/**
+ * @brief Maps again the pages of a range that trimming gave back to the pmm
+ *
+ * @param start The first byte that needs memory
+ * @param end The byte after the last one
+ * @return true If every page of the range is mapped
+ */
+static bool kheap_populate(uint64_t start, uint64_t end)
+{
+    uint64_t *kernel_pml4 = hhdm_physToVirt(paging_getKernelRoot());
+
+    for(uint64_t virtual = start & ~(PAGING_PAGE_SIZE - 1); virtual < end; virtual += PAGING_PAGE_SIZE)
+    {
+        if(kheap_page_present(kernel_pml4, virtual)) continue;
+
+        uint64_t phys = pmm_alloc_pages_policy(0, PMM_ZONE_NORMAL, &kheap_policy);
+        if(!phys) return false;
+
+        paging_map_page(kernel_pml4, virtual, phys, PTE_FLAG_RW | PTE_FLAG_GLOBAL, false);
+        kheap_mapped_pages++;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Unmaps the pages of a range and gives them back to the pmm
+ *
+ * @param start The first page, aligned
+ * @param end The end of the last page, aligned
+ * @return uint64_t How many pages were unmapped
+ */
+static uint64_t kheap_unmap(uint64_t start, uint64_t end)
+{
+    uint64_t *kernel_pml4 = hhdm_physToVirt(paging_getKernelRoot());
+    uint64_t unmapped = 0;
+
+    for(uint64_t virtual = start; virtual < end; virtual += PAGING_PAGE_SIZE)
+    {
+        if(!kheap_page_present(kernel_pml4, virtual)) continue;
+
+        paging_unmap_page(kernel_pml4, virtual, false, true);
+        unmapped++;
+    }
+
+    kheap_mapped_pages -= unmapped;
+    return unmapped;
+}
+
+/**
+ * @brief Gives back to the pmm the whole pages inside a free region
+ * The header, the links and the footer stay mapped so the region can still be walked and merged
+ * @param node The free region
+ * @return uint64_t How many pages were unmapped
+ */
+static uint64_t kheap_trim_region(struct kheap_node *node)
+{
+    uint64_t start = (uint64_t)(node + 1) + sizeof(struct kheap_free_links);
+    start = (start + PAGING_PAGE_SIZE - 1) & ~(PAGING_PAGE_SIZE - 1);
+    uint64_t end = (uint64_t)kheap_footer(node) & ~(PAGING_PAGE_SIZE - 1);
+    if(start >= end) return 0;
+
+    node->trimmed = kheap_footer(node)->trimmed = true;
+    return kheap_unmap(start, end);
+}
+
+/**
+ * @brief Shrinks the last region if it's free, giving back the end of the heap
+ *
+ * @return uint64_t How many pages were unmapped
+ */
+static uint64_t kheap_trim_tail(void)
+{
+    struct kheap_node *last = kheap_region_before(kheap_end);
+    if(last == NULL || !last->isFree) return 0;
+
+    // Only the header, the links and the footer are kept
+    uint64_t new_end = (uint64_t)(last + 1) + sizeof(struct kheap_free_links) + sizeof(struct kheap_node);
+    new_end = (new_end + PAGING_PAGE_SIZE - 1) & ~(PAGING_PAGE_SIZE - 1);
+    if(new_end >= kheap_end) return 0;
+
+    // The links page is always mapped, but the footer may not fit in it and spill on a trimmed page.
+    // We run inside a shrinker, mapping it would allocate: leave the tail alone instead
+    uint64_t *kernel_pml4 = hhdm_physToVirt(paging_getKernelRoot());
+    if(!kheap_page_present(kernel_pml4, new_end - PAGING_PAGE_SIZE)) return 0;
+
+    uint64_t unmapped = kheap_unmap(new_end, kheap_end);
+
+    kheap_remove_free(last);
+    kheap_end = new_end;
+    kheap_set_region(last, new_end - (uint64_t)last - KHEAP_OVERHEAD, true, last->trimmed);
+    kheap_insert_free(last);
+
+    return unmapped;
+}
+
+/**
+ * @brief Gives back to the pmm the end of the heap and the pages inside every free region
+ *
+ * @return uint64_t How many pages were unmapped
+ * @note The heap lock has to be held
+ */
+static uint64_t kheap_trim_locked(void)
+{
+    uint64_t unmapped = kheap_trim_tail();
+
+    for(uint32_t i = 0; i < KHEAP_NR_LISTS; i++)
+    {
+        // Regions in the first lists are smaller than a page
+        if((KHEAP_MIN_SPLITTING_SIZE << (i + 1)) <= PAGING_PAGE_SIZE) continue;
+
+        for(struct kheap_node *node = kheap_free_lists[i]; node; node = kheap_links(node)->next)
+        {
+            unmapped += kheap_trim_region(node);
+        }
+    }
+
+    kheap_untrimmed_bytes = 0;
+    kheap_trimmed_pages += unmapped;
+    return unmapped;
+}
+
+/**
+ * @brief Gives back to the pmm the pages of the heap that no allocation uses
+ *
+ * @return uint64_t How many pages were given back
+ */
+uint64_t kheap_trim(void)
+{
+    mutex_acquire(&kheap_lock);
+    uint64_t unmapped = kheap_trim_locked();
+    mutex_release(&kheap_lock);
+
+    return unmapped;
+}
+
+// How many pages trimming could give back, it's only an estimate
+static uint64_t kheap_shrink_count(void)
+{
+    return kheap_untrimmed_bytes / PAGING_PAGE_SIZE;
+}
+
+// Trims the heap when memory runs low, unless someone is using it: the lock may be held by our caller
+static uint64_t kheap_shrink_scan(uint64_t nr_pages)
+{
+    (void)nr_pages;
+    if(!mutex_try_acquire(&kheap_lock)) return 0;
+
+    uint64_t unmapped = kheap_trim_locked();
+    mutex_release(&kheap_lock);
+    return unmapped;
+}
+
+static struct pmm_shrinker kheap_shrinker = {
+    .name = "kheap",
+    .count = kheap_shrink_count,
+    .scan = kheap_shrink_scan,
+};
+
 /**
  * @brief This function will initialize the kernel heap
  * The kernel heap is placed after the kernel, using the remainig space on the VAS
@@ -39,6 +335,12 @@ void kheap_init(void)
     // We map the initial memory region of the heap
     kheap_extend(KHEAP_STARTING_SIZE);
 
+    // The size classes for the small objects
+    slab_init();
+
+    // Free heap pages go back to the pmm when memory runs low
+    pmm_register_shrinker(&kheap_shrinker);
+
     log_line(LOG_SUCCESS, "%s: Kernel heap initialized\r\n\tVirtual range: 0x%llx - 0x%llx", __FUNCTION__, kheap_start, kheap_end);
 }
 
@@ -55,123 +357,682 @@ bool kheap_extend(size_t size)
     uint64_t numPages = size / PAGING_PAGE_SIZE;
     if(size % PAGING_PAGE_SIZE) numPages++;
 
-    uint64_t *kernel_pml4_phys = paging_getKernelRoot();
+    uint64_t *kernel_pml4 = hhdm_physToVirt(paging_getKernelRoot());
+    uint64_t start = timer_read_tsc();
     
-    // Start the mapping
-    for(uint64_t virtual = kheap_end; virtual < kheap_end + (numPages * PAGING_PAGE_SIZE); virtual += PAGING_PAGE_SIZE)
+    // Start the mapping, the pages come in batches so the pmm lock is taken once per batch
+    uint64_t pages[PMM_BULK_BATCH];
+    uint64_t virtual = kheap_end;
+    while(virtual < kheap_end + (numPages * PAGING_PAGE_SIZE))
     {
-        // Allocate a new page
-        uint64_t newPage = pmm_alloc(PAGING_PAGE_SIZE);
-        if(!newPage)
+        uint64_t wanted = (kheap_end + numPages * PAGING_PAGE_SIZE - virtual) / PAGING_PAGE_SIZE;
+        if(wanted > PMM_BULK_BATCH) wanted = PMM_BULK_BATCH;
+
+        uint64_t got = pmm_alloc_bulk(wanted, pages, &kheap_policy);
+        if(got < wanted)
         {
-            // No more space in the pmm
+            // No more space in the pmm, give back what this extension took
+            pmm_free_bulk(pages, got);
+            paging_unmap_region(kernel_pml4, kheap_end, virtual - kheap_end, false, true);
+            kheap_mapped_pages -= (virtual - kheap_end) / PAGING_PAGE_SIZE;
             return false;
         }
-        // Map the page
-        paging_map_page(hhdm_physToVirt(kernel_pml4_phys), virtual, newPage, PTE_FLAG_RW | PTE_FLAG_GLOBAL, false);
+
+        // Map the pages
+        for(uint64_t i = 0; i < got; i++, virtual += PAGING_PAGE_SIZE)
+        {
+            paging_map_page(kernel_pml4, virtual, pages[i], PTE_FLAG_RW | PTE_FLAG_GLOBAL, false);
+        }
+        kheap_mapped_pages += got;
+    }
+
+    // The new memory becomes a free region, merged with the last one if it's free
+    uint64_t added = numPages * PAGING_PAGE_SIZE;
+    struct kheap_node *node = (struct kheap_node *) kheap_end;
+    uint64_t region_size = added - KHEAP_OVERHEAD;
+    bool trimmed = false;
+
+    struct kheap_node *last = kheap_region_before(kheap_end);
+    if(last != NULL && last->isFree)
+    {
+        kheap_remove_free(last);
+        node = last;
+        region_size = last->size + added;
+        trimmed = last->trimmed;
+    }
+
+    kheap_end += added;
+    kheap_set_region(node, region_size, true, trimmed);
+    kheap_insert_free(node);
+
+    // Before the timer is calibrated the time reads 0
+    uint64_t us = timer_tsc_to_us(timer_read_tsc() - start);
+    log_line(LOG_DEBUG, "%s: The heap has been expanded by %llu bytes in %llu us (%llu MB/s); new kheap_end = %llx",__FUNCTION__, 
+        numPages * PAGING_PAGE_SIZE, us, us ? (numPages * PAGING_PAGE_SIZE) / us : 0, kheap_end);
+    return true;
+}
+
+/**
+ * @brief Gives a region back to the list allocator
+ * 
+ * @param ptr A pointer to a valid kernel heap region
+ * @note The heap lock has to be held
+ */
+static void kheap_free_locked(void *ptr)
+{
+    // Get the header
+    struct kheap_node *node_to_free = (struct kheap_node *)ptr - 1;
+    
+    // Check for double free
+    if(node_to_free->isFree)
+    {
+        log_line(LOG_WARN, "%s: Kernel heap double free detected; virtual addr: 0x%llx", __FUNCTION__, ptr);
+        return;
     }
 
-    // Get the last node
-    struct kheap_node *current = kheap_head;
-    while(current != NULL && current->next != NULL)
+    // The footer must agree with the header, otherwise someone wrote past its region
+    struct kheap_node *footer = kheap_footer(node_to_free);
+    if((uint64_t)(footer + 1) > kheap_end || footer->size != node_to_free->size || footer->isFree)
     {
-        current = current->next;
+        log_line(LOG_WARN, "%s: Kernel heap corruption detected; virtual addr: 0x%llx", __FUNCTION__, ptr);
+        return;
     }
 
-    // We have no nodes or the last one is occupied
-    if(current == NULL || current->isFree == false)
+    // Merge with the free neighbours to reduce external fragmentation, the boundary tags find them in O(1)
+    uint64_t size = node_to_free->size;
+    bool trimmed = false;
+    struct kheap_node *next = kheap_next(node_to_free);
+    struct kheap_node *prev = kheap_region_before((uint64_t)node_to_free);
+
+    kheap_live_bytes -= size;
+    kheap_live_objects--;
+    kheap_untrimmed_bytes += size + KHEAP_OVERHEAD;
+
+    if(next != NULL && next->isFree)
     {
-        struct kheap_node *newNode = (struct kheap_node *) kheap_end;
-        newNode->isFree = true;
-        newNode->size = numPages * PAGING_PAGE_SIZE - sizeof(struct kheap_node);
-        newNode->next = NULL;
+        kheap_remove_free(next);
+        size += next->size + KHEAP_OVERHEAD;
+        trimmed |= next->trimmed;
+    }
 
-        if(current == NULL)
-        {
-            // If it's the first node then we set the head
-            kheap_head = newNode;
-        }
-        else 
+    if(prev != NULL && prev->isFree)
+    {
+        kheap_remove_free(prev);
+        size += prev->size + KHEAP_OVERHEAD;
+        trimmed |= prev->trimmed;
+        node_to_free = prev;
+    }
+
+    kheap_set_region(node_to_free, size, true, trimmed);
+    kheap_insert_free(node_to_free);
+
+    // A burst of frees left pages we don't need anymore
+    if(kheap_untrimmed_bytes >= KHEAP_TRIM_THRESHOLD) kheap_trim_locked();
+}
+
+/**
+ * @brief Frees the regions that were freed while someone else held the heap lock
+ * @note The heap lock has to be held
+ */
+static void kheap_free_deferred(void)
+{
+    // Racy peek, a region pushed right after is freed next time
+    if(!kheap_deferred) return;
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&kheap_deferred_lock, &irq_flags);
+    void *list = kheap_deferred;
+    kheap_deferred = NULL;
+    spinlock_irq_release(&kheap_deferred_lock, &irq_flags);
+
+    while(list)
+    {
+        void *next = *(void **)list;
+        kheap_free_locked(list);
+        list = next;
+    }
+}
+
+// Large allocations live in the vmm range of the kernel, above the HHDM and below the heap
+static inline bool kheap_is_large(void *ptr)
+{
+    return (uint64_t)ptr >= VMM_KERNEL_START && (uint64_t)ptr <= VMM_KERNEL_END;
+}
+
+/**
+ * @brief Maps a new area of the kernel address space for a large allocation
+ * The area is populated right away, with 2MB pages for every whole 2MB of it
+ * while the pmm has blocks that big: big tables and buffers need fewer TLB entries
+ * @param size The minimum bytes that need to be reserved
+ * @return void* The area, aligned to a page (2MB from PAGING_HUGE_PAGE_SIZE up). NULL if the vmm isn't ready or we're out of memory
+ */
+static void *kheap_large_alloc(size_t size)
+{
+    struct vm_address_space *kernel_vas = vmm_get_kernel_vas();
+    if(!kernel_vas) return NULL;
+
+    uint64_t flags = VMM_FLAGS_READ | VMM_FLAGS_WRITE | VMM_FLAGS_ANON | VMM_FLAGS_POPULATE;
+    if(size >= PAGING_HUGE_PAGE_SIZE) flags |= VMM_FLAGS_HUGE;
+
+    void *object = vmm_alloc(kernel_vas, size, flags, 0);
+    if(!object) return NULL;
+
+    __atomic_add_fetch(&kheap_large_bytes, (size + PAGING_PAGE_SIZE - 1) & ~(uint64_t)(PAGING_PAGE_SIZE - 1), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&kheap_large_objects, 1, __ATOMIC_RELAXED);
+    return object;
+}
+
+/**
+ * @brief Unmaps the area of a large allocation
+ * 
+ * @param ptr The address kheap_large_alloc returned
+ */
+static void kheap_large_free(void *ptr)
+{
+    struct vm_address_space *kernel_vas = vmm_get_kernel_vas();
+    uint64_t size = vmm_get_area_size(kernel_vas, (uint64_t)ptr);
+    if(size == 0)
+    {
+        log_line(LOG_WARN, "%s: 0x%llx is not a large allocation", __FUNCTION__, ptr);
+        return;
+    }
+
+    vmm_free(kernel_vas, (uint64_t)ptr);
+
+    __atomic_sub_fetch(&kheap_large_bytes, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&kheap_large_objects, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Gives back the end of an allocated region that's past size
+ * The tail becomes a free region, merged with the next one if it's free
+ * @param node The region, allocated or already out of its free list
+ * @param size The new size, aligned to KHEAP_BLOCK_SIZE
+ * @return uint64_t How many bytes the region lost
+ */
+static uint64_t kheap_split(struct kheap_node *node, uint64_t size)
+{
+    // The remainder must be big enough for another block
+    if(node->size - size < KHEAP_OVERHEAD + KHEAP_MIN_SPLITTING_SIZE) return 0;
+
+    struct kheap_node *rest = (struct kheap_node *)((uint8_t *)(node + 1) + size + sizeof(struct kheap_node));
+    uint64_t rest_size = node->size - size - KHEAP_OVERHEAD;
+    bool trimmed = node->trimmed;
+
+    struct kheap_node *next = kheap_next(node);
+    if(next != NULL && next->isFree)
+    {
+        kheap_remove_free(next);
+        rest_size += next->size + KHEAP_OVERHEAD;
+        trimmed |= next->trimmed;
+    }
+
+    kheap_set_region(rest, rest_size, true, trimmed);
+    kheap_insert_free(rest);
+
+    uint64_t lost = node->size - size;
+    node->size = size;
+    return lost;
+}
+
+/**
+ * @brief Carves a region out of the list allocator
+ *
+ * @param size The minimum bytes that need to be reserved
+ * @param align The alignment of the region, a power of two. At most KHEAP_BLOCK_SIZE means no constraint
+ * @return void* The region, NULL if we're out of memory
+ * @note The heap lock has to be held. If interrupts are disabled the pmm won't reclaim memory
+ */
+static void *kheap_alloc_locked(size_t size, size_t align)
+{
+    // Align the size to 16 bytes, a free region must have room for its links
+    if(size < KHEAP_MIN_SPLITTING_SIZE) size = KHEAP_MIN_SPLITTING_SIZE;
+    if(size % KHEAP_BLOCK_SIZE) size += KHEAP_BLOCK_SIZE - (size % KHEAP_BLOCK_SIZE);
+
+    // An aligned region may start after a gap that has to become a free block of its own
+    uint64_t slack = align > KHEAP_BLOCK_SIZE ? align + KHEAP_OVERHEAD + KHEAP_MIN_SPLITTING_SIZE : 0;
+
+    struct kheap_node *currentNode;
+    while((currentNode = kheap_find_free(size + slack)) == NULL)
+    {
+        // If we're here it's because we didn't find a big enough block
+        uint64_t needed = size + slack + KHEAP_OVERHEAD;
+        if(!kheap_extend(needed > KHEAP_EXTENDING_AMOUNT ? needed : KHEAP_EXTENDING_AMOUNT))
         {
-            // Otherwise we attach it to the last one
-            current->next = newNode;
+            // The heap expansion has failed
+            return NULL;
         }
     }
-    else // The last node is free so we simply augment it's size
+
+    uint64_t payload = (uint64_t)(currentNode + 1);
+    if(slack)
     {
-        current->size += numPages * PAGING_PAGE_SIZE;
+        payload = (payload + align - 1) & ~(uint64_t)(align - 1);
+
+        // The gap is too small to be a block, the next aligned address leaves a big enough one
+        uint64_t gap = payload - (uint64_t)(currentNode + 1);
+        if(gap && gap < KHEAP_OVERHEAD + KHEAP_MIN_SPLITTING_SIZE) payload += align;
     }
 
-    kheap_end += numPages * PAGING_PAGE_SIZE;
+    if(currentNode->trimmed)
+    {
+        // Only what we hand out and the header and links of the remainder need memory behind them
+        uint64_t used_end = payload + size + KHEAP_OVERHEAD + sizeof(struct kheap_free_links);
+        uint64_t region_end = (uint64_t)(kheap_footer(currentNode) + 1);
 
-    log_line(LOG_DEBUG, "%s: The heap has been expanded by %llu bytes; new kheap_end = %llx",__FUNCTION__, numPages * PAGING_PAGE_SIZE, kheap_end);
-    return true;
+        if(!kheap_populate((uint64_t)currentNode, used_end < region_end ? used_end : region_end)) return NULL;
+    }
+
+    kheap_remove_free(currentNode);
+
+    if(payload != (uint64_t)(currentNode + 1))
+    {
+        // The gap before the aligned address goes back to the free lists, its previous region is allocated
+        struct kheap_node *aligned = (struct kheap_node *)payload - 1;
+        uint64_t region_size = (uint64_t)kheap_footer(currentNode) - payload;
+        bool trimmed = currentNode->trimmed;
+
+        kheap_set_region(currentNode, (uint64_t)aligned - (uint64_t)currentNode - KHEAP_OVERHEAD, true, trimmed);
+        kheap_insert_free(currentNode);
+
+        currentNode = aligned;
+        currentNode->size = region_size;
+        currentNode->trimmed = trimmed;
+    }
+
+    // If the remaining size is enough for another big enough block we split it
+    kheap_split(currentNode, size);
+
+    kheap_set_region(currentNode, currentNode->size, false, false);
+    kheap_live_bytes += currentNode->size;
+    kheap_live_objects++;
+    return (void *)(currentNode + 1);
+}
+
+/**
+ * @brief Frees anything kmalloc returned, without touching the profile
+ * It never sleeps if interrupts are disabled: when the heap lock is busy
+ * the region is queued and freed by the next caller that takes the lock
+ * @param ptr A pointer to a valid kernel heap region
+ */
+static void kheap_free(void *ptr)
+{
+    if(!ptr) return;
+
+    if(kheap_is_large(ptr))
+    {
+        kheap_large_free(ptr);
+        return;
+    }
+
+    // Only the big objects live in the heap range, the slabs are reached through the HHDM
+    if((uint64_t)ptr < kheap_start || (uint64_t)ptr >= kheap_end)
+    {
+        slab_free(ptr);
+        return;
+    }
+
+    uint64_t irq_flags = interrupts_save_and_disable();
+    interrupts_restore(irq_flags);
+
+    if(irq_flags & RFLAGS_IF)
+    {
+        mutex_acquire(&kheap_lock);
+    }
+    else if(!mutex_try_acquire(&kheap_lock))
+    {
+        // We can't sleep, the region is reused as a link of the deferred list
+        uint64_t lock_flags;
+        spinlock_irq_acquire(&kheap_deferred_lock, &lock_flags);
+        *(void **)ptr = kheap_deferred;
+        kheap_deferred = ptr;
+        spinlock_irq_release(&kheap_deferred_lock, &lock_flags);
+        return;
+    }
+
+    kheap_free_deferred();
+    kheap_free_locked(ptr);
+    mutex_release(&kheap_lock);
+}
+
+#if KHEAP_PROFILE
+// The histograms and the call sites of kmalloc, the counters are atomic since most paths don't take the heap lock
+static uint64_t kheap_hist_allocs[KHEAP_HIST_BUCKETS], kheap_hist_live[KHEAP_HIST_BUCKETS];
+static struct kheap_site kheap_sites[KHEAP_PROFILE_SITES];
+static struct callsite_table kheap_site_table = CALLSITE_TABLE_INIT(kheap_sites, KHEAP_PROFILE_SHIFT, KHEAP_PROFILE_PROBES);
+static uint64_t kheap_sites_dropped = 0;
+
+// The bucket of a size, the last one takes every bigger size
+static inline uint32_t kheap_hist_bucket(uint64_t size)
+{
+    uint32_t bucket = 63 - __builtin_clzll(size | 1);
+    return bucket < KHEAP_HIST_BUCKETS ? bucket : KHEAP_HIST_BUCKETS - 1;
+}
+
+// How many bytes the caller can use, the histograms count what the allocators hand out
+static uint64_t kheap_usable_size(void *ptr)
+{
+    if(kheap_is_large(ptr)) return vmm_get_area_size(vmm_get_kernel_vas(), (uint64_t)ptr);
+    if((uint64_t)ptr < kheap_start || (uint64_t)ptr >= kheap_end) return slab_object_size(ptr);
+    return ((struct kheap_node *)ptr - 1)->size;
+}
+
+// The dump sorts the call sites by the bytes they asked for
+static int64_t kheap_site_key(const void *entry)
+{
+    return __atomic_load_n(&((const struct kheap_site *)entry)->bytes, __ATOMIC_RELAXED);
+}
+#endif
+
+/**
+ * @brief Records an allocation in the histograms and charges it to its call site
+ * Does nothing unless KHEAP_PROFILE is set
+ * @param object What the allocation returned, NULL if it failed
+ * @param size The size that was asked
+ * @param caller The return address of the allocation call, NULL to only update the histograms
+ */
+static inline void kheap_profile_alloc(void *object, size_t size, void *caller)
+{
+#if KHEAP_PROFILE
+    if(!object) return;
+
+    uint32_t bucket = kheap_hist_bucket(kheap_usable_size(object));
+    __atomic_add_fetch(&kheap_hist_live[bucket], 1, __ATOMIC_RELAXED);
+    if(!caller) return;
+
+    __atomic_add_fetch(&kheap_hist_allocs[kheap_hist_bucket(size)], 1, __ATOMIC_RELAXED);
+
+    uint32_t slot = callsite_slot(&kheap_site_table, caller);
+    if(slot == CALLSITE_NONE)
+    {
+        __atomic_add_fetch(&kheap_sites_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct kheap_site *site = &kheap_sites[slot];
+
+    __atomic_add_fetch(&site->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->bytes, size, __ATOMIC_RELAXED);
+#else
+    (void)object; (void)size; (void)caller;
+#endif
+}
+
+/**
+ * @brief Takes an object that's being freed out of the histograms
+ * Does nothing unless KHEAP_PROFILE is set
+ * @param object The object, still allocated
+ */
+static inline void kheap_profile_free(void *object)
+{
+#if KHEAP_PROFILE
+    if(!object) return;
+
+    uint64_t size = kheap_usable_size(object);
+    if(size) __atomic_sub_fetch(&kheap_hist_live[kheap_hist_bucket(size)], 1, __ATOMIC_RELAXED);
+#else
+    (void)object;
+#endif
 }
 
 /**
  * @brief kernel heap allocating function
- * It allocates a virtually contiguos memory region 
+ * Requests up to SLAB_MAX_SIZE come from the slab caches in O(1),
+ * from KHEAP_LARGE_SIZE up they get an area of the vmm,
+ * the others get a virtually contiguos memory region 
  * above the mapping of the kernel
  * not guaranteed to be physically contiguos
  * @param size The minimum bytes that need to be reserved
+ * @param flags KMALLOC_FLAGS_SLEEP if the caller can sleep, KMALLOC_FLAGS_ATOMIC if it's
+ * an interrupt handler or holds a spinlock. Atomic allocations fail instead of waiting
+ * for the heap lock or for memory to be reclaimed
  * @return void* A virtual address pointing to the reserved region
  */
-void* kmalloc(size_t size)
+static void *kheap_malloc(size_t size, uint64_t flags)
 {
-    // Align the size to 16 bytes
-    if(size % KHEAP_BLOCK_SIZE) size += KHEAP_BLOCK_SIZE - (size % KHEAP_BLOCK_SIZE);
+    if(size <= SLAB_MAX_SIZE)
+    {
+        void *object = slab_alloc(size, flags);
+        if(object) return object;
+
+        // No page for a new slab, the list may still have room
+    }
+
+    // Big requests get their own area instead of growing the list in small pages. It's mapped under a spinlock,
+    // atomic callers stay on the list so they don't keep interrupts disabled while megabytes are cleared
+    if(size >= KHEAP_LARGE_SIZE && !(flags & KMALLOC_FLAGS_ATOMIC))
+    {
+        void *object = kheap_large_alloc(size);
+        if(object) return object;
+    }
+
+    void *object = NULL;
+
+    if(flags & KMALLOC_FLAGS_ATOMIC)
+    {
+        // The holder of the lock may be the thread we interrupted, we can't wait for it.
+        // With interrupts disabled the pmm doesn't reclaim memory either
+        uint64_t irq_flags = interrupts_save_and_disable();
+        if(mutex_try_acquire(&kheap_lock))
+        {
+            object = kheap_alloc_locked(size, KHEAP_BLOCK_SIZE);
+            mutex_release(&kheap_lock);
+        }
+        interrupts_restore(irq_flags);
+        return object;
+    }
 
     mutex_acquire(&kheap_lock);
+    kheap_free_deferred();
+    object = kheap_alloc_locked(size, KHEAP_BLOCK_SIZE);
+    mutex_release(&kheap_lock);
+    return object;
+}
 
-    // We iterate through the nodes
-    struct kheap_node *currentNode;
-    while(true)
+/**
+ * @brief Allocates memory, telling whether the caller can sleep
+ * 
+ * @param size The minimum bytes that need to be reserved
+ * @param flags KMALLOC_FLAGS_SLEEP or KMALLOC_FLAGS_ATOMIC
+ * @return void* A virtual address pointing to the reserved region, NULL if we're out of memory
+ */
+void *kmalloc_flags(size_t size, uint64_t flags)
+{
+    void *object = kheap_malloc(size, flags);
+    kheap_profile_alloc(object, size, __builtin_return_address(0));
+    return object;
+}
+
+/**
+ * @brief Allocates memory, the caller may be put to sleep
+ * 
+ * @param size The minimum bytes that need to be reserved
+ * @return void* A virtual address pointing to the reserved region, NULL if we're out of memory
+ */
+void *kmalloc(size_t size)
+{
+    void *object = kheap_malloc(size, KMALLOC_FLAGS_SLEEP);
+    kheap_profile_alloc(object, size, __builtin_return_address(0));
+    return object;
+}
+
+/**
+ * @brief Allocates memory without ever sleeping, for interrupt handlers and spinlock holders
+ * Small requests can build their slabs from the reserve of the CPU when the pmm has no memory
+ * @param size The minimum bytes that need to be reserved
+ * @return void* A virtual address pointing to the reserved region, NULL if it can't be done without sleeping
+ */
+void *kmalloc_atomic(size_t size)
+{
+    void *object = kheap_malloc(size, KMALLOC_FLAGS_ATOMIC);
+    kheap_profile_alloc(object, size, __builtin_return_address(0));
+    return object;
+}
+
+/**
+ * @brief Allocates memory aligned to a power of two, the caller may be put to sleep
+ * Up to KHEAP_BLOCK_SIZE it's a plain kmalloc, small objects come from the power of two size classes,
+ * bigger alignments are carved out of the list allocator.
+ * Use a cache from kmem_cache_create for many small objects of the same size
+ * @param size The minimum bytes that need to be reserved
+ * @param align The alignment, a power of two (KMEM_CACHE_LINE, PAGING_PAGE_SIZE...)
+ * @return void* The region, to be freed with kfree. NULL if we're out of memory or align isn't a power of two
+ */
+void *kmalloc_aligned(size_t size, size_t align)
+{
+    if(align == 0 || (align & (align - 1)))
+    {
+        log_line(LOG_WARN, "%s: %llu is not a power of two", __FUNCTION__, align);
+        return NULL;
+    }
+
+    void *object = NULL;
+    if(align <= KHEAP_BLOCK_SIZE)
+    {
+        object = kheap_malloc(size, KMALLOC_FLAGS_SLEEP);
+    }
+    else
+    {
+        if(size <= SLAB_MAX_SIZE && align <= SLAB_MAX_SIZE) object = slab_alloc_aligned(size, align, KMALLOC_FLAGS_SLEEP);
+
+        // Large areas are aligned to a page, or to a huge page when they have one
+        if(!object && size >= KHEAP_LARGE_SIZE && align <= (size >= PAGING_HUGE_PAGE_SIZE ? PAGING_HUGE_PAGE_SIZE : PAGING_PAGE_SIZE))
+            object = kheap_large_alloc(size);
+
+        if(!object)
+        {
+            mutex_acquire(&kheap_lock);
+            kheap_free_deferred();
+            object = kheap_alloc_locked(size, align);
+            mutex_release(&kheap_lock);
+        }
+    }
+
+    kheap_profile_alloc(object, size, __builtin_return_address(0));
+    return object;
+}
+
+/**
+ * @brief krealloc without the profile, see krealloc
+ * 
+ * @param ptr The region, NULL behaves like kmalloc
+ * @param size The new size, 0 behaves like kfree
+ * @return void* The region, NULL if we're out of memory: ptr is still valid then
+ */
+static void *kheap_realloc(void *ptr, size_t size)
+{
+    if(!ptr) return kheap_malloc(size, KMALLOC_FLAGS_SLEEP);
+
+    if(size == 0)
+    {
+        kheap_free(ptr);
+        return NULL;
+    }
+
+    uint64_t old_size;
+    if(kheap_is_large(ptr))
+    {
+        // The area already has room, unless it would be mostly wasted
+        old_size = vmm_get_area_size(vmm_get_kernel_vas(), (uint64_t)ptr);
+        if(old_size == 0) return NULL;
+        if(size <= old_size && size >= KHEAP_LARGE_SIZE) return ptr;
+    }
+    else if((uint64_t)ptr < kheap_start || (uint64_t)ptr >= kheap_end)
     {
-        currentNode = kheap_head;
+        // A slab object can't grow, but its class may already have room
+        old_size = slab_object_size(ptr);
+        if(old_size == 0) return NULL;
+        if(size <= old_size) return ptr;
+    }
+    else
+    {
+        uint64_t new_size = size < KHEAP_MIN_SPLITTING_SIZE ? KHEAP_MIN_SPLITTING_SIZE : size;
+        if(new_size % KHEAP_BLOCK_SIZE) new_size += KHEAP_BLOCK_SIZE - (new_size % KHEAP_BLOCK_SIZE);
 
-        // Iterate the list of free nodes
-        while(currentNode != NULL)
+        mutex_acquire(&kheap_lock);
+        kheap_free_deferred();
+
+        struct kheap_node *node = (struct kheap_node *)ptr - 1;
+        if(node->isFree || kheap_footer(node)->size != node->size)
         {
-            // We found a free and big enough block
-            if(currentNode->isFree && currentNode->size >= size)
+            mutex_release(&kheap_lock);
+            log_line(LOG_WARN, "%s: 0x%llx is not an allocated heap region", __FUNCTION__, ptr);
+            return NULL;
+        }
+
+        old_size = node->size;
+        struct kheap_node *next = kheap_next(node);
+
+        // Grow into the next region, only the memory we hand out needs to be mapped
+        if(new_size > node->size && next != NULL && next->isFree && node->size + KHEAP_OVERHEAD + next->size >= new_size)
+        {
+            uint64_t merged = node->size + KHEAP_OVERHEAD + next->size;
+            uint64_t used_end = (uint64_t)(node + 1) + new_size + KHEAP_OVERHEAD + sizeof(struct kheap_free_links);
+            uint64_t region_end = (uint64_t)node + merged + KHEAP_OVERHEAD;
+
+            if(!next->trimmed || kheap_populate((uint64_t)next, used_end < region_end ? used_end : region_end))
             {
-                // If the remaining size is enough for another big enough block we split it
-                if(currentNode->size - size >= sizeof(struct kheap_node) + KHEAP_MIN_SPLITTING_SIZE)
-                {
-                    struct kheap_node *newNode = (struct kheap_node *)((uint8_t *)currentNode + sizeof(struct kheap_node) + size);
-                
-                    // Change the next node for both nodes
-                    newNode->next = currentNode->next;
-                    currentNode->next = newNode;
-
-                    // Set the new node as free and the old one as occupied
-                    newNode->isFree = true;               
-
-                    // Set both sizes accordingly
-                    newNode->size = currentNode->size - size - sizeof(struct kheap_node);
-                    currentNode->size = size;
-                }
-
-                currentNode->isFree = false;
-                mutex_release(&kheap_lock);
-                return (void *)(currentNode + 1);
+                kheap_remove_free(next);
+                node->size = merged;
+                node->trimmed = next->trimmed;
             }
-
-            // We go to the next node
-            currentNode = currentNode->next;
         }
-        // If we're here it's because we didn't find a big enough block
-        if(!kheap_extend(KHEAP_EXTENDING_AMOUNT))
+
+        if(new_size <= node->size)
         {
-            // The heap expansion has failed
+            // Shrinking, or the merge above made room: give back what's left
+            kheap_untrimmed_bytes += kheap_split(node, new_size);
+            kheap_set_region(node, node->size, false, false);
+
+            kheap_live_bytes += node->size - old_size;
             mutex_release(&kheap_lock);
-            return NULL;
+            return ptr;
         }
+
+        mutex_release(&kheap_lock);
     }
 
-    mutex_release(&kheap_lock);
-    // Should never come here
-    return NULL;
+    // No room in place, move the content
+    void *new_ptr = kheap_malloc(size, KMALLOC_FLAGS_SLEEP);
+    if(!new_ptr) return NULL;
+
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    kheap_free(ptr);
+    return new_ptr;
+}
+
+/**
+ * @brief Resizes a region, in place whenever possible
+ * A region of the list allocator shrinks by giving back its tail and grows into the
+ * next region if that's free, a large area is kept while it's big enough,
+ * otherwise the content is moved to a new region.
+ * A moved region keeps only the alignment of kmalloc, the caller may be put to sleep
+ * @param ptr The region, NULL behaves like kmalloc
+ * @param size The new size, 0 behaves like kfree
+ * @return void* The region, NULL if we're out of memory: ptr is still valid then
+ */
+void *krealloc(void *ptr, size_t size)
+{
+    // The old region leaves the histograms, what we return is an allocation of our caller
+    kheap_profile_free(ptr);
+
+    void *object = kheap_realloc(ptr, size);
+    if(object) kheap_profile_alloc(object, size, __builtin_return_address(0));
+    else if(size) kheap_profile_alloc(ptr, size, NULL);
+
+    return object;
+}
+
+/**
+ * @brief Our kernel heap deallocator function
+ * It never sleeps if interrupts are disabled: when the heap lock is busy
+ * the region is queued and freed by the next caller that takes the lock
+ * @param ptr A pointer to a valid kernel heap region
+ */
+void kfree(void *ptr)
+{
+    kheap_profile_free(ptr);
+    kheap_free(ptr);
 }
 
 /**
@@ -183,7 +1044,7 @@ void kheap_print_nodes()
     log_line(LOG_DEBUG, "%s: Kernel heap current nodes:", __FUNCTION__);
 
     mutex_acquire(&kheap_lock);
-    struct kheap_node *current = kheap_head;
+    struct kheap_node *current = kheap_end > kheap_start ? (struct kheap_node *)kheap_start : NULL;
     while(current)
     {
         log_line(LOG_DEBUG, "Region: 0x%llx - 0x%llx; isFree: %s; size: %lld bytes", 
@@ -191,65 +1052,217 @@ void kheap_print_nodes()
             (uint64_t)current + sizeof(struct kheap_node) + current->size,
             current->isFree ? "true" : "false", 
             current->size);
-        current = current->next;
+        current = kheap_next(current);
     }
 
     mutex_release(&kheap_lock);
 }
 
 /**
- * @brief Tries to coalesce near free blocks
- * useful to combat external fragmentation
+ * @brief Prints how much memory the heap takes against how much of it is allocated
+ * It's a debug function
  */
-static void kheap_coalesce()
+void kheap_print_usage(void)
 {
-    struct kheap_node *current = kheap_head;
-    while(current != NULL && current->next != NULL)
-    {
-        // If 2 consecutive blocks are free then we merge them
-        if(current->isFree && current->next->isFree)
-        {
-            // Increment the size of the previous node
-            current->size += current->next->size + sizeof(struct kheap_node);
+    uint64_t slab_resident, slab_live;
+    slab_get_usage(&slab_resident, &slab_live);
 
-            // We remove the 2nd node from the list
-            current->next = current->next->next;
-        }
-        else 
+    mutex_acquire(&kheap_lock);
+    log_line(LOG_DEBUG, "%s: List heap: %llu KB virtual; %llu KB resident; %llu KB live in %llu objects; %llu pages trimmed", 
+        __FUNCTION__, (kheap_end - kheap_start) / 1024, kheap_mapped_pages * PAGING_PAGE_SIZE / 1024, 
+        kheap_live_bytes / 1024, kheap_live_objects, kheap_trimmed_pages);
+    mutex_release(&kheap_lock);
+
+    log_line(LOG_DEBUG, "%s: Slabs: %llu KB resident; %llu KB live", __FUNCTION__, slab_resident / 1024, slab_live / 1024);
+    log_line(LOG_DEBUG, "%s: Large: %llu KB in %llu areas", __FUNCTION__, 
+        __atomic_load_n(&kheap_large_bytes, __ATOMIC_RELAXED) / 1024, __atomic_load_n(&kheap_large_objects, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Fills the summary of the heap, the free regions of the list are found through the free lists
+ * 
+ * @param header The header of the profile
+ */
+static void kheap_profile_collect(struct kheap_profile_header *header)
+{
+    header->magic = KHEAP_PROFILE_MAGIC;
+    header->version = KHEAP_PROFILE_VERSION;
+    header->nr_buckets = KHEAP_PROFILE ? KHEAP_HIST_BUCKETS : 0;
+    header->nr_sites = 0;
+    header->sites_dropped = 0;
+
+    uint64_t slab_resident, slab_live;
+    slab_get_usage(&slab_resident, &slab_live);
+    header->slab_resident = slab_resident;
+    header->slab_live = slab_live;
+    header->large_bytes = __atomic_load_n(&kheap_large_bytes, __ATOMIC_RELAXED);
+    header->large_objects = __atomic_load_n(&kheap_large_objects, __ATOMIC_RELAXED);
+
+    header->free_bytes = header->free_regions = header->largest_free = 0;
+
+    mutex_acquire(&kheap_lock);
+    for(uint32_t i = 0; i < KHEAP_NR_LISTS; i++)
+    {
+        for(struct kheap_node *node = kheap_free_lists[i]; node; node = kheap_links(node)->next)
         {
-            // We advance only if we didn't merge anything
-            current = current->next;
+            header->free_bytes += node->size;
+            header->free_regions++;
+            if(node->size > header->largest_free) header->largest_free = node->size;
         }
     }
+
+    header->heap_bytes = kheap_end - kheap_start;
+    header->mapped_bytes = kheap_mapped_pages * PAGING_PAGE_SIZE;
+    header->live_bytes = kheap_live_bytes;
+    header->live_objects = kheap_live_objects;
+    mutex_release(&kheap_lock);
+
+    // A single free region is no fragmentation, many small ones are a lot
+    header->fragmentation = header->free_bytes ? 1000 - header->largest_free * 1000 / header->free_bytes : 0;
+
+#if KHEAP_PROFILE
+    header->nr_sites = callsite_count(&kheap_site_table);
+    header->sites_dropped = __atomic_load_n(&kheap_sites_dropped, __ATOMIC_RELAXED);
+#endif
 }
 
 /**
- * @brief Our kernel heap deallocator function
- * 
- * @param ptr A pointer to a valid kernel heap region
+ * @brief Prints the size histograms, the fragmentation of the list and the call sites that allocated the most
+ * It's a debug function, the histograms and the call sites need KHEAP_PROFILE
  */
-void kfree(void *ptr)
+void kheap_profile_dump(void)
 {
-    if(!ptr) return;
+    struct kheap_profile_header header;
+    kheap_profile_collect(&header);
 
-    mutex_acquire(&kheap_lock);
+    log_line(LOG_DEBUG, "--- KHEAP PROFILE ---");
+    log_line(LOG_DEBUG, "List: %llu KB live in %llu objects; %llu KB free in %llu regions; largest free %llu KB; fragmentation %u.%u%%",
+        header.live_bytes / 1024, header.live_objects, header.free_bytes / 1024, header.free_regions,
+        header.largest_free / 1024, header.fragmentation / 10, header.fragmentation % 10);
+    log_line(LOG_DEBUG, "Slabs: %llu KB live; %llu KB resident. Large: %llu KB in %llu areas",
+        header.slab_live / 1024, header.slab_resident / 1024, header.large_bytes / 1024, header.large_objects);
 
-    // Get the header
-    struct kheap_node *node_to_free = (struct kheap_node *)ptr - 1;
-    
-    // Check for double free
-    if(node_to_free->isFree)
+#if KHEAP_PROFILE
+    log_line(LOG_DEBUG, "Sizes (asked; handed out and live):");
+    for(uint32_t i = 0; i < KHEAP_HIST_BUCKETS; i++)
     {
-        mutex_release(&kheap_lock);
-        log_line(LOG_WARN, "%s: Kernel heap double free detected; virtual addr: 0x%llx", __FUNCTION__, ptr);
-        return;
+        uint64_t allocs = __atomic_load_n(&kheap_hist_allocs[i], __ATOMIC_RELAXED);
+        uint64_t live = __atomic_load_n(&kheap_hist_live[i], __ATOMIC_RELAXED);
+        if(allocs || live) log_line(LOG_DEBUG, "  %llu-%llu bytes: %llu allocs; %llu live", 1ULL << i, (2ULL << i) - 1, allocs, live);
     }
 
-    // Set the node as free
-    node_to_free->isFree = true;
+    log_line(LOG_DEBUG, "%u call sites; %llu allocations dropped:", header.nr_sites, header.sites_dropped);
 
-    // Coalesce the blocks to reduce external fragmentation
-    kheap_coalesce();
+    uint32_t slot = CALLSITE_NONE;
+    for(uint32_t n = 0; n < KHEAP_PROFILE_TOP && (slot = callsite_next_top(&kheap_site_table, kheap_site_key, slot)) != CALLSITE_NONE; n++)
+    {
+        struct kheap_site *site = &kheap_sites[slot];
+        log_line(LOG_DEBUG, "  %p: %llu allocs; %llu KB", site->caller, site->allocs, site->bytes / 1024);
+    }
+#else
+    log_line(LOG_DEBUG, "%s: Histograms and call sites are off, build with KHEAP_PROFILE set to 1", __FUNCTION__);
+#endif
 
-    mutex_release(&kheap_lock);
-}
\ No newline at end of file
+    log_line(LOG_DEBUG, "-----------------------------");
+}
+
+/**
+ * @brief Sends the profile over the serial port as a binary blob, for offline analysis
+ * The blob is a struct kheap_profile_header followed by the histograms and every call site,
+ * it can land between log lines: the reader looks for KHEAP_PROFILE_MAGIC
+ */
+void kheap_profile_export(void)
+{
+    struct kheap_profile_header header;
+    kheap_profile_collect(&header);
+    serial_write_str((const char *)&header, sizeof(header));
+
+#if KHEAP_PROFILE
+    uint64_t hist[KHEAP_HIST_BUCKETS];
+    for(uint32_t i = 0; i < KHEAP_HIST_BUCKETS; i++) hist[i] = __atomic_load_n(&kheap_hist_allocs[i], __ATOMIC_RELAXED);
+    serial_write_str((const char *)hist, sizeof(hist));
+    for(uint32_t i = 0; i < KHEAP_HIST_BUCKETS; i++) hist[i] = __atomic_load_n(&kheap_hist_live[i], __ATOMIC_RELAXED);
+    serial_write_str((const char *)hist, sizeof(hist));
+
+    // Only the sites counted in the header, one claimed meanwhile is left out
+    for(uint32_t i = 0, sent = 0; i < KHEAP_PROFILE_SITES && sent < header.nr_sites; i++)
+    {
+        struct kheap_site site = {
+            .caller = __atomic_load_n(&kheap_sites[i].caller, __ATOMIC_RELAXED),
+            .allocs = __atomic_load_n(&kheap_sites[i].allocs, __ATOMIC_RELAXED),
+            .bytes = __atomic_load_n(&kheap_sites[i].bytes, __ATOMIC_RELAXED),
+        };
+        if(!site.caller) continue;
+
+        serial_write_str((const char *)&site, sizeof(site));
+        sent++;
+    }
+#endif
+}
+
+// A random size for kheap_benchmark, from just above the slab classes to 4 pages
+static uint64_t kheap_bench_size(uint64_t *seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return SLAB_MAX_SIZE + 1 + (*seed >> 33) % (4 * PAGING_PAGE_SIZE - SLAB_MAX_SIZE);
+}
+
+/**
+ * @brief Measures kmalloc and kfree on the list allocator while the number of live objects grows
+ * Up to KHEAP_BENCH_LIVE objects bigger than SLAB_MAX_SIZE are kept allocated, every KHEAP_BENCH_STEP
+ * new ones we time random frees followed by allocations: the latency shouldn't depend on how many are live
+ * @param iterations How many free + alloc pairs to time at every step
+ */
+void kheap_benchmark(uint64_t iterations)
+{
+    static void *live[KHEAP_BENCH_LIVE];
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+    log_line(LOG_DEBUG, "--- KHEAP BENCHMARK (%llu iterations) ---", iterations);
+
+    uint64_t nr_live = 0;
+    while(nr_live < KHEAP_BENCH_LIVE)
+    {
+        for(uint64_t i = 0; i < KHEAP_BENCH_STEP && nr_live < KHEAP_BENCH_LIVE; i++)
+        {
+            live[nr_live] = kmalloc(kheap_bench_size(&seed));
+            if(!live[nr_live]) break;
+            nr_live++;
+        }
+
+        if(nr_live == 0 || (nr_live % KHEAP_BENCH_STEP && nr_live < KHEAP_BENCH_LIVE))
+        {
+            log_line(LOG_DEBUG, "%s: Out of memory with %llu live objects", __FUNCTION__, nr_live);
+            break;
+        }
+
+        // Replace random objects, each free leaves a hole the next allocations may reuse
+        uint64_t free_cycles = 0, alloc_cycles = 0, done = 0;
+        for(uint64_t i = 0; i < iterations; i++)
+        {
+            uint64_t victim = kheap_bench_size(&seed) % nr_live;
+            uint64_t size = kheap_bench_size(&seed);
+
+            uint64_t start = timer_read_tsc();
+            kfree(live[victim]);
+            uint64_t middle = timer_read_tsc();
+            live[victim] = kmalloc(size);
+            alloc_cycles += timer_read_tsc() - middle;
+            free_cycles += middle - start;
+
+            if(!live[victim])
+            {
+                // Keep the array dense
+                live[victim] = live[--nr_live];
+                break;
+            }
+            done++;
+        }
+
+        if(done) log_line(LOG_DEBUG, "%llu live objects: kfree %llu cycles/op; kmalloc %llu cycles/op", 
+            nr_live, free_cycles / done, alloc_cycles / done);
+        if(done < iterations) break;
+    }
+
+    for(uint64_t i = 0; i < nr_live; i++) kfree(live[i]);
+}
@@ -0,0 +1,236 @@
+#include <common/logging.h>
+#include <cpu.h>
+#include <drivers/acpi.h>
+#include <memory/numa.h>
+#include <memory/pmm.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// How many nodes were found, always at least 1
+static uint32_t nr_nodes = 1;
+
+// The proximity domain of every node, nodes are numbered in the order we meet their domain
+static uint32_t node_pxm[NUMA_MAX_NODES];
+
+// Memory ranges and the node they belong to
+static struct numa_memblock memblocks[NUMA_MAX_MEMBLOCKS];
+static uint32_t nr_memblocks = 0;
+
+// The node of every CPU indexed by APIC ID
+static uint8_t apic_node[NUMA_MAX_APIC_ID];
+
+// The distance between every couple of nodes
+static uint8_t node_distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// The node of the boot CPU, until SMP lands every context runs on it
+static uint32_t boot_node = 0;
+
+/**
+ * @brief Converts a proximity domain into a node, creating the node the first time we see it
+ *
+ * @param pxm The proximity domain
+ * @return uint32_t The node, 0 if we ran out of nodes
+ */
+static uint32_t numa_pxm_to_node(uint32_t pxm)
+{
+    for(uint32_t i = 0; i < nr_nodes; i++)
+    {
+        if(node_pxm[i] == pxm) return i;
+    }
+
+    if(nr_nodes == NUMA_MAX_NODES)
+    {
+        log_line(LOG_WARN, "%s: Too many proximity domains, folding domain %u into node 0", __FUNCTION__, pxm);
+        return 0;
+    }
+
+    node_pxm[nr_nodes] = pxm;
+    return nr_nodes++;
+}
+
+/**
+ * @brief Reads the CPU and memory affinity entries of the SRAT
+ *
+ * @param srat The SRAT
+ * @return true If at least a memory range was assigned to a node
+ */
+static bool numa_parse_srat(struct SRAT *srat)
+{
+    uint8_t *entry = srat->entries;
+    uint8_t *end = (uint8_t *)srat + srat->sdtHeader.Length;
+
+    // The first domain we meet becomes node 0
+    nr_nodes = 0;
+
+    while(entry + sizeof(struct SRATEntryHeader) <= end)
+    {
+        struct SRATEntryHeader *header = (struct SRATEntryHeader *)entry;
+        if(header->Length == 0 || entry + header->Length > end) break;
+
+        switch(header->Type)
+        {
+            case SRAT_TYPE_LAPIC_AFFINITY:
+            {
+                struct SRATLapicAffinity *lapic = (struct SRATLapicAffinity *)entry;
+                if(!(lapic->Flags & SRAT_AFFINITY_ENABLED)) break;
+
+                uint32_t pxm = lapic->ProximityDomainLow | (lapic->ProximityDomainHigh[0] << 8) |
+                    (lapic->ProximityDomainHigh[1] << 16) | ((uint32_t)lapic->ProximityDomainHigh[2] << 24);
+                apic_node[lapic->ApicID] = numa_pxm_to_node(pxm);
+                break;
+            }
+
+            case SRAT_TYPE_X2APIC_AFFINITY:
+            {
+                struct SRATX2ApicAffinity *x2apic = (struct SRATX2ApicAffinity *)entry;
+                if(!(x2apic->Flags & SRAT_AFFINITY_ENABLED)) break;
+
+                uint32_t node = numa_pxm_to_node(x2apic->ProximityDomain);
+                if(x2apic->X2ApicID < NUMA_MAX_APIC_ID) apic_node[x2apic->X2ApicID] = node;
+                break;
+            }
+
+            case SRAT_TYPE_MEMORY_AFFINITY:
+            {
+                struct SRATMemoryAffinity *memory = (struct SRATMemoryAffinity *)entry;
+                if(!(memory->Flags & SRAT_AFFINITY_ENABLED) || memory->Length == 0) break;
+
+                if(nr_memblocks == NUMA_MAX_MEMBLOCKS)
+                {
+                    log_line(LOG_WARN, "%s: Too many memory ranges, 0x%llx-0x%llx goes to node 0", __FUNCTION__,
+                        memory->BaseAddress, memory->BaseAddress + memory->Length);
+                    break;
+                }
+
+                memblocks[nr_memblocks].start_pfn = memory->BaseAddress / PMM_PAGE_SIZE;
+                memblocks[nr_memblocks].end_pfn = (memory->BaseAddress + memory->Length) / PMM_PAGE_SIZE;
+                memblocks[nr_memblocks].node = numa_pxm_to_node(memory->ProximityDomain);
+                nr_memblocks++;
+                break;
+            }
+        }
+
+        entry += header->Length;
+    }
+
+    if(nr_nodes == 0) nr_nodes = 1;
+    return nr_memblocks > 0;
+}
+
+/**
+ * @brief Reads the node distances from the SLIT
+ *
+ * @param slit The SLIT
+ */
+static void numa_parse_slit(struct SLIT *slit)
+{
+    uint64_t localities = slit->NumberOfLocalities;
+    if(sizeof(struct SLIT) + localities * localities > slit->sdtHeader.Length)
+    {
+        log_line(LOG_WARN, "%s: The SLIT is truncated, ignoring it", __FUNCTION__);
+        return;
+    }
+
+    for(uint32_t from = 0; from < nr_nodes; from++)
+    {
+        for(uint32_t to = 0; to < nr_nodes; to++)
+        {
+            if(node_pxm[from] >= localities || node_pxm[to] >= localities) continue;
+            node_distance[from][to] = slit->Entries[node_pxm[from] * localities + node_pxm[to]];
+        }
+    }
+}
+
+/**
+ * @brief Discovers the NUMA topology from the ACPI SRAT and SLIT
+ * Without an SRAT the whole machine is a single node
+ * @note acpi_init has to be called before, pmm_init after
+ */
+void numa_init(void)
+{
+    nr_nodes = 1;
+    nr_memblocks = 0;
+    node_pxm[0] = 0;
+
+    for(uint32_t i = 0; i < NUMA_MAX_APIC_ID; i++) apic_node[i] = 0;
+
+    struct SRAT *srat = acpi_find_table(SRAT_SIGNATURE);
+    if(!srat || !numa_parse_srat(srat))
+    {
+        nr_nodes = 1;
+        nr_memblocks = 0;
+        node_distance[0][0] = NUMA_LOCAL_DISTANCE;
+        log_line(LOG_DEBUG, "%s: No memory affinity in the SRAT, running as a single node", __FUNCTION__);
+        return;
+    }
+
+    // Without a SLIT every other node is equally far
+    for(uint32_t from = 0; from < nr_nodes; from++)
+    {
+        for(uint32_t to = 0; to < nr_nodes; to++)
+        {
+            node_distance[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    struct SLIT *slit = acpi_find_table(SLIT_SIGNATURE);
+    if(slit) numa_parse_slit(slit);
+
+    // The initial APIC ID of the boot CPU
+    uint32_t ebx;
+    cpu_cpuid(1, 0, NULL, &ebx, NULL, NULL);
+    boot_node = apic_node[(ebx >> 24) & 0xFF];
+
+    log_line(LOG_SUCCESS, "%s: %u nodes, %u memory ranges, boot CPU on node %u", __FUNCTION__, nr_nodes, nr_memblocks, boot_node);
+    for(uint32_t i = 0; i < nr_memblocks; i++)
+    {
+        log_line(LOG_DEBUG, "\tNode %u: 0x%llx-0x%llx", memblocks[i].node,
+            memblocks[i].start_pfn * PMM_PAGE_SIZE, memblocks[i].end_pfn * PMM_PAGE_SIZE);
+    }
+}
+
+/**
+ * @brief Returns how many nodes the machine has
+ */
+uint32_t numa_node_count(void)
+{
+    return nr_nodes;
+}
+
+/**
+ * @brief Returns the node of the CPU we're running on
+ */
+uint32_t numa_current_node(void)
+{
+    return boot_node;
+}
+
+/**
+ * @brief Returns the node a page belongs to
+ *
+ * @param pfn The page frame number
+ * @return uint32_t The node, 0 if no SRAT range covers the page
+ */
+uint32_t numa_pfn_to_node(uint64_t pfn)
+{
+    for(uint32_t i = 0; i < nr_memblocks; i++)
+    {
+        if(pfn >= memblocks[i].start_pfn && pfn < memblocks[i].end_pfn) return memblocks[i].node;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Returns the relative distance between two nodes
+ *
+ * @param from The node doing the access
+ * @param to The node being accessed
+ * @return uint8_t The distance, NUMA_LOCAL_DISTANCE means the same node
+ */
+uint8_t numa_distance(uint32_t from, uint32_t to)
+{
+    if(from >= nr_nodes || to >= nr_nodes) return 0xFF;
+    return node_distance[from][to];
+}
@@ -25,7 +25,8 @@ static uint64_t *kernel_pml4_phys;
  * @param allocate If true then we allocate the page if non present and also intermediete page tables
  * @param is_huge If true then the virtual address belongs to a huge page (2MB)
  * @return uint64_t* the virtual address (HHDM) of the page table entry or NULL. If allocate = false then
- * the pte isn't present. If allocate = true then there was a problem allocating it
+ * the pte isn't present. If allocate = true then there was a problem allocating it.
+ * Without is_huge it's also NULL if a 2MB page maps the address
  * @note virt_addr does not have to be aligned to a page boundary
  */
 static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool allocate, bool is_huge)
@@ -49,15 +50,10 @@ static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool alloc
     {
         if(!allocate) return NULL;
         
-        // We allocate a new page for our new pdpr
-        uint64_t phys_new_pdpr = pmm_alloc(PAGING_PAGE_SIZE);
+        // We allocate a new zeroed page for our new pdpr, the zero pool usually has one ready
+        uint64_t phys_new_pdpr = pmm_alloc_zeroed(NULL);
         if(!phys_new_pdpr) return NULL;
 
-        virtual_pdpr = hhdm_physToVirt((void *)phys_new_pdpr);
-
-        // We have to set it to zero
-        memset(virtual_pdpr, 0x00, PAGING_PAGE_SIZE);
-
         // We set the directory entry as present, readable and writable by all
         pml4_root[pml4Index] = phys_new_pdpr | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
     }
@@ -72,15 +68,10 @@ static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool alloc
     {
         if(!allocate) return NULL;
 
-        // We allocate a new page for our new pd
-        uint64_t phys_new_pd = pmm_alloc(PAGING_PAGE_SIZE);
+        // We allocate a new zeroed page for our new pd, the zero pool usually has one ready
+        uint64_t phys_new_pd = pmm_alloc_zeroed(NULL);
         if(!phys_new_pd) return NULL;
 
-        virtual_pd = hhdm_physToVirt((void *)phys_new_pd);
-
-        // We have to set it to zero
-        memset(virtual_pd, 0x00, PAGING_PAGE_SIZE);
-
         // We set the directory entry as present, readable and writable by all 
         virtual_pdpr[pdprIndex] = phys_new_pd | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
     }
@@ -90,6 +81,9 @@ static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool alloc
     // If the page is huge we stop here
     if(is_huge) return &virtual_pd[pdIndex];
 
+    // A 2MB page covers the address, there's no page table below it
+    if(virtual_pd[pdIndex] & PTE_FLAG_PS) return NULL;
+
     // ************************ PD -> PT ********************************
     uint64_t *virtual_pt;
     // If the pd entry doesn't exist we must create it
@@ -97,15 +91,10 @@ static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool alloc
     {
         if(!allocate) return NULL;
 
-        // We allocate a new page for our new pt
-        uint64_t phys_new_pt = pmm_alloc(PAGING_PAGE_SIZE);
+        // We allocate a new zeroed page for our new pt, the zero pool usually has one ready
+        uint64_t phys_new_pt = pmm_alloc_zeroed(NULL);
         if(!phys_new_pt) return NULL;
 
-        virtual_pt = hhdm_physToVirt((void *)phys_new_pt);
-
-        // We have to set it to zero
-        memset(virtual_pt, 0x00, PAGING_PAGE_SIZE);
-
         // We set the directory entry as present, readable and writable by all 
         virtual_pd[pdIndex] = phys_new_pt | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
     }
@@ -114,6 +103,33 @@ static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool alloc
     return &virtual_pt[ptIndex];
 }
 
+/**
+ * @brief Returns the page table entry of a 4KB page without allocating anything
+ * 
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The virtual address belonging to the page
+ * @return uint64_t* the virtual address (HHDM) of the page table entry, NULL if a page table on the way isn't present
+ * or a 2MB page maps the address
+ * @note virt_addr does not have to be aligned to a page boundary
+ */
+uint64_t *paging_get_pte(uint64_t *pml4_root, uint64_t virt_addr)
+{
+    return vmm_get_pte(pml4_root, virt_addr, false, false);
+}
+
+/**
+ * @brief Returns the page directory entry of an address without allocating anything
+ * It either maps a 2MB page (PTE_FLAG_PS is set) or points to a page table
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The virtual address
+ * @return uint64_t* the virtual address (HHDM) of the page directory entry, NULL if a table on the way isn't present
+ * @note virt_addr does not have to be aligned to a page boundary
+ */
+uint64_t *paging_get_pde(uint64_t *pml4_root, uint64_t virt_addr)
+{
+    return vmm_get_pte(pml4_root, virt_addr, false, true);
+}
+
 /**
  * @brief This function takes a virtual address and maps the page associated to it to the physical page associated with the physical address
  * 
@@ -1,25 +1,38 @@
 #include <cpu.h>
+#include <devices/timer.h>
 #include <libk/stdio.h>
 #include <memory/gdt/gdt.h>
 #include <memory/pmm.h>
 #include <limine.h>
 #include <scheduling/lock.h>
+#include <scheduling/scheduler.h>
+#include <scheduling/task.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <memory/hhdm.h>
 #include <libk/string.h>
 #include <common/logging.h>
-#include <common/dll.h>
+#include <common/callsite.h>
 
 extern struct limine_memmap_request memmap_request;
 
 // Array of all pages
 static struct pmm_page *buddy_memmap = NULL;
+_Static_assert(sizeof(struct pmm_page) <= 16, "struct pmm_page must stay within 16 bytes");
 static uint64_t buddy_memmap_size = 0;
 
-// Array of free lists of each order
-static struct free_area free_areas[PMM_MAX_ORDER];
+// The memory zones of every node, each one with its own free lists
+static struct pmm_zone zones[NUMA_MAX_NODES][PMM_NR_ZONES];
+static struct pmm_node nodes[NUMA_MAX_NODES];
+static uint32_t nr_nodes = 1;
+
+// For every node the other nodes sorted by distance, where its allocations fall back to
+static uint32_t node_fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// The node of every 2^PMM_NODE_MAP_SHIFT pages, placed after the memmap
+static uint8_t *pfn_node_map = NULL;
+static uint64_t pfn_node_map_size = 0;
 
 // Used for statistics
 static uint64_t used_pages, totalPages;
@@ -30,11 +43,85 @@ static uint64_t highestAddr = 0;
 // The lock for our pmm, spinlock beacuse it can be called by ISRs
 static struct spinlock_irq pmm_lock = SPINLOCK_IRQ_INIT;
 
+// The order 0 page caches, one for each CPU
+static struct pmm_pcp pcp_caches[PMM_PCP_MAX_CPUS];
+
+// Pages the idle thread zeroed ahead of time
+static struct pmm_zero_pool zero_pool;
+static struct spinlock_irq zero_pool_lock = SPINLOCK_IRQ_INIT;
+
+// The usable RAM ranges, sorted and with adjacent entries merged
+static struct pmm_range pmm_ranges[PMM_MAX_RANGES];
+static uint64_t pmm_nr_ranges = 0;
+
+// How many TSC cycles pmm_init took
+static uint64_t pmm_init_cycles = 0;
+
+// One bit per memmap section, set once its descriptors are initialized
+static uint64_t section_ready[PMM_MAX_SECTIONS / 64];
+static uint64_t nr_sections = 0;
+
+// The first section that might still need to be initialized
+static uint64_t next_deferred_section = 0;
+
+// Usable pages inside sections that are not initialized yet, they count as free but are in no list
+static uint64_t deferred_pages = 0;
+
+// pmm_alloc_contig is emptying [start, end), pages freed inside it are captured instead of going back to the buddy lists
+static uint64_t contig_window_start = 0, contig_window_end = 0;
+
+// Serializes the contiguous allocations, the migrator can sleep so a spinlock won't do
+static struct mutex contig_lock = MUTEX_INIT;
+
+// Moves the movable pages out of a physical range, registered by the vmm
+static uint64_t (*contig_migrator)(uint64_t start_phys, uint64_t end_phys) = NULL;
+
+// Contiguous allocator statistics
+static uint64_t contig_allocs = 0, contig_failures = 0, contig_pages = 0;
+
+// Pages moved by the migrator, for contiguous runs and compaction
+static uint64_t migrated_pages = 0;
+
+// Compaction statistics
+static uint64_t compact_attempts = 0, compact_success = 0, compact_failures = 0;
+
+// The idle thread skips 2^compact_defer_shift calls after a compaction that failed
+static uint32_t compact_defer_shift = 0;
+static uint64_t compact_deferred = 0;
+
+// The registered shrinkers. The mutex only orders registration and the scans, which never sleep
+static struct pmm_shrinker *shrinkers = NULL;
+static struct mutex shrinker_lock = MUTEX_INIT;
+
+// The background reclaim thread, woken when a zone goes below its low watermark
+static struct thread *reclaim_thread = NULL;
+
+// Set while the reclaim thread is bringing the zones back above their high watermark
+static volatile bool reclaim_pressure = false;
+
+// Reclaim statistics
+static uint64_t reclaim_runs = 0, reclaim_direct = 0, reclaim_pages = 0;
+
+#if PMM_TRACE
+// Live memory per caller, an open addressing table whose slots are never removed
+static struct pmm_trace_entry trace_table[PMM_TRACE_SLOTS];
+static struct callsite_table trace_sites = CALLSITE_TABLE_INIT(trace_table, PMM_TRACE_SHIFT, PMM_TRACE_PROBES);
+
+// Allocations whose caller found no slot
+static uint64_t trace_dropped = 0;
+#endif
+
 /********************** UTILITY FUNCTIONS FOR BUDDY ***********************/
 
+static inline bool section_is_ready(uint64_t section)
+{
+    return section_ready[section / 64] & (1ULL << (section % 64));
+}
+
+// Descriptors of sections that are not initialized yet hold garbage, so they don't exist
 static inline struct pmm_page *pfn_to_page(uint64_t pfn)
 {
-    if(pfn >= totalPages) return NULL;
+    if(pfn >= totalPages || !section_is_ready(pfn / PMM_SECTION_PAGES)) return NULL;
     return &buddy_memmap[pfn];
 }
 
@@ -45,199 +132,2045 @@ static inline uint64_t page_to_phys(struct pmm_page *page) { return page_to_pfn(
 
 static inline struct pmm_page *phys_to_page(uint64_t phys) { return pfn_to_page(phys/PMM_PAGE_SIZE); }
 
-static inline bool is_page_free(struct pmm_page *page) { return (page->flags & PMM_FLAG_FREE) != 0; }
+static inline uint32_t page_flags(struct pmm_page *page) { return page->info & PMM_INFO_FLAGS_MASK; }
 
-/*************************************************************************/
+static inline uint32_t page_order(struct pmm_page *page) { return (page->info & PMM_INFO_ORDER_MASK) >> PMM_INFO_ORDER_SHIFT; }
+
+static inline uint32_t page_ref_count(struct pmm_page *page) { return page->info >> PMM_INFO_REF_SHIFT; }
+
+
+// Overwrites the whole info word at once
+static inline void page_set_info(struct pmm_page *page, uint32_t flags, uint32_t order, uint32_t ref_count)
+{
+    page->info = flags | (order << PMM_INFO_ORDER_SHIFT) | (ref_count << PMM_INFO_REF_SHIFT);
+}
+
+// The biggest block that starts at pfn, is aligned to its size and ends before end_pfn
+static inline uint32_t max_block_order(uint64_t pfn, uint64_t end_pfn)
+{
+    uint32_t order = PMM_MAX_ORDER - 1;
+    if(pfn & ((1ULL << order) - 1)) order = __builtin_ctzll(pfn);
+
+    uint64_t left = end_pfn - pfn;
+    if(left < (1ULL << order)) order = 63 - __builtin_clzll(left);
+
+    return order;
+}
 
+#if PMM_TRACE
 /**
- * @brief Frees an entire block of pages of order x
+ * @brief Charges a block to its caller, the slot is kept in the prev field
+ * of the head page which is unused while the block is allocated
  * 
- * @param phys The physical address of the starting block. HAS to be aligned
- * @param order The size of the block: 0 = 4KB up to PMM_MAX_ORDER
+ * @param phys The block, 0 if the allocation failed
+ * @param nr_pages How many pages the block has
+ * @param caller The return address of the allocation call
  */
-void pmm_free_pages(uint64_t phys, uint32_t order)
+static void pmm_trace_alloc(uint64_t phys, uint64_t nr_pages, void *caller)
 {
-    if(phys % PMM_PAGE_SIZE)
+    if(!phys) return;
+
+    uint32_t slot = callsite_slot(&trace_sites, caller);
+    buddy_memmap[phys / PMM_PAGE_SIZE].prev = slot;
+
+    if(slot == CALLSITE_NONE)
     {
-        log_line(LOG_WARN, "%s: Warning freeing unaligned address %llx", __FUNCTION__, phys);
+        __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
         return;
     }
 
-    uint64_t irq_flags;
-    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+    __atomic_add_fetch(&trace_table[slot].live_bytes, nr_pages * PMM_PAGE_SIZE, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trace_table[slot].allocs, 1, __ATOMIC_RELAXED);
+}
 
-    // Get the page we're referring to
-    uint64_t pfn = phys / PMM_PAGE_SIZE;
-    struct pmm_page *page = pfn_to_page(pfn);
-    if(!page) 
+/**
+ * @brief Gives a block back to the caller that allocated it
+ * 
+ * @param pfn The head page of the block
+ * @param nr_pages How many pages the block has
+ */
+static void pmm_trace_free(uint64_t pfn, uint64_t nr_pages)
+{
+    uint32_t slot = buddy_memmap[pfn].prev;
+    buddy_memmap[pfn].prev = PMM_PFN_NONE;
+    if(slot >= PMM_TRACE_SLOTS) return;
+
+    __atomic_sub_fetch(&trace_table[slot].live_bytes, nr_pages * PMM_PAGE_SIZE, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trace_table[slot].frees, 1, __ATOMIC_RELAXED);
+}
+
+// Used by the public allocation functions, so the caller is whoever called them
+#define PMM_TRACE_ALLOC(phys, nr_pages) pmm_trace_alloc((phys), (nr_pages), __builtin_return_address(0))
+#define PMM_TRACE_FREE(pfn, nr_pages) pmm_trace_free((pfn), (nr_pages))
+
+// The dump sorts the callers by the memory they hold
+static int64_t pmm_trace_key(const void *entry)
+{
+    return __atomic_load_n(&((const struct pmm_trace_entry *)entry)->live_bytes, __ATOMIC_RELAXED);
+}
+#else
+#define PMM_TRACE_ALLOC(phys, nr_pages) ((void)0)
+#define PMM_TRACE_FREE(pfn, nr_pages) ((void)0)
+#endif
+
+static inline bool contig_window_contains(uint64_t pfn)
+{
+    return pfn >= contig_window_start && pfn < contig_window_end;
+}
+
+/*************************************************************************/
+
+/************************ PFN LINKED PAGE LISTS ***************************/
+
+static inline void pmm_list_init(struct pmm_list *list)
+{
+    list->head = PMM_PFN_NONE;
+    list->tail = PMM_PFN_NONE;
+}
+
+static inline bool pmm_list_empty(struct pmm_list *list) { return list->head == PMM_PFN_NONE; }
+
+static inline void pmm_list_push_head(struct pmm_list *list, uint64_t pfn)
+{
+    struct pmm_page *page = &buddy_memmap[pfn];
+    page->prev = PMM_PFN_NONE;
+    page->next = list->head;
+
+    if(list->head == PMM_PFN_NONE) list->tail = pfn;
+    else buddy_memmap[list->head].prev = pfn;
+
+    list->head = pfn;
+}
+
+static inline void pmm_list_push_tail(struct pmm_list *list, uint64_t pfn)
+{
+    struct pmm_page *page = &buddy_memmap[pfn];
+    page->next = PMM_PFN_NONE;
+    page->prev = list->tail;
+
+    if(list->tail == PMM_PFN_NONE) list->head = pfn;
+    else buddy_memmap[list->tail].next = pfn;
+
+    list->tail = pfn;
+}
+
+static inline void pmm_list_remove(struct pmm_list *list, uint64_t pfn)
+{
+    struct pmm_page *page = &buddy_memmap[pfn];
+
+    if(page->prev == PMM_PFN_NONE) list->head = page->next;
+    else buddy_memmap[page->prev].next = page->next;
+
+    if(page->next == PMM_PFN_NONE) list->tail = page->prev;
+    else buddy_memmap[page->next].prev = page->prev;
+
+    page->next = page->prev = PMM_PFN_NONE;
+}
+
+/*************************************************************************/
+
+/*************************** FREE AREAS BOOKKEEPING ***********************/
+
+static inline uint32_t pfn_to_node(uint64_t pfn) { return pfn_node_map[pfn >> PMM_NODE_MAP_SHIFT]; }
+
+static inline enum pmm_zone_type pfn_to_zone_type(uint64_t pfn)
+{
+    if(pfn < PMM_ZONE_DMA_END / PMM_PAGE_SIZE) return PMM_ZONE_DMA;
+    if(pfn < PMM_ZONE_DMA32_END / PMM_PAGE_SIZE) return PMM_ZONE_DMA32;
+    return PMM_ZONE_NORMAL;
+}
+
+// The zone a page belongs to, blocks never cross zones or nodes so the head is enough
+static inline struct pmm_zone *pfn_to_zone(uint64_t pfn)
+{
+    return &zones[pfn_to_node(pfn)][pfn_to_zone_type(pfn)];
+}
+
+// Is the block of this order starting at pfn free in the buddy lists? Only the head of a free block is flagged
+static inline bool is_block_free(uint64_t pfn, uint32_t order)
+{
+    struct pmm_page *page = &buddy_memmap[pfn];
+    return (page_flags(page) & PMM_FLAG_FREE) && page_order(page) == order;
+}
+
+// Inserts a free block in the list of its order keeping the mask in sync
+static inline void free_area_add(struct pmm_zone *zone, uint64_t pfn, uint32_t order)
+{
+    page_set_info(&buddy_memmap[pfn], PMM_FLAG_FREE, order, 0);
+    pmm_list_push_head(&zone->free_areas[order].list, pfn);
+    zone->free_areas[order].nr_free++;
+    zone->free_area_mask |= 1u << order;
+    zone->free_pages += 1ULL << order;
+}
+
+// Removes a free block from the list of its order keeping the mask in sync
+static inline void free_area_del(struct pmm_zone *zone, uint64_t pfn, uint32_t order)
+{
+    pmm_list_remove(&zone->free_areas[order].list, pfn);
+    zone->free_areas[order].nr_free--;
+    if(pmm_list_empty(&zone->free_areas[order].list)) zone->free_area_mask &= ~(1u << order);
+    zone->free_pages -= 1ULL << order;
+}
+
+/*************************************************************************/
+
+/*********************** DEFERRED MEMMAP INIT ***************************/
+
+/**
+ * @brief Puts a range of pages in the free lists as maximal aligned blocks
+ * Every block is already as big as its alignment and the range allow,
+ * so no coalescing is needed and only the head of every block is touched
+ * 
+ * @param start_pfn The first page of the range
+ * @param end_pfn The first page after the range
+ * @return uint64_t How many pages were added
+ * @note Must only run while nothing else can touch the buddy lists
+ */
+static uint64_t pmm_build_range(uint64_t start_pfn, uint64_t end_pfn)
+{
+    uint64_t pfn = start_pfn;
+    while(pfn < end_pfn)
+    {
+        uint32_t order = max_block_order(pfn, end_pfn);
+
+        // Zone boundaries are aligned to the biggest order, the head tells the zone
+        free_area_add(pfn_to_zone(pfn), pfn, order);
+        pfn += 1ULL << order;
+    }
+
+    return end_pfn - start_pfn;
+}
+
+/**
+ * @brief Initializes the descriptors of a memmap section
+ * and puts the usable pages inside it in the free lists
+ * 
+ * @param section The section to initialize
+ * @note pmm_lock has to be held by the caller (or nothing else can run yet)
+ */
+static void pmm_init_section(uint64_t section)
+{
+    uint64_t start_pfn = section * PMM_SECTION_PAGES;
+    uint64_t end_pfn = start_pfn + PMM_SECTION_PAGES;
+    if(end_pfn > totalPages) end_pfn = totalPages;
+
+    // A zeroed descriptor is a reserved page (or the tail of a block),
+    // only the heads of the blocks we build get touched afterwards
+    memset(&buddy_memmap[start_pfn], 0, (end_pfn - start_pfn) * sizeof(struct pmm_page));
+
+    // Blocks never cross a section since sections are aligned to the biggest order
+    uint64_t built = 0;
+    for(size_t i = 0; i < pmm_nr_ranges; i++)
+    {
+        uint64_t start = pmm_ranges[i].start_pfn > start_pfn ? pmm_ranges[i].start_pfn : start_pfn;
+        uint64_t end = pmm_ranges[i].end_pfn < end_pfn ? pmm_ranges[i].end_pfn : end_pfn;
+        if(start < end) built += pmm_build_range(start, end);
+    }
+
+    deferred_pages -= built;
+    section_ready[section / 64] |= 1ULL << (section % 64);
+}
+
+/**
+ * @brief Initializes the next section that is not ready yet
+ * Sections are handed out one at a time, so once SMP exists
+ * every CPU can pull from here in parallel
+ * 
+ * @return true If a section was initialized
+ * @return false If the whole memmap is already initialized
+ * @note pmm_lock has to be held by the caller
+ */
+static bool pmm_init_next_section(void)
+{
+    while(next_deferred_section < nr_sections && section_is_ready(next_deferred_section))
+    {
+        next_deferred_section++;
+    }
+
+    if(next_deferred_section == nr_sections) return false;
+
+    pmm_init_section(next_deferred_section++);
+    return true;
+}
+
+/**
+ * @brief Initializes the first section spanned by a zone that is not ready yet
+ * 
+ * @param zone The zone that needs more memory
+ * @return true If a section was initialized
+ * @return false If every section of the zone is already initialized
+ * @note pmm_lock has to be held by the caller
+ */
+static bool pmm_init_zone_section(struct pmm_zone *zone)
+{
+    if(zone->start_pfn >= zone->end_pfn) return false;
+
+    uint64_t first = zone->start_pfn / PMM_SECTION_PAGES;
+    if(first < next_deferred_section) first = next_deferred_section;
+    uint64_t last = (zone->end_pfn - 1) / PMM_SECTION_PAGES;
+
+    for(uint64_t section = first; section <= last; section++)
+    {
+        if(!section_is_ready(section))
+        {
+            pmm_init_section(section);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief The background thread that initializes the rest of the memmap
+ */
+static void pmm_deferred_init_worker(void)
+{
+    uint64_t start = timer_read_tsc();
+    uint64_t sections = 0;
+
+    while(true)
     {
+        uint64_t irq_flags;
+        spinlock_irq_acquire(&pmm_lock, &irq_flags);
+        bool done = !pmm_init_next_section();
         spinlock_irq_release(&pmm_lock, &irq_flags);
+
+        if(done) break;
+        sections++;
+
+        // Give the CPU back between sections, boot shouldn't wait for us
+        scheduler_yield();
+    }
+
+    log_line(LOG_SUCCESS, "%s: Deferred memmap init done, %llu sections in %llu us", 
+        __FUNCTION__, sections, timer_tsc_to_us(timer_read_tsc() - start));
+}
+
+/**
+ * @brief Starts a kernel thread that initializes the memmap sections pmm_init skipped
+ * Allocations that run out of memory before it finishes initialize sections on their own
+ * @note The scheduler has to be initialized
+ */
+void pmm_start_deferred_init(void)
+{
+    if(next_deferred_section == nr_sections) return;
+
+    struct task *task = task_create("pmm deferred init");
+    if(!task || !task_create_thread(task, pmm_deferred_init_worker))
+    {
+        log_line(LOG_WARN, "%s: Cannot create the deferred init thread, sections will be initialized on demand", __FUNCTION__);
+    }
+}
+
+/*************************************************************************/
+
+/**
+ * @brief Gives a block back to the buddy lists, coalescing it with its buddies
+ * 
+ * @param pfn The page frame number of the starting block. HAS to be aligned to the order
+ * @param order The size of the block: 0 = 4KB up to PMM_MAX_ORDER
+ * @note pmm_lock has to be held by the caller
+ */
+static void buddy_free_block(uint64_t pfn, uint32_t order)
+{
+    struct pmm_page *page = pfn_to_page(pfn);
+    if(!page) return;
+
+    // pmm_alloc_contig is emptying this range, the page becomes part of it.
+    // Only order 0 movable pages can be freed inside the window
+    if(contig_window_contains(pfn))
+    {
+        page_set_info(page, PMM_FLAG_ISOLATED, 0, 0);
         return;
     }
 
+    struct pmm_zone *zone = pfn_to_zone(pfn);
+    used_pages -= (1ULL << order);
+
     // Coalescing buddys
     while(order < PMM_MAX_ORDER - 1)
     {
         // Get the buddy page
         uint64_t buddy_pfn = pfn ^ (1 << order);
-        struct pmm_page *buddy_page = pfn_to_page(buddy_pfn);
         
-        // If the buddy doesn't exist or it's outside our RAM, stop
-        if(!buddy_page || buddy_pfn >= totalPages) break;
+        // If the buddy is (even partially) outside our RAM, stop
+        if(buddy_pfn + (1ULL << order) > totalPages) break;
 
-        // We can merge if and only if:
-        // 1) Buddy is free
-        // 2) Buddy has the same order
-        if(!is_page_free(buddy_page) || buddy_page->order != order) break;
+        // We can merge if and only if the buddy is a free block of the same order
+        if(!is_block_free(buddy_pfn, order)) break;
 
         // We found a valid buddy to coalesce with
 
         // Remove the buddy from his free list
-        dll_delete(&buddy_page->link);
-        free_areas[order].nr_free--;
+        free_area_del(zone, buddy_pfn, order);
 
         // Cleanup
-        buddy_page->order = 0;
+        buddy_memmap[buddy_pfn].info = 0;
 
         // If buddy comes before us we set it to be the new "manager"
         if(buddy_pfn < pfn)
         {
+            page->info = 0;
             pfn = buddy_pfn;
-            page = buddy_page;
+            page = &buddy_memmap[pfn];
         }
 
         order++;
     }
 
-    // We set the newly coalesced page as free
-    page->order = order;
-    page->flags = PMM_FLAG_FREE;
-    page->ref_count = 0;
+    // We set the newly coalesced page as free and add it to our free areas list
+    free_area_add(zone, pfn, order);
+}
+
+/**
+ * @brief Takes a block of the requested order out of the buddy lists of a zone
+ * 
+ * @param zone The zone to take the block from
+ * @param order The order of the block we want
+ * @return struct pmm_page* The head page of the block, NULL if the zone has no block big enough
+ * @note pmm_lock has to be held by the caller, the returned page info is left to the caller
+ */
+static struct pmm_page *buddy_alloc_block(struct pmm_zone *zone, uint32_t order)
+{
+    // The lowest set bit at or above our order is the smallest non empty list that fits
+    uint32_t candidates = zone->free_area_mask >> order;
+    if(!candidates) return NULL;
+
+    uint32_t current_order = order + __builtin_ctz(candidates);
+
+    // Delete the node since it's not free anymore
+    uint64_t pfn = zone->free_areas[current_order].list.head;
+    free_area_del(zone, pfn, current_order);
+
+    // Splitting
+    // If our order is bigger we simply split it until it's of the correct size
+    while(current_order > order)
+    {
+        current_order--;
+
+        // We find our buddy and add it to our list of free pages
+        uint64_t buddy_pfn = pfn ^ (1 << current_order);
+        free_area_add(zone, buddy_pfn, current_order);
+    }
+
+    used_pages += (1ULL << order);
+
+    return &buddy_memmap[pfn];
+}
+
+/**
+ * @brief Takes a block from the highest allowed zone of a node, falling back to the
+ * lower zones and then to the other nodes from the nearest to the farthest
+ * The first pass keeps every zone above its watermarks (low for the zone that was asked,
+ * high for the fallbacks so that DMA and remote memory aren't eaten by normal allocations),
+ * the second pass empties the zone that was asked but leaves the fallbacks their min watermark
+ * 
+ * @param node The node the memory should come from
+ * @param highest The highest zone the caller can use
+ * @param order The order of the block we want
+ * @return struct pmm_page* The head page of the block, NULL if there's no memory left
+ * @note pmm_lock has to be held by the caller, the returned page info is left to the caller
+ */
+static struct pmm_page *zone_alloc_block(uint32_t node, enum pmm_zone_type highest, uint32_t order)
+{
+    for(int pass = 0; pass < 2; pass++)
+    {
+        for(uint32_t n = 0; n < nr_nodes; n++)
+        {
+            uint32_t current_node = node_fallback[node][n];
+
+            for(int z = highest; z >= 0; z--)
+            {
+                struct pmm_zone *zone = &zones[current_node][z];
+                bool preferred = current_node == node && z == (int)highest;
+                uint64_t mark;
+                if(pass == 0) mark = preferred ? zone->watermark_low : zone->watermark_high;
+                else mark = preferred ? 0 : zone->watermark_min;
+
+                // Part of the zone may still be waiting to be initialized
+                while((zone->free_pages < mark + (1ULL << order) || !(zone->free_area_mask >> order)) 
+                    && pmm_init_zone_section(zone));
+
+                if(zone->free_pages < mark + (1ULL << order)) continue;
+
+                struct pmm_page *page = buddy_alloc_block(zone, order);
+                if(!page) continue;
+
+                zone->allocs++;
+                if(!preferred) zone->fallbacks++;
+
+                // Start freeing memory before the zone runs dry
+                if(zone->free_pages < zone->watermark_low && reclaim_thread) thread_wake(reclaim_thread);
+                return page;
+            }
+        }
+    }
+
+    zones[node][highest].failures++;
+    return NULL;
+}
+
+/**
+ * @brief Returns the page cache of the CPU we're running on
+ * @note Interrupts have to be disabled so that we can't be moved while using it
+ */
+static inline struct pmm_pcp *pmm_pcp_this_cpu(void)
+{
+    return &pcp_caches[0];
+}
+
+/**
+ * @brief Moves a batch of order 0 pages from the buddy lists to the cold end of a per-CPU cache
+ * 
+ * @param pcp The per-CPU cache to refill
+ * @note Interrupts have to be disabled by the caller
+ */
+static void pmm_pcp_refill(struct pmm_pcp *pcp)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    uint64_t moved = 0;
+    for(; moved < PMM_PCP_BATCH; moved++)
+    {
+        struct pmm_page *page = zone_alloc_block(numa_current_node(), PMM_ZONE_NORMAL, 0);
+        if(!page) break;
+
+        page_set_info(page, PMM_FLAG_PCP, 0, 0);
+        pmm_list_push_tail(&pcp->list, page_to_pfn(page));
+        pcp->count++;
+    }
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+
+    // Only batches that took something, the buddy lists may be dry
+    if(moved) pcp->refills++;
+}
+
+/**
+ * @brief Gives back a batch of the coldest pages of a per-CPU cache to the buddy lists
+ * 
+ * @param pcp The per-CPU cache to drain
+ * @param nr_pages The maximum amount of pages to drain
+ * @note Interrupts have to be disabled by the caller
+ */
+static void pmm_pcp_drain(struct pmm_pcp *pcp, uint64_t nr_pages)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    uint64_t moved = 0;
+    for(; moved < nr_pages && pcp->count > 0; moved++)
+    {
+        uint64_t pfn = pcp->list.tail;
+        pmm_list_remove(&pcp->list, pfn);
+        pcp->count--;
+
+        buddy_free_block(pfn, 0);
+    }
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+    if(moved) pcp->drains++;
+}
+
+#if PMM_DEBUG
+/**
+ * @brief Checks that an address is the head of a block the allocator handed out
+ * 
+ * @param phys The physical address being freed
+ * @param caller The function doing the free, for the log
+ * @return true If the head is valid
+ */
+static bool pmm_check_head(uint64_t phys, const char *caller)
+{
+    struct pmm_page *page = phys_to_page(phys);
+    if(phys % PMM_PAGE_SIZE || !page)
+    {
+        log_line(LOG_ERROR, "%s: 0x%llx is not a page we manage", caller, phys);
+        return false;
+    }
+
+    if(!(page_flags(page) & PMM_FLAG_USED))
+    {
+        log_line(LOG_ERROR, "%s: 0x%llx is not allocated (flags 0x%x), double free?", caller, phys, page_flags(page));
+        return false;
+    }
+
+    uint64_t pfn = phys / PMM_PAGE_SIZE;
+    uint32_t order = page_order(page);
+    if(pfn & ((1ULL << order) - 1))
+    {
+        log_line(LOG_ERROR, "%s: 0x%llx is not aligned to its order %u", caller, phys, order);
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+/**
+ * @brief Frees an entire block of pages of order x
+ * Order 0 blocks are pushed to the hot end of the per-CPU cache
+ * without taking the buddy lock
+ * @param phys The physical address of the starting block. HAS to be aligned
+ * @param order The size of the block: 0 = 4KB up to PMM_MAX_ORDER
+ * @note pmm_free_addr finds the order on its own
+ */
+void pmm_free_pages(uint64_t phys, uint32_t order)
+{
+    if(phys % PMM_PAGE_SIZE)
+    {
+        log_line(LOG_WARN, "%s: Warning freeing unaligned address %llx", __FUNCTION__, phys);
+        return;
+    }
+
+    // Get the page we're referring to
+    uint64_t pfn = phys / PMM_PAGE_SIZE;
+    struct pmm_page *page = pfn_to_page(pfn);
+    if(!page) return;
+
+#if PMM_DEBUG
+    if(!pmm_check_head(phys, __FUNCTION__)) return;
+    if(page_order(page) != order)
+    {
+        log_line(LOG_ERROR, "%s: 0x%llx was allocated with order %u, not %u", __FUNCTION__, phys, page_order(page), order);
+        return;
+    }
+#endif
+
+    PMM_TRACE_FREE(pfn, 1ULL << order);
+
+    // Pages inside the window of a contiguous allocation skip the cache so that they can be captured
+    if(order == 0 && !contig_window_contains(pfn))
+    {
+        uint64_t irq_flags = interrupts_save_and_disable();
+        struct pmm_pcp *pcp = pmm_pcp_this_cpu();
+
+        page_set_info(page, PMM_FLAG_PCP, 0, 0);
+        pmm_list_push_head(&pcp->list, pfn);
+        pcp->count++;
+
+        // Too many pages are sitting in the cache, give the cold ones back
+        if(pcp->count >= PMM_PCP_HIGH)
+        {
+            pmm_pcp_drain(pcp, PMM_PCP_BATCH);
+        }
+
+        interrupts_restore(irq_flags);
+        return;
+    }
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    buddy_free_block(pfn, order);
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+}
+
+/**
+ * @brief Takes a page out of the zero pool
+ * 
+ * @return uint64_t The physical address of the zeroed page, 0 if the pool is empty
+ */
+static uint64_t pmm_zero_pool_take(void)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&zero_pool_lock, &irq_flags);
+
+    uint64_t pfn = zero_pool.list.head;
+    if(pfn == PMM_PFN_NONE)
+    {
+        spinlock_irq_release(&zero_pool_lock, &irq_flags);
+        return 0;
+    }
+
+    pmm_list_remove(&zero_pool.list, pfn);
+    zero_pool.count--;
+    page_set_info(&buddy_memmap[pfn], PMM_FLAG_USED, 0, 1);
+
+    spinlock_irq_release(&zero_pool_lock, &irq_flags);
+    return pfn * PMM_PAGE_SIZE;
+}
+
+/**
+ * @brief Picks the node an allocation should come from
+ * 
+ * @param policy The memory policy, NULL for the default one (local)
+ * @return uint32_t The node
+ */
+static uint32_t pmm_policy_node(struct numa_policy *policy)
+{
+    if(!policy || nr_nodes == 1) return numa_current_node();
+
+    switch(policy->mode)
+    {
+        case NUMA_POLICY_PREFERRED:
+            if(policy->node < nr_nodes) return policy->node;
+            break;
+
+        case NUMA_POLICY_INTERLEAVE:
+            // Skip the nodes without memory, a race on next only skews the rotation
+            for(uint32_t i = 0; i < nr_nodes; i++)
+            {
+                uint32_t node = policy->next++ % nr_nodes;
+                if(nodes[node].present_pages)
+                {
+                    __atomic_add_fetch(&nodes[node].interleave, 1, __ATOMIC_RELAXED);
+                    return node;
+                }
+            }
+            break;
+
+        case NUMA_POLICY_LOCAL:
+            break;
+    }
+
+    return numa_current_node();
+}
+
+// Records whether an allocation got memory from the node it wanted
+static inline void pmm_account_node(uint32_t wanted, uint64_t pfn)
+{
+    uint32_t got = pfn_to_node(pfn);
+    if(got == wanted)
+    {
+        __atomic_add_fetch(&nodes[wanted].hits, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&nodes[got].misses, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&nodes[wanted].foreign, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static bool pmm_compact_node(uint32_t order, enum pmm_zone_type zone, uint32_t node);
+static uint64_t contig_alloc(uint64_t nr_pages, uint64_t align_pages, enum pmm_zone_type zone);
+
+/**
+ * @brief Allocates 2^(12 + order) bytes from a node, below the end of a zone
+ * Only order 0 requests for the local node that can use any zone
+ * go through the per-CPU cache
+ * 
+ * @param order 
+ * @param zone The highest zone the memory can come from
+ * @param node The node the memory should come from, other nodes are used when it's full
+ * @return uint64_t the starting physical address of the newly allocated block, 0 if it failed
+ */
+static uint64_t pmm_try_alloc_pages_node(uint32_t order, enum pmm_zone_type zone, uint32_t node)
+{
+
+    struct pmm_page *page;
+
+    if(order == 0 && zone == PMM_ZONE_NORMAL && node == numa_current_node())
+    {
+        uint64_t irq_flags = interrupts_save_and_disable();
+        struct pmm_pcp *pcp = pmm_pcp_this_cpu();
+
+        if(pcp->count == 0)
+        {
+            pmm_pcp_refill(pcp);
+        }
+        else 
+        {
+            pcp->hits++;
+        }
+
+        if(pcp->count == 0)
+        {
+            // Not even the buddy lists have pages left, the zeroed ones are our last resort
+            interrupts_restore(irq_flags);
+            uint64_t phys = pmm_zero_pool_take();
+            if(phys) pmm_account_node(node, phys / PMM_PAGE_SIZE);
+            return phys;
+        }
+
+        // Take the hottest page
+        uint64_t pfn = pcp->list.head;
+        pmm_list_remove(&pcp->list, pfn);
+        pcp->count--;
+
+        page = &buddy_memmap[pfn];
+        page_set_info(page, PMM_FLAG_USED, 0, 1);
+        pmm_account_node(node, pfn);
+
+        interrupts_restore(irq_flags);
+        return page_to_phys(page);
+    }
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    page = zone_alloc_block(node, zone, order);
+
+    // High order allocations fail because of fragmentation long before memory runs out,
+    // compact if we're allowed to sleep and try again
+    if(!page && order > 0 && (irq_flags & RFLAGS_IF))
+    {
+        spinlock_irq_release(&pmm_lock, &irq_flags);
+        bool compacted = pmm_compact_node(order, zone, node);
+        spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+        if(compacted) page = zone_alloc_block(node, zone, order);
+    }
+
+    if(!page)
+    {
+        spinlock_irq_release(&pmm_lock, &irq_flags);
+        return 0;
+    }
+
+    page_set_info(page, PMM_FLAG_USED, order, 1);
+    pmm_account_node(node, page_to_pfn(page));
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+
+    return page_to_phys(page);
+}
+
+/**
+ * @brief Like pmm_try_alloc_pages_node, but when memory runs out and the caller
+ * can sleep the shrinkers are asked to give pages back before failing.
+ * It never waits for the shrinker lock: a shrinker that allocates would wait for itself
+ */
+static uint64_t pmm_alloc_pages_node(uint32_t order, enum pmm_zone_type zone, uint32_t node)
+{
+    uint64_t phys = pmm_try_alloc_pages_node(order, zone, node);
+    if(phys) return phys;
+
+    // Interrupts are disabled: we may be inside an ISR or holding a spinlock
+    uint64_t irq_flags = interrupts_save_and_disable();
+    interrupts_restore(irq_flags);
+    if(!(irq_flags & RFLAGS_IF)) return 0;
+
+    uint64_t wanted = (1ULL << order) > PMM_RECLAIM_BATCH ? (1ULL << order) : PMM_RECLAIM_BATCH;
+    for(uint32_t retry = 0; !phys && retry < PMM_RECLAIM_RETRIES; retry++)
+    {
+        __atomic_add_fetch(&reclaim_direct, 1, __ATOMIC_RELAXED);
+        if(!pmm_try_reclaim(wanted)) break;
+
+        phys = pmm_try_alloc_pages_node(order, zone, node);
+    }
+
+    return phys;
+}
+
+/**
+ * @brief Allocates 2^(12 + order) bytes from any zone of the local node.
+ * Order 0 requests are served by the per-CPU cache which is
+ * refilled in batches from the buddy lists
+ * @param order 
+ * @return uint64_t the starting physical address of the newly allocated block
+ * returns 0 if the allocation failed
+ * @note the returned address is ALWAYS aligned to a page boundary
+ */
+uint64_t pmm_alloc_pages(uint32_t order)
+{
+    if(order >= PMM_MAX_ORDER) return 0;
+
+    uint64_t phys = pmm_alloc_pages_node(order, PMM_ZONE_NORMAL, numa_current_node());
+    PMM_TRACE_ALLOC(phys, 1ULL << order);
+    return phys;
+}
+
+/**
+ * @brief Allocates 2^(12 + order) bytes below the end of a zone
+ * The zone is tried first, then the ones below it
+ * @param order 
+ * @param zone The highest zone the memory can come from (PMM_ZONE_DMA32 for memory below 4GB)
+ * @return uint64_t the starting physical address of the newly allocated block
+ * returns 0 if the allocation failed
+ * @note the returned address is ALWAYS aligned to a page boundary
+ */
+uint64_t pmm_alloc_pages_zone(uint32_t order, enum pmm_zone_type zone)
+{
+    if(order >= PMM_MAX_ORDER || zone >= PMM_NR_ZONES) return 0;
+
+    uint64_t phys = pmm_alloc_pages_node(order, zone, numa_current_node());
+    PMM_TRACE_ALLOC(phys, 1ULL << order);
+    return phys;
+}
+
+/**
+ * @brief Allocates 2^(12 + order) bytes below the end of a zone, on the node a memory policy picks
+ * 
+ * @param order 
+ * @param zone The highest zone the memory can come from
+ * @param policy The memory policy, NULL for the default one (local)
+ * @return uint64_t the starting physical address of the newly allocated block
+ * returns 0 if the allocation failed
+ * @note the returned address is ALWAYS aligned to a page boundary
+ */
+uint64_t pmm_alloc_pages_policy(uint32_t order, enum pmm_zone_type zone, struct numa_policy *policy)
+{
+    if(order >= PMM_MAX_ORDER || zone >= PMM_NR_ZONES) return 0;
+
+    uint64_t phys = pmm_alloc_pages_node(order, zone, pmm_policy_node(policy));
+    PMM_TRACE_ALLOC(phys, 1ULL << order);
+    return phys;
+}
+
+/**
+ * @brief Allocates many single pages under a single hold of the buddy lock
+ * Instead of splitting a block down to one page and putting the buddies back every time,
+ * the biggest block that fits what's left is taken once and all its pages are handed out
+ * 
+ * @param nr_pages How many pages we want
+ * @param pages Filled with the physical addresses of the pages
+ * @param policy The memory policy, NULL for the default one (local). It picks the node of every block
+ * @return uint64_t How many pages were allocated, less than nr_pages if we ran out of memory
+ * @note The pages are independent: free them with pmm_free_bulk or one by one with pmm_free_addr
+ */
+uint64_t pmm_alloc_bulk(uint64_t nr_pages, uint64_t *pages, struct numa_policy *policy)
+{
+    if(!pages) return 0;
+
+    uint64_t allocated = 0;
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    while(allocated < nr_pages)
+    {
+        uint32_t node = pmm_policy_node(policy);
+
+        // The biggest block that doesn't overshoot, smaller ones if memory is fragmented
+        uint64_t left = nr_pages - allocated;
+        int order = 63 - __builtin_clzll(left);
+        if(order > PMM_MAX_ORDER - 1) order = PMM_MAX_ORDER - 1;
+
+        struct pmm_page *page = NULL;
+        for(; order >= 0 && !page; order--) page = zone_alloc_block(node, PMM_ZONE_NORMAL, order);
+        if(!page) break;
+        order++;
+
+        uint64_t pfn = page_to_pfn(page);
+        pmm_account_node(node, pfn);
+
+        for(uint64_t i = 0; i < (1ULL << order); i++)
+        {
+            page_set_info(&buddy_memmap[pfn + i], PMM_FLAG_USED, 0, 1);
+            pages[allocated++] = (pfn + i) * PMM_PAGE_SIZE;
+            PMM_TRACE_ALLOC((pfn + i) * PMM_PAGE_SIZE, 1);
+        }
+    }
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+    return allocated;
+}
+
+/**
+ * @brief Frees many single pages under a single hold of the buddy lock
+ * They go straight back to the buddy lists, skipping the per-CPU cache
+ * 
+ * @param pages The physical addresses of the pages
+ * @param nr_pages How many pages there are
+ */
+void pmm_free_bulk(uint64_t *pages, uint64_t nr_pages)
+{
+    if(!pages) return;
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    for(uint64_t i = 0; i < nr_pages; i++)
+    {
+        if(pages[i] % PMM_PAGE_SIZE)
+        {
+            log_line(LOG_WARN, "%s: Warning freeing unaligned address %llx", __FUNCTION__, pages[i]);
+            continue;
+        }
+
+#if PMM_DEBUG
+        if(!pmm_check_head(pages[i], __FUNCTION__)) continue;
+#endif
+
+        PMM_TRACE_FREE(pages[i] / PMM_PAGE_SIZE, 1);
+        buddy_free_block(pages[i] / PMM_PAGE_SIZE, 0);
+    }
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+}
+
+/**
+ * @brief Convert a size (bytes) into an order type
+ * 
+ * @param size Num of bytes to convert
+ * @return uint32_t The corresponding order
+ */
+static uint32_t pmm_get_order_from_size(uint64_t size)
+{
+    uint64_t pages_needed = size / PMM_PAGE_SIZE;
+    if(size % PMM_PAGE_SIZE) pages_needed++;
+
+    // We search the power of 2 
+    uint32_t order = 0;
+    while((1ULL << order) < pages_needed) order++;
+    return order;
+}
+
+/**
+ * @brief Our main function for allocating physical memory
+ * 
+ * @param size The number of bytes of physical memory to allocate
+ * @return uint64_t the physical address of the newly allocated block
+ * if the returned value is 0 then the allocation was unsuccesfull
+ * @note Sizes above the biggest buddy block go through pmm_alloc_contig, which can sleep
+ */
+uint64_t pmm_alloc(uint64_t size)
+{
+    uint32_t order = pmm_get_order_from_size(size);
+
+    // Too big for the buddy lists, search for a run of pages
+    if(order >= PMM_MAX_ORDER)
+    {
+        uint64_t nr_pages = (size + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+        uint64_t phys = contig_alloc(nr_pages, 1, PMM_ZONE_NORMAL);
+        PMM_TRACE_ALLOC(phys, nr_pages);
+        return phys;
+    }
+
+    uint64_t phys = pmm_alloc_pages_node(order, PMM_ZONE_NORMAL, numa_current_node());
+    PMM_TRACE_ALLOC(phys, 1ULL << order);
+    return phys;
+}
+
+/**
+ * @brief Allocates a single zeroed page, from the zero pool when possible
+ * 
+ * @param policy The memory policy, NULL for the default one (local)
+ * @return uint64_t The physical address of the zeroed page, 0 if we're out of memory
+ * @note Free it with pmm_free_addr like any other page
+ */
+uint64_t pmm_alloc_zeroed(struct numa_policy *policy)
+{
+    uint32_t node = pmm_policy_node(policy);
+
+    // The pool is filled by the idle thread with local pages
+    if(node == numa_current_node())
+    {
+        uint64_t phys = pmm_zero_pool_take();
+        if(phys)
+        {
+            __atomic_add_fetch(&zero_pool.hits, 1, __ATOMIC_RELAXED);
+            pmm_account_node(node, phys / PMM_PAGE_SIZE);
+            PMM_TRACE_ALLOC(phys, 1);
+            return phys;
+        }
+    }
+    __atomic_add_fetch(&zero_pool.misses, 1, __ATOMIC_RELAXED);
+
+    // The pool is dry (or on the wrong node), we pay for the memset here
+    uint64_t phys = pmm_alloc_pages_node(0, PMM_ZONE_NORMAL, node);
+    if(phys) memset(hhdm_physToVirt((void *)phys), 0x00, PMM_PAGE_SIZE);
+    PMM_TRACE_ALLOC(phys, 1);
+    return phys;
+}
+
+/**
+ * @brief Zeroes free pages into the zero pool until it's full
+ * 
+ * @param max_pages The most pages we zero in this call
+ * @return uint64_t How many pages were zeroed, 0 if there was nothing to do
+ * @note The memset runs with interrupts enabled, it's meant for the idle thread.
+ * It never reclaims: the idle thread can't sleep on the shrinkers
+ */
+uint64_t pmm_zero_pool_refill(uint64_t max_pages)
+{
+    // The pool would take back what the reclaim thread is freeing
+    if(reclaim_pressure) return 0;
+
+    uint64_t done = 0;
+    while(done < max_pages && zero_pool.count < PMM_ZERO_POOL_HIGH)
+    {
+        // Leave the last free pages to who really needs them
+        if(totalPages - used_pages - deferred_pages <= PMM_ZERO_POOL_HIGH) break;
+
+        // Pool pages belong to nobody until they're handed out
+        uint64_t phys = pmm_try_alloc_pages_node(0, PMM_ZONE_NORMAL, numa_current_node());
+        if(!phys) break;
+
+        memset(hhdm_physToVirt((void *)phys), 0x00, PMM_PAGE_SIZE);
+
+        uint64_t irq_flags;
+        spinlock_irq_acquire(&zero_pool_lock, &irq_flags);
+
+        uint64_t pfn = phys / PMM_PAGE_SIZE;
+        page_set_info(&buddy_memmap[pfn], PMM_FLAG_ZERO, 0, 0);
+        pmm_list_push_head(&zero_pool.list, pfn);
+        zero_pool.count++;
+        zero_pool.zeroed++;
+
+        spinlock_irq_release(&zero_pool_lock, &irq_flags);
+        done++;
+    }
+
+    return done;
+}
+
+/**
+ * @brief Frees exactly what was allocated at an address
+ * The head of every block remembers its order (or its length for contiguous runs)
+ * so the caller doesn't have to carry the size around
+ * 
+ * @param phys The physical address returned by any of the allocation functions
+ */
+void pmm_free_addr(uint64_t phys)
+{
+#if PMM_DEBUG
+    if(!pmm_check_head(phys, __FUNCTION__)) return;
+#endif
+
+    struct pmm_page *page = phys_to_page(phys);
+    if(!page) return;
+
+    uint32_t info = page->info;
+    if(info & PMM_FLAG_CONTIG)
+    {
+        pmm_free_contig(phys);
+        return;
+    }
+
+    pmm_free_pages(phys, (info & PMM_INFO_ORDER_MASK) >> PMM_INFO_ORDER_SHIFT);
+}
+
+/**
+ * @brief Our main function for deallocating physical memory
+ * 
+ * @param physAddr The physical address of the starting block 
+ * @param length The number of bytes of our allocation, only checked in debug builds
+ * @note The size comes from the page descriptor, this is pmm_free_addr
+ */
+void pmm_free(uint64_t physAddr, uint64_t length)
+{
+#if PMM_DEBUG
+    struct pmm_page *page = phys_to_page(physAddr);
+    uint32_t order = pmm_get_order_from_size(length);
+    if(page && !(page_flags(page) & PMM_FLAG_CONTIG) && page_order(page) != order)
+    {
+        log_line(LOG_WARN, "%s: 0x%llx was allocated with order %u but freed with a length of %llu bytes", 
+            __FUNCTION__, physAddr, page_order(page), length);
+    }
+#else
+    (void) length;
+#endif
+
+    pmm_free_addr(physAddr);
+}
+
+/************************ CONTIGUOUS ALLOCATOR ***************************/
+
+/**
+ * @brief Finds the free block a page belongs to
+ * 
+ * @param pfn The page frame number
+ * @param order Filled with the order of the block
+ * @return uint64_t The head of the free block, PMM_PFN_NONE if the page isn't free
+ * @note pmm_lock has to be held by the caller and the section of pfn has to be ready
+ */
+static uint64_t free_block_containing(uint64_t pfn, uint32_t *order)
+{
+    for(uint32_t current_order = 0; current_order < PMM_MAX_ORDER; current_order++)
+    {
+        uint64_t head = pfn & ~((1ULL << current_order) - 1);
+        if(head + (1ULL << current_order) > totalPages) break;
+
+        if(is_block_free(head, current_order))
+        {
+            *order = current_order;
+            return head;
+        }
+    }
+
+    return PMM_PFN_NONE;
+}
+
+// Is the page an anonymous page mapped once, whose content can be moved elsewhere?
+static inline bool page_is_movable(struct pmm_page *page)
+{
+    // Order 0 and a single reference, read at once since the count changes without the lock
+    return __atomic_load_n(&page->info, __ATOMIC_RELAXED) == (PMM_FLAG_USED | PMM_FLAG_MOVABLE | (1u << PMM_INFO_REF_SHIFT));
+}
+
+/**
+ * @brief Finds the first page of a range that stops it from becoming a contiguous run
+ * Free blocks are skipped as a whole, and so are the sections that aren't initialized
+ * yet since all their usable pages are free
+ * 
+ * @param start_pfn The first page of the range
+ * @param end_pfn The first page after the range
+ * @param migrate If true movable pages don't block the range
+ * @return uint64_t The first blocking page, PMM_PFN_NONE if there's none
+ * @note pmm_lock has to be held by the caller
+ */
+static uint64_t contig_first_blocker(uint64_t start_pfn, uint64_t end_pfn, bool migrate)
+{
+    uint64_t pfn = start_pfn;
+    while(pfn < end_pfn)
+    {
+        uint64_t section = pfn / PMM_SECTION_PAGES;
+        if(!section_is_ready(section))
+        {
+            pfn = (section + 1) * PMM_SECTION_PAGES;
+            continue;
+        }
+
+        uint32_t order;
+        uint64_t head = free_block_containing(pfn, &order);
+        if(head != PMM_PFN_NONE)
+        {
+            pfn = head + (1ULL << order);
+            continue;
+        }
+
+        if(!migrate || !page_is_movable(&buddy_memmap[pfn])) return pfn;
+        pfn++;
+    }
+
+    return PMM_PFN_NONE;
+}
+
+/**
+ * @brief Searches the usable ranges for an aligned run of pages
+ * After a blocking page the search jumps to the next aligned candidate past it
+ * 
+ * @param from The search starts at this page
+ * @param nr_pages The length of the run
+ * @param align_pages The alignment of the first page of the run
+ * @param limit_pfn The run has to end below this page
+ * @param zone If not NULL the run has to start inside this zone
+ * @param migrate If true the run may contain movable pages
+ * @return uint64_t The first page of the run, PMM_PFN_NONE if there's none
+ * @note pmm_lock has to be held by the caller
+ */
+static uint64_t contig_find(uint64_t from, uint64_t nr_pages, uint64_t align_pages, uint64_t limit_pfn, 
+    struct pmm_zone *zone, bool migrate)
+{
+    for(size_t i = 0; i < pmm_nr_ranges; i++)
+    {
+        uint64_t end = pmm_ranges[i].end_pfn < limit_pfn ? pmm_ranges[i].end_pfn : limit_pfn;
+        uint64_t pfn = pmm_ranges[i].start_pfn > from ? pmm_ranges[i].start_pfn : from;
+        pfn = (pfn + align_pages - 1) / align_pages * align_pages;
+
+        while(pfn + nr_pages <= end)
+        {
+            // Zones of different nodes interleave inside a zone span
+            if(zone && pfn_to_zone(pfn) != zone)
+            {
+                pfn += align_pages;
+                continue;
+            }
+
+            uint64_t blocker = contig_first_blocker(pfn, pfn + nr_pages, migrate);
+            if(blocker == PMM_PFN_NONE) return pfn;
+
+            pfn = (blocker + align_pages) / align_pages * align_pages;
+        }
+    }
+
+    return PMM_PFN_NONE;
+}
+
+/**
+ * @brief Takes the free blocks overlapping a range out of the buddy lists
+ * The parts of the blocks outside the range go back as smaller blocks,
+ * the pages inside are marked isolated and counted as used.
+ * Only the sections the range touches get initialized
+ * 
+ * @param start_pfn The first page of the range
+ * @param end_pfn The first page after the range
+ * @note pmm_lock has to be held by the caller
+ */
+static void contig_isolate(uint64_t start_pfn, uint64_t end_pfn)
+{
+    uint64_t pfn = start_pfn;
+    while(pfn < end_pfn)
+    {
+        // The search skipped it, its pages have to reach the buddy lists before we take them
+        uint64_t section = pfn / PMM_SECTION_PAGES;
+        if(!section_is_ready(section)) pmm_init_section(section);
+
+        uint32_t order;
+        uint64_t head = free_block_containing(pfn, &order);
+        if(head == PMM_PFN_NONE)
+        {
+            pfn++;
+            continue;
+        }
+
+        uint64_t block_end = head + (1ULL << order);
+        free_area_del(pfn_to_zone(head), head, order);
+
+        // Give back what sticks out of the range, the buddies of these pieces are inside the old block
+        if(head < start_pfn) pmm_build_range(head, start_pfn);
+        if(block_end > end_pfn) pmm_build_range(end_pfn, block_end);
+
+        uint64_t first = head > start_pfn ? head : start_pfn;
+        uint64_t last = block_end < end_pfn ? block_end : end_pfn;
+        for(uint64_t i = first; i < last; i++) page_set_info(&buddy_memmap[i], PMM_FLAG_ISOLATED, 0, 0);
+
+        used_pages += last - first;
+        pfn = last;
+    }
+}
+
+// Are all the pages of the range isolated?
+static bool contig_range_isolated(uint64_t start_pfn, uint64_t end_pfn)
+{
+    for(uint64_t pfn = start_pfn; pfn < end_pfn; pfn++)
+    {
+        if(page_flags(&buddy_memmap[pfn]) != PMM_FLAG_ISOLATED) return false;
+    }
+
+    return true;
+}
+
+// Gives the isolated pages of a range back to the buddy lists, the window has to be closed already
+static void contig_release_isolated(uint64_t start_pfn, uint64_t end_pfn)
+{
+    for(uint64_t pfn = start_pfn; pfn < end_pfn; pfn++)
+    {
+        if(page_flags(&buddy_memmap[pfn]) == PMM_FLAG_ISOLATED) buddy_free_block(pfn, 0);
+    }
+}
+
+// Turns an isolated range into an allocated run, the head remembers its length
+static void contig_commit(uint64_t start_pfn, uint64_t nr_pages)
+{
+    for(uint64_t pfn = start_pfn + 1; pfn < start_pfn + nr_pages; pfn++) buddy_memmap[pfn].info = 0;
+
+    page_set_info(&buddy_memmap[start_pfn], PMM_FLAG_USED | PMM_FLAG_CONTIG, 0, 1);
+    buddy_memmap[start_pfn].next = nr_pages;
+
+    contig_allocs++;
+    contig_pages += nr_pages;
+}
+
+/**
+ * @brief Gives the pages sitting in the per-CPU cache, and optionally in the zero pool,
+ * back to the buddy lists since the range search sees them as used. The idle thread refills the pool later
+ * 
+ * @param zero_pool_too If true the zero pool is emptied too
+ */
+static void pmm_drain_caches(bool zero_pool_too)
+{
+    uint64_t irq_flags = interrupts_save_and_disable();
+    struct pmm_pcp *pcp = pmm_pcp_this_cpu();
+    if(pcp->count) pmm_pcp_drain(pcp, pcp->count);
+    interrupts_restore(irq_flags);
+
+    if(!zero_pool_too) return;
+
+    uint64_t pool_flags;
+    spinlock_irq_acquire(&zero_pool_lock, &pool_flags);
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    while(zero_pool.count > 0)
+    {
+        uint64_t pfn = zero_pool.list.head;
+        pmm_list_remove(&zero_pool.list, pfn);
+        zero_pool.count--;
+
+        buddy_free_block(pfn, 0);
+    }
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+    spinlock_irq_release(&zero_pool_lock, &pool_flags);
+}
+
+/**
+ * @brief Empties an aligned range made of free and movable pages
+ * The free pages are isolated, the migrator moves the others elsewhere and
+ * they're captured as they're freed. If something can't be moved the pages
+ * go back and the next candidate is tried
+ * 
+ * @param from The search starts at this page
+ * @param nr_pages The length of the range
+ * @param align_pages The alignment of the first page of the range
+ * @param limit_pfn The range has to end below this page
+ * @param zone If not NULL the range has to start inside this zone
+ * @param irq_flags The flags pmm_lock was acquired with, the lock is dropped while the migrator runs
+ * @return uint64_t The first page of a range whose pages are now all isolated, PMM_PFN_NONE if it failed
+ * @note pmm_lock and contig_lock have to be held by the caller
+ */
+static uint64_t contig_migrate_range(uint64_t from, uint64_t nr_pages, uint64_t align_pages, uint64_t limit_pfn, 
+    struct pmm_zone *zone, uint64_t *irq_flags)
+{
+    for(uint32_t tries = 0; contig_migrator && tries < PMM_CONTIG_MAX_TRIES; tries++)
+    {
+        uint64_t start_pfn = contig_find(from, nr_pages, align_pages, limit_pfn, zone, true);
+        if(start_pfn == PMM_PFN_NONE) break;
+
+        uint64_t end_pfn = start_pfn + nr_pages;
+        contig_window_start = start_pfn;
+        contig_window_end = end_pfn;
+        contig_isolate(start_pfn, end_pfn);
+
+        // The migrator allocates, the isolated pages are out of its reach
+        spinlock_irq_release(&pmm_lock, irq_flags);
+        uint64_t moved = contig_migrator(start_pfn * PMM_PAGE_SIZE, end_pfn * PMM_PAGE_SIZE);
+        spinlock_irq_acquire(&pmm_lock, irq_flags);
+
+        migrated_pages += moved;
+        contig_window_start = contig_window_end = 0;
+
+        if(contig_range_isolated(start_pfn, end_pfn)) return start_pfn;
+
+        // Something couldn't be moved, try past this candidate
+        contig_release_isolated(start_pfn, end_pfn);
+        from = start_pfn + 1;
+    }
+
+    return PMM_PFN_NONE;
+}
+
+/**
+ * @brief Registers the function that moves movable pages out of a physical range
+ * 
+ * @param migrate Called with [start_phys, end_phys), it returns how many pages it moved.
+ * It has to free the old pages with pmm_page_dec_ref
+ */
+void pmm_register_migrator(uint64_t (*migrate)(uint64_t start_phys, uint64_t end_phys))
+{
+    contig_migrator = migrate;
+}
+
+/**
+ * @brief Allocates a physically contiguous run of any length, above the limit of the buddy lists
+ * 1) Searches the usable ranges for an aligned run made only of free pages
+ * 2) If there's none, searches for a run made of free and movable pages, isolates its free pages,
+ *    asks the migrator to move the others elsewhere and captures them as they're freed.
+ *    If something can't be moved the pages go back and the next candidate is tried
+ * 
+ * @param nr_pages How many pages the run is long
+ * @param align_pages The alignment of the run in pages (262144 for a 1GB page), 0 or 1 for none
+ * @param zone The highest zone the run can reach (PMM_ZONE_DMA32 for memory below 4GB)
+ * @return uint64_t The physical address of the run, 0 if the allocation failed
+ * @note It drains the page caches and walks the descriptors of the ranges it searches, it's meant for
+ * big and rare allocations. It can sleep: don't call it while holding a spinlock.
+ * Free the run with pmm_free_contig
+ */
+uint64_t pmm_alloc_contig(uint64_t nr_pages, uint64_t align_pages, enum pmm_zone_type zone)
+{
+    uint64_t phys = contig_alloc(nr_pages, align_pages, zone);
+    PMM_TRACE_ALLOC(phys, nr_pages);
+    return phys;
+}
+
+/**
+ * @brief The body of pmm_alloc_contig, without the tracing
+ */
+static uint64_t contig_alloc(uint64_t nr_pages, uint64_t align_pages, enum pmm_zone_type zone)
+{
+    if(nr_pages == 0 || nr_pages >= PMM_PFN_NONE || zone >= PMM_NR_ZONES) return 0;
+    if(align_pages == 0) align_pages = 1;
+
+    uint64_t limit_pfn = totalPages;
+    if(zone == PMM_ZONE_DMA && limit_pfn > PMM_ZONE_DMA_END / PMM_PAGE_SIZE) limit_pfn = PMM_ZONE_DMA_END / PMM_PAGE_SIZE;
+    if(zone == PMM_ZONE_DMA32 && limit_pfn > PMM_ZONE_DMA32_END / PMM_PAGE_SIZE) limit_pfn = PMM_ZONE_DMA32_END / PMM_PAGE_SIZE;
+
+    mutex_acquire(&contig_lock);
+    pmm_drain_caches(true);
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    // Free pages only
+    uint64_t start_pfn = contig_find(0, nr_pages, align_pages, limit_pfn, NULL, false);
+    if(start_pfn != PMM_PFN_NONE)
+    {
+        contig_isolate(start_pfn, start_pfn + nr_pages);
+    }
+    else
+    {
+        // Free and movable pages
+        start_pfn = contig_migrate_range(0, nr_pages, align_pages, limit_pfn, NULL, &irq_flags);
+    }
+
+    if(start_pfn != PMM_PFN_NONE)
+    {
+        contig_commit(start_pfn, nr_pages);
+
+        spinlock_irq_release(&pmm_lock, &irq_flags);
+        mutex_release(&contig_lock);
+        return start_pfn * PMM_PAGE_SIZE;
+    }
+
+    contig_failures++;
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+    mutex_release(&contig_lock);
+
+    log_line(LOG_WARN, "%s: Cannot find %llu contiguous pages aligned to %llu pages", __FUNCTION__, nr_pages, align_pages);
+    return 0;
+}
+
+/**
+ * @brief Frees a run allocated by pmm_alloc_contig
+ * The run goes back to the buddy lists as the biggest aligned blocks it contains
+ * 
+ * @param phys The physical address returned by pmm_alloc_contig
+ */
+void pmm_free_contig(uint64_t phys)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    struct pmm_page *page = phys_to_page(phys);
+    if(!page || !(page_flags(page) & PMM_FLAG_CONTIG))
+    {
+        spinlock_irq_release(&pmm_lock, &irq_flags);
+        log_line(LOG_WARN, "%s: 0x%llx is not a contiguous run", __FUNCTION__, phys);
+        return;
+    }
+
+    uint64_t pfn = phys / PMM_PAGE_SIZE;
+    uint64_t end_pfn = pfn + page->next;
+    page->info = 0;
+    PMM_TRACE_FREE(pfn, end_pfn - pfn);
+
+    while(pfn < end_pfn)
+    {
+        uint32_t order = max_block_order(pfn, end_pfn);
+        buddy_free_block(pfn, order);
+        pfn += 1ULL << order;
+    }
+
+    contig_pages -= end_pfn - phys / PMM_PAGE_SIZE;
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+}
+
+/**
+ * @brief Marks an order 0 page as movable: its only user is a single mapping
+ * that the migrator can point somewhere else
+ * 
+ * @param phys The physical address of the page
+ */
+void pmm_page_set_movable(uint64_t phys)
+{
+    struct pmm_page *page = phys_to_page(phys);
+
+    // The reference count changes without the lock, so the flag is set atomically too
+    if(page && (page_flags(page) & PMM_FLAG_USED) && page_order(page) == 0) 
+        __atomic_fetch_or(&page->info, PMM_FLAG_MOVABLE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Tells if a page can be moved by rewriting its mapping
+ * 
+ * @param phys The physical address of the page
+ * @return true If the page is movable and mapped once
+ */
+bool pmm_page_is_movable(uint64_t phys)
+{
+    struct pmm_page *page = phys_to_page(phys);
+    return page && page_is_movable(page);
+}
+
+/*************************************************************************/
+
+/***************************** COMPACTION ********************************/
+
+/**
+ * @brief Computes the fragmentation index of a zone for an order
+ * Close to 0 an allocation of this order fails for lack of memory,
+ * close to 1000 it fails because the free memory is split in blocks too small
+ * 
+ * @param zone The zone
+ * @param order The order of the allocation
+ * @return int64_t The index in thousandths, -1000 if a block of that order is free
+ * @note Reads the zone without locking, the result is a hint
+ */
+static int64_t pmm_fragmentation_index(struct pmm_zone *zone, uint32_t order)
+{
+    if(zone->free_area_mask >> order) return -1000;
+
+    uint64_t free_blocks = 0;
+    for(uint32_t i = 0; i < PMM_MAX_ORDER; i++) free_blocks += zone->free_areas[i].nr_free;
+    if(free_blocks == 0) return 0;
+
+    uint64_t requested = 1ULL << order;
+    return 1000 - (int64_t)((1000 + (zone->free_pages * 1000) / requested) / free_blocks);
+}
+
+/**
+ * @brief Assembles a free block in a zone by moving the movable pages of an aligned range away
+ * 
+ * @param zone The zone to compact
+ * @param order The order of the block we want
+ * @return true If a free block of that order is now in the buddy lists of the zone
+ * @note contig_lock has to be held by the caller
+ */
+static bool pmm_compact_zone(struct pmm_zone *zone, uint32_t order)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    compact_attempts++;
+    uint64_t start_pfn = contig_migrate_range(zone->start_pfn, 1ULL << order, 1ULL << order, zone->end_pfn, zone, &irq_flags);
+    if(start_pfn == PMM_PFN_NONE)
+    {
+        compact_failures++;
+        spinlock_irq_release(&pmm_lock, &irq_flags);
+        return false;
+    }
+
+    // The isolated pages coalesce back into a single block
+    contig_release_isolated(start_pfn, start_pfn + (1ULL << order));
+    compact_success++;
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+    return true;
+}
+
+/**
+ * @brief Compacts the zones an allocation can use until one of them has a free block of the order
+ * The zones are visited in the order zone_alloc_block uses, only the ones whose
+ * fragmentation index says the failure is due to fragmentation get compacted
+ * 
+ * @param order The order of the failed allocation
+ * @param zone The highest zone the allocation can use
+ * @param node The node the allocation wanted
+ * @return true If a block of that order was assembled
+ * @note It can sleep, interrupts have to be enabled
+ */
+static bool pmm_compact_node(uint32_t order, enum pmm_zone_type zone, uint32_t node)
+{
+    if(!contig_migrator) return false;
+
+    mutex_acquire(&contig_lock);
+    pmm_drain_caches(false);
+
+    bool done = false;
+    for(uint32_t n = 0; n < nr_nodes && !done; n++)
+    {
+        for(int z = zone; z >= 0 && !done; z--)
+        {
+            struct pmm_zone *current = &zones[node_fallback[node][n]][z];
+            if(!current->present_pages || pmm_fragmentation_index(current, order) <= PMM_COMPACT_THRESHOLD) continue;
+
+            done = pmm_compact_zone(current, order);
+        }
+    }
+
+    mutex_release(&contig_lock);
+    return done;
+}
+
+/**
+ * @brief Compacts memory so that an allocation of this order can succeed
+ * 
+ * @param order The order of the allocation
+ * @param zone The highest zone the allocation can use
+ * @return true If a block of that order was assembled
+ * @note It can sleep, interrupts have to be enabled
+ */
+bool pmm_compact(uint32_t order, enum pmm_zone_type zone)
+{
+    if(order >= PMM_MAX_ORDER || zone >= PMM_NR_ZONES) return false;
+
+    return pmm_compact_node(order, zone, numa_current_node());
+}
+
+/**
+ * @brief Compacts a little while the CPU is idle, so that the biggest blocks are ready
+ * before someone asks for them. After a failure the next attempts are deferred more and more
+ * 
+ * @return true If some work was done
+ * @note Meant for the idle thread, it never sleeps
+ */
+bool pmm_compact_idle(void)
+{
+    if(!contig_migrator) return false;
+
+    if(compact_deferred > 0)
+    {
+        compact_deferred--;
+        return false;
+    }
+
+    struct pmm_zone *zone = &zones[numa_current_node()][PMM_ZONE_NORMAL];
+    if(!zone->present_pages) zone = &zones[numa_current_node()][PMM_ZONE_DMA32];
+
+    uint32_t order = PMM_MAX_ORDER - 1;
+    if(pmm_fragmentation_index(zone, order) <= PMM_COMPACT_THRESHOLD) return false;
+
+    // Someone is already allocating a run or compacting
+    if(!mutex_try_acquire(&contig_lock)) return false;
+
+    pmm_drain_caches(false);
+    bool done = pmm_compact_zone(zone, order);
+    mutex_release(&contig_lock);
+
+    if(done)
+    {
+        compact_defer_shift = 0;
+    }
+    else
+    {
+        if(compact_defer_shift < PMM_COMPACT_MAX_DEFER_SHIFT) compact_defer_shift++;
+        compact_deferred = 1ULL << compact_defer_shift;
+    }
+
+    return true;
+}
+
+/****************************** RECLAIM **********************************/
+
+// The pages sitting in the per-CPU caches and in the zero pool
+static uint64_t pmm_caches_count(void)
+{
+    return pcp_caches[0].count + zero_pool.count;
+}
+
+// Gives every cached page back to the buddy lists, they're cheap to refill
+static uint64_t pmm_caches_scan(uint64_t nr_pages)
+{
+    (void)nr_pages;
+
+    uint64_t before = pmm_caches_count();
+    pmm_drain_caches(true);
+    return before - pmm_caches_count();
+}
+
+// The allocator's own caches, always the first shrinker
+static struct pmm_shrinker pmm_caches_shrinker = {
+    .name = "pmm caches",
+    .count = pmm_caches_count,
+    .scan = pmm_caches_scan,
+};
+
+/**
+ * @brief Adds a shrinker, reclaim calls the shrinkers in the order they were registered
+ * 
+ * @param shrinker The shrinker, it has to stay valid until it's unregistered
+ */
+void pmm_register_shrinker(struct pmm_shrinker *shrinker)
+{
+    if(!shrinker || !shrinker->count || !shrinker->scan) return;
+
+    mutex_acquire(&shrinker_lock);
+
+    shrinker->next = NULL;
+    struct pmm_shrinker **last = &shrinkers;
+    while(*last) last = &(*last)->next;
+    *last = shrinker;
+
+    mutex_release(&shrinker_lock);
+
+    log_line(LOG_DEBUG, "%s: Registered shrinker %s", __FUNCTION__, shrinker->name);
+}
+
+/**
+ * @brief Removes a shrinker, once this returns its callbacks are never called again
+ * 
+ * @param shrinker The shrinker
+ */
+void pmm_unregister_shrinker(struct pmm_shrinker *shrinker)
+{
+    mutex_acquire(&shrinker_lock);
+
+    for(struct pmm_shrinker **current = &shrinkers; *current; current = &(*current)->next)
+    {
+        if(*current == shrinker)
+        {
+            *current = shrinker->next;
+            break;
+        }
+    }
+
+    mutex_release(&shrinker_lock);
+}
+
+// Calls the shrinkers in order until enough pages were freed, shrinker_lock has to be held
+static uint64_t pmm_shrink(uint64_t nr_pages)
+{
+    uint64_t freed = 0;
+
+    for(struct pmm_shrinker *shrinker = shrinkers; shrinker && freed < nr_pages; shrinker = shrinker->next)
+    {
+        if(!shrinker->count()) continue;
+
+        uint64_t got = shrinker->scan(nr_pages - freed);
+        shrinker->freed += got;
+        freed += got;
+    }
+
+    __atomic_add_fetch(&reclaim_pages, freed, __ATOMIC_RELAXED);
+    return freed;
+}
+
+/**
+ * @brief Asks the shrinkers to give memory back
+ * 
+ * @param nr_pages How many pages we'd like to be freed
+ * @return uint64_t How many pages were freed, 0 if nobody had anything to give
+ * @note It can sleep, interrupts have to be enabled
+ */
+uint64_t pmm_reclaim(uint64_t nr_pages)
+{
+    mutex_acquire(&shrinker_lock);
+    uint64_t freed = pmm_shrink(nr_pages);
+    mutex_release(&shrinker_lock);
+
+    return freed;
+}
+
+/**
+ * @brief Like pmm_reclaim, but it never sleeps: if someone else is already reclaiming it gives up
+ * 
+ * @param nr_pages How many pages we'd like to be freed
+ * @return uint64_t How many pages were freed, 0 if nobody had anything to give or the shrinkers were busy
+ * @note Safe with interrupts disabled, the page fault handler uses it
+ */
+uint64_t pmm_try_reclaim(uint64_t nr_pages)
+{
+    if(!mutex_try_acquire(&shrinker_lock)) return 0;
+
+    uint64_t freed = pmm_shrink(nr_pages);
+    mutex_release(&shrinker_lock);
+
+    return freed;
+}
+
+/**
+ * @brief Tells whether a zone is below one of its watermarks
+ * The deferred sections of a zone are initialized before we call it low on memory
+ * 
+ * @param high Check the high watermark instead of the low one
+ * @return true If at least one zone is below the watermark
+ * @note pmm_lock has to be held by the caller
+ */
+static bool pmm_zones_below(bool high)
+{
+    for(uint32_t node = 0; node < nr_nodes; node++)
+    {
+        for(size_t z = 0; z < PMM_NR_ZONES; z++)
+        {
+            struct pmm_zone *zone = &zones[node][z];
+            if(!zone->present_pages) continue;
+
+            uint64_t mark = high ? zone->watermark_high : zone->watermark_low;
+            while(zone->free_pages < mark && pmm_init_zone_section(zone));
 
-    // Add it to our free areas list
-    dll_add_after(&free_areas[order].head, &page->link);
-    free_areas[order].nr_free++;
+            if(zone->free_pages < mark) return true;
+        }
+    }
 
-    used_pages -= (1ULL << order);
+    return false;
+}
 
+// Locked wrapper of pmm_zones_below
+static bool pmm_under_pressure(bool high)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+    bool below = pmm_zones_below(high);
     spinlock_irq_release(&pmm_lock, &irq_flags);
+    return below;
 }
 
 /**
- * @brief Allocates 2^(12 + order) page.
- * 
- * @param order 
- * @return uint64_t the starting physical address of the newly allocated block
- * returns 0 if the allocation failed
- * @note the returned address is ALWAYS aligned to a page boundary
+ * @brief The reclaim thread, once a zone goes below its low watermark
+ * it calls the shrinkers until every zone is back above the high one
  */
-uint64_t pmm_alloc_pages(uint32_t order)
+static void pmm_reclaim_worker(void)
 {
-    if(order >= PMM_MAX_ORDER) return 0;
-
-    uint64_t irq_flags;
-    spinlock_irq_acquire(&pmm_lock, &irq_flags);
-
-    // Search for a page >= order we search for
-    uint32_t current_order;
-    bool page_found = false;
-    for(current_order = order; current_order < PMM_MAX_ORDER; current_order++)
+    while(1)
     {
-        // Has this free list at least one block?
-        if(!dll_empty(&free_areas[current_order].head))
+        if(pmm_under_pressure(false))
         {
-            page_found = true;
-            break;
+            reclaim_runs++;
+            reclaim_pressure = true;
+
+            // Stop when there's nothing left to give back, the next wakeup tries again
+            while(pmm_reclaim(PMM_RECLAIM_BATCH) && pmm_under_pressure(true))
+            {
+                scheduler_yield();
+            }
+
+            reclaim_pressure = pmm_under_pressure(true);
         }
+
+        // Allocations wake us up early through thread_wake
+        thread_sleep(PMM_RECLAIM_INTERVAL_MS);
     }
+}
 
-    if(!page_found)
+/**
+ * @brief Starts the background reclaim thread
+ * @note The scheduler has to be initialized
+ */
+void pmm_start_reclaim_thread(void)
+{
+    struct task *task = task_create("pmm reclaim");
+    struct thread *thread = task ? task_create_thread(task, pmm_reclaim_worker) : NULL;
+    if(!thread)
     {
-        spinlock_irq_release(&pmm_lock, &irq_flags);
-        return 0;
+        log_line(LOG_WARN, "%s: Cannot create the reclaim thread, memory is reclaimed only when allocations fail", __FUNCTION__);
+        return;
     }
 
-    // Delete the node since it's not free anymore
-    struct double_ll_node *node = free_areas[current_order].head.next;
-    dll_delete(node);
-    free_areas[current_order].nr_free--;
-    
-    // Get the page struct
-    struct pmm_page *page = (struct pmm_page *)((uint8_t *)node - offsetof(struct pmm_page, link));
+    reclaim_thread = thread;
+}
 
-    // Splitting
-    // If our order is bigger we simply split it until it's of the correct size
-    while(current_order > order)
-    {
-        current_order--;
+/****************************** TRACING **********************************/
 
-        // We find our buddy
-        uint64_t buddy_pfn = page_to_pfn(page) ^ (1 << current_order);
-        struct pmm_page *buddy_page = pfn_to_page(buddy_pfn);
-        
-        // We initialize the new page
-        buddy_page->order = current_order;
-        buddy_page->flags = PMM_FLAG_FREE;
-        buddy_page->ref_count = 0;
+/**
+ * @brief Prints the callers holding the most memory, sorted by live bytes
+ * @note Only available when PMM_TRACE is on, the addresses can be resolved with addr2line
+ */
+void pmm_trace_dump(void)
+{
+#if PMM_TRACE
+    log_line(LOG_DEBUG, "--- PMM TRACE: %u callers; %llu allocations dropped ---", callsite_count(&trace_sites), trace_dropped);
 
-        // We add it to our list of free pages
-        dll_add_after(&free_areas[current_order].head, &buddy_page->link);
-        free_areas[current_order].nr_free++;
+    uint32_t slot = CALLSITE_NONE;
+    for(uint32_t n = 0; n < PMM_TRACE_DUMP_TOP && (slot = callsite_next_top(&trace_sites, pmm_trace_key, slot)) != CALLSITE_NONE; n++)
+    {
+        struct pmm_trace_entry *entry = &trace_table[slot];
+        log_line(LOG_DEBUG, "  %p: %lld KB live; %llu allocs; %llu frees", 
+            entry->caller, entry->live_bytes / 1024, entry->allocs, entry->frees);
     }
 
-    page->flags = PMM_FLAG_USED;
-    page->ref_count = 1;
-    page->order = order;
+    log_line(LOG_DEBUG, "-----------------------------");
+#else
+    log_line(LOG_DEBUG, "%s: Tracing is off, build with PMM_TRACE set to 1", __FUNCTION__);
+#endif
+}
 
-    used_pages += (1ULL << order);
-    spinlock_irq_release(&pmm_lock, &irq_flags);
+/*************************************************************************/
 
-    return page_to_phys(page);
+/**
+ * @brief Copies the usable memmap entries into pmm_ranges
+ * Entries are page aligned, clamped to the pages we manage and
+ * merged with the previous one when they're adjacent, so the
+ * builder can emit the biggest blocks possible
+ * 
+ * @param memmap The limine memory map
+ */
+static void pmm_collect_ranges(struct limine_memmap_response *memmap)
+{
+    pmm_nr_ranges = 0;
+    for(size_t i = 0; i < memmap->entry_count; i++)
+    {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if(entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+        // Round the start up and the end down to a page
+        uint64_t start_pfn = (entry->base + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+        uint64_t end_pfn = (entry->base + entry->length) / PMM_PAGE_SIZE;
+
+        // We sacrifice page 0 as we use that to mark invalid allocations
+        if(start_pfn == 0) start_pfn = 1;
+        if(end_pfn > totalPages) end_pfn = totalPages;
+        if(start_pfn >= end_pfn) continue;
+
+        // Limine sorts the entries by base so we only look at the last one
+        if(pmm_nr_ranges > 0 && pmm_ranges[pmm_nr_ranges - 1].end_pfn == start_pfn)
+        {
+            pmm_ranges[pmm_nr_ranges - 1].end_pfn = end_pfn;
+            continue;
+        }
+
+        if(pmm_nr_ranges == PMM_MAX_RANGES)
+        {
+            log_line(LOG_WARN, "%s: Too many usable ranges, ignoring 0x%llx-0x%llx", __FUNCTION__, 
+                start_pfn * PMM_PAGE_SIZE, end_pfn * PMM_PAGE_SIZE);
+            continue;
+        }
+
+        pmm_ranges[pmm_nr_ranges].start_pfn = start_pfn;
+        pmm_ranges[pmm_nr_ranges].end_pfn = end_pfn;
+        pmm_nr_ranges++;
+    }
 }
 
 /**
- * @brief Convert a size (bytes) into an order type
+ * @brief Adds a range to pmm_ranges keeping them sorted,
+ * merging it with the ranges it touches
  * 
- * @param size Num of bytes to convert
- * @return uint32_t The corresponding order
+ * @param start_pfn The first page of the range
+ * @param end_pfn The page after the last one
+ * @return true If the range was added
+ * @return false If pmm_ranges is full
  */
-static uint32_t pmm_get_order_from_size(uint64_t size)
+static bool pmm_insert_range(uint64_t start_pfn, uint64_t end_pfn)
 {
-    uint64_t pages_needed = size / PMM_PAGE_SIZE;
-    if(size % PMM_PAGE_SIZE) pages_needed++;
+    size_t i = 0;
+    while(i < pmm_nr_ranges && pmm_ranges[i].end_pfn < start_pfn) i++;
 
-    // We search the power of 2 
-    uint32_t order = 0;
-    while((1ULL << order) < pages_needed) order++;
-    return order;
+    // Merge with every range we overlap or touch
+    size_t last = i;
+    while(last < pmm_nr_ranges && pmm_ranges[last].start_pfn <= end_pfn)
+    {
+        if(pmm_ranges[last].start_pfn < start_pfn) start_pfn = pmm_ranges[last].start_pfn;
+        if(pmm_ranges[last].end_pfn > end_pfn) end_pfn = pmm_ranges[last].end_pfn;
+        last++;
+    }
+
+    if(last == i)
+    {
+        if(pmm_nr_ranges == PMM_MAX_RANGES) return false;
+
+        memmove(&pmm_ranges[i + 1], &pmm_ranges[i], (pmm_nr_ranges - i) * sizeof(struct pmm_range));
+        pmm_nr_ranges++;
+    }
+    else if(last > i + 1)
+    {
+        memmove(&pmm_ranges[i + 1], &pmm_ranges[last], (pmm_nr_ranges - last) * sizeof(struct pmm_range));
+        pmm_nr_ranges -= last - i - 1;
+    }
+
+    pmm_ranges[i].start_pfn = start_pfn;
+    pmm_ranges[i].end_pfn = end_pfn;
+    return true;
 }
 
 /**
- * @brief Our main function for allocating physical memory
+ * @brief Accounts a usable range to the zones and nodes it overlaps,
+ * a biggest block at a time since that's the granularity of both
  * 
- * @param size The number of bytes of physical memory to allocate
- * @return uint64_t the physical address of the newly allocated block
- * if the returned value is 0 then the allocation was unsuccesfull
+ * @param start_pfn The first page of the range
+ * @param end_pfn The page after the last one
  */
-uint64_t pmm_alloc(uint64_t size)
+static void pmm_account_range(uint64_t start_pfn, uint64_t end_pfn)
 {
-    uint32_t order = pmm_get_order_from_size(size);
-    if(order >= PMM_MAX_ORDER) return 0; // Too big
+    uint64_t pfn = start_pfn;
+    while(pfn < end_pfn)
+    {
+        uint64_t end = ((pfn >> PMM_NODE_MAP_SHIFT) + 1) << PMM_NODE_MAP_SHIFT;
+        if(end > end_pfn) end = end_pfn;
 
-    return pmm_alloc_pages(order);
+        struct pmm_zone *zone = pfn_to_zone(pfn);
+        if(!zone->present_pages || pfn < zone->start_pfn) zone->start_pfn = pfn;
+        if(end > zone->end_pfn) zone->end_pfn = end;
+        zone->present_pages += end - pfn;
+        nodes[zone->node].present_pages += end - pfn;
+
+        pfn = end;
+    }
 }
 
 /**
- * @brief Our main function for deallocating physical memory
- * 
- * @param physAddr The physical address of the starting block 
- * @param length The number of bytes of our allocation
+ * @brief Computes the watermarks of every zone, they scale with the zone size
  */
-void pmm_free(uint64_t physAddr, uint64_t length)
+static void pmm_set_watermarks(void)
 {
-    uint32_t order = pmm_get_order_from_size(length);
+    for(uint32_t node = 0; node < nr_nodes; node++)
+    {
+        for(size_t z = 0; z < PMM_NR_ZONES; z++)
+        {
+            struct pmm_zone *zone = &zones[node][z];
+            if(!zone->present_pages) continue;
 
-    pmm_free_pages(physAddr, order);
+            zone->watermark_min = zone->present_pages / PMM_WATERMARK_MIN_DIV;
+            if(zone->watermark_min < PMM_WATERMARK_MIN_PAGES) zone->watermark_min = PMM_WATERMARK_MIN_PAGES;
+            zone->watermark_low = zone->watermark_min + zone->watermark_min / 4;
+            zone->watermark_high = zone->watermark_min + zone->watermark_min / 2;
+        }
+    }
 }
 
 /**
@@ -250,6 +2183,7 @@ void pmm_free(uint64_t physAddr, uint64_t length)
 void pmm_init()
 {
     struct limine_memmap_response *memmap = memmap_request.response;
+    uint64_t init_start = timer_read_tsc();
 
     // Find the highest usable RAM address
     for(size_t i = 0; i < memmap->entry_count; i++)
@@ -273,26 +2207,37 @@ void pmm_init()
     totalPages = highestAddr / PMM_PAGE_SIZE;
     if(highestAddr % PMM_PAGE_SIZE) totalPages++;
 
-    // Calculate the size needed to host our structs
+    // The page lists are linked through 32 bit PFNs
+    if(totalPages >= PMM_PFN_NONE)
+    {
+        log_line(LOG_WARN, "%s: Only the first %llu pages of RAM can be managed", __FUNCTION__, (uint64_t)PMM_PFN_NONE);
+        totalPages = PMM_PFN_NONE;
+    }
+
+    // Calculate the size needed to host our structs, the node map is placed right after the memmap
     buddy_memmap_size = totalPages * sizeof(struct pmm_page);
+    if(buddy_memmap_size % sizeof(uint64_t)) buddy_memmap_size += sizeof(uint64_t) - (buddy_memmap_size % sizeof(uint64_t));
 
-    log_line(LOG_DEBUG, "%s: highest addr: 0x%llx; Total pages: 0x%llu; buddy_memmap_size: 0x%llx bytes", __FUNCTION__,highestAddr, totalPages, buddy_memmap_size);
+    // One byte for every biggest block, the node it belongs to
+    pfn_node_map_size = (totalPages + (1ULL << PMM_NODE_MAP_SHIFT) - 1) >> PMM_NODE_MAP_SHIFT;
+
+    log_line(LOG_DEBUG, "%s: highest addr: 0x%llx; Total pages: 0x%llu; buddy_memmap_size: 0x%llx bytes", 
+        __FUNCTION__,highestAddr, totalPages, buddy_memmap_size);
 
     // Find the first usable region to store our memmap
     for(size_t i = 0; i < memmap->entry_count; i++)
     {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        if(entry->type == LIMINE_MEMMAP_USABLE && entry->length >= buddy_memmap_size)
+        if(entry->type == LIMINE_MEMMAP_USABLE && entry->length >= buddy_memmap_size + pfn_node_map_size)
         {
             // We convert the physical address to a virtual one
             buddy_memmap = hhdm_physToVirt((void *)entry->base);
+
+            pfn_node_map = (uint8_t *)buddy_memmap + buddy_memmap_size;
             
             // Reduce the region
-            entry->base += buddy_memmap_size;
-            entry->length -= buddy_memmap_size;
-            
-            // Zero the memmap
-            memset(buddy_memmap, 0, buddy_memmap_size);
+            entry->base += buddy_memmap_size + pfn_node_map_size;
+            entry->length -= buddy_memmap_size + pfn_node_map_size;
             break;
         }
     }
@@ -304,120 +2249,252 @@ void pmm_init()
         hcf();
     }
 
-    // Initialize the free lists
-    for(size_t i = 0; i < PMM_MAX_ORDER; i++)
+    // Record the node of every biggest block. Node boundaries that aren't aligned
+    // to it are rounded, the block goes to the node owning its first page
+    nr_nodes = numa_node_count();
+    for(uint64_t i = 0; i < pfn_node_map_size; i++)
     {
-        // Initializes the double linked lists as empty
-        dll_init(&free_areas[i].head);
-        free_areas[i].nr_free = 0;
+        pfn_node_map[i] = nr_nodes == 1 ? 0 : numa_pfn_to_node(i << PMM_NODE_MAP_SHIFT);
     }
 
-    // Fill the memmap as used
-    // Note that we memset'd to 0 the entire memmap before so order and link = 0
-    used_pages = totalPages;
-    for(uint64_t i = 0; i < totalPages; i++)
+    // Allocations fall back to the nearest nodes first
+    for(uint32_t node = 0; node < nr_nodes; node++)
     {
-        buddy_memmap[i].flags |= PMM_FLAG_RESERVED;
-        buddy_memmap[i].ref_count = 1;
+        for(uint32_t i = 0; i < nr_nodes; i++) node_fallback[node][i] = i;
+
+        // Insertion sort by distance, we're the nearest to ourself
+        for(uint32_t i = 1; i < nr_nodes; i++)
+        {
+            uint32_t current = node_fallback[node][i];
+            uint32_t j = i;
+            while(j > 0 && numa_distance(node, node_fallback[node][j - 1]) > numa_distance(node, current))
+            {
+                node_fallback[node][j] = node_fallback[node][j - 1];
+                j--;
+            }
+            node_fallback[node][j] = current;
+        }
     }
 
-    // Populate the buddy structs with valid entries
-    for(size_t i = 0; i < memmap->entry_count; i++)
+    // Initialize the zones of every node with empty free lists
+    static const char *zone_names[PMM_NR_ZONES] = { "DMA", "DMA32", "Normal" };
+    memset(nodes, 0, sizeof(nodes));
+    for(uint32_t node = 0; node < nr_nodes; node++)
     {
-        struct limine_memmap_entry *entry = memmap->entries[i];
-        if(entry->type == LIMINE_MEMMAP_USABLE)
+        for(size_t z = 0; z < PMM_NR_ZONES; z++)
         {
-            uint64_t start = entry->base;
-            uint64_t end = start + entry->length;
-            
-            // Round up to the next page
-            if(start % PMM_PAGE_SIZE) start += PMM_PAGE_SIZE - (start % PMM_PAGE_SIZE);
-            
-            // Round down to the previous page
-            if(end % PMM_PAGE_SIZE) end -= end % PMM_PAGE_SIZE;
+            struct pmm_zone *zone = &zones[node][z];
+            memset(zone, 0, sizeof(struct pmm_zone));
+            zone->name = zone_names[z];
+            zone->node = node;
 
-            // We sacrifice page 0 as we use that to mark invalid allocations
-            if(start == 0)
+            for(size_t i = 0; i < PMM_MAX_ORDER; i++)
             {
-                start += PMM_PAGE_SIZE;
+                // Initializes the page lists as empty
+                pmm_list_init(&zone->free_areas[i].list);
             }
+        }
+    }
 
-            uint64_t current_phys = start;
-            
-            while(current_phys < end)
+    // Initialize the per-CPU caches as empty, they fill on the first allocations
+    for(size_t i = 0; i < PMM_PCP_MAX_CPUS; i++)
+    {
+        pmm_list_init(&pcp_caches[i].list);
+    }
+
+    // The zero pool fills up once the idle thread runs
+    pmm_list_init(&zero_pool.list);
+
+    // Reclaim empties the allocator's own caches first
+    pmm_caches_shrinker.next = NULL;
+    shrinkers = &pmm_caches_shrinker;
+
+    // Collect the usable ranges, every usable page starts as deferred
+    pmm_collect_ranges(memmap);
+
+    deferred_pages = 0;
+    for(size_t i = 0; i < pmm_nr_ranges; i++)
+    {
+        deferred_pages += pmm_ranges[i].end_pfn - pmm_ranges[i].start_pfn;
+        pmm_account_range(pmm_ranges[i].start_pfn, pmm_ranges[i].end_pfn);
+    }
+    used_pages = totalPages - deferred_pages;
+
+    pmm_set_watermarks();
+
+    // Only the first sections are initialized now, the others wait for
+    // pmm_start_deferred_init or for an allocation that can't be satisfied
+    nr_sections = (totalPages + PMM_SECTION_PAGES - 1) / PMM_SECTION_PAGES;
+    uint64_t early_sections = nr_sections;
+    if(PMM_DEFERRED_INIT)
+    {
+        early_sections = ((PMM_EARLY_INIT_MB * 1024ULL * 1024ULL / PMM_PAGE_SIZE) + PMM_SECTION_PAGES - 1) / PMM_SECTION_PAGES;
+        if(early_sections > nr_sections) early_sections = nr_sections;
+    }
+
+    memset(section_ready, 0, sizeof(section_ready));
+    next_deferred_section = 0;
+    for(uint64_t i = 0; i < early_sections; i++)
+    {
+        pmm_init_section(i);
+    }
+    next_deferred_section = early_sections;
+
+    pmm_init_cycles = timer_read_tsc() - init_start;
+
+    log_line(LOG_SUCCESS, "%s: PMM initialized:\r\n\tBuddy allocator structures size %lu bytes\r\n\tBuddy allocator start virt addr 0x%lx\r\n\tManaging %llu pages in %llu ranges\r\n\tInitialized %llu of %llu memmap sections\r\n\tInit took %llu TSC cycles", 
+        __FUNCTION__, buddy_memmap_size + pfn_node_map_size, buddy_memmap, totalPages, pmm_nr_ranges, next_deferred_section, nr_sections, pmm_init_cycles);
+}
+
+/**
+ * @brief Returns how long pmm_init took
+ * 
+ * @return uint64_t The TSC cycles spent in pmm_init
+ * @note Convert it with timer_tsc_to_us once the timer is calibrated
+ */
+uint64_t pmm_get_init_cycles(void)
+{
+    return pmm_init_cycles;
+}
+
+/**
+ * @brief Gives the bootloader reclaimable and ACPI reclaimable memory to the allocator
+ * Pages in initialized sections go straight to the free lists, the others
+ * join the deferred pages and are built with their section
+ * @note Nothing may use the limine responses, the bootloader stack and page tables
+ * or the firmware ACPI tables after this, see acpi_copy_tables
+ */
+void pmm_reclaim_boot_memory(void)
+{
+    struct limine_memmap_response *memmap = memmap_request.response;
+
+    // The memmap lives in bootloader reclaimable memory too, we copy what we need before freeing anything
+    struct pmm_range reclaim[PMM_MAX_RANGES];
+    size_t nr_reclaim = 0;
+    for(size_t i = 0; i < memmap->entry_count && nr_reclaim < PMM_MAX_RANGES; i++)
+    {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if(entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE && entry->type != LIMINE_MEMMAP_ACPI_RECLAIMABLE) continue;
+
+        uint64_t start_pfn = (entry->base + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+        uint64_t end_pfn = (entry->base + entry->length) / PMM_PAGE_SIZE;
+        if(start_pfn == 0) start_pfn = 1;
+        if(end_pfn > totalPages) end_pfn = totalPages;
+        if(start_pfn >= end_pfn) continue;
+
+        reclaim[nr_reclaim].start_pfn = start_pfn;
+        reclaim[nr_reclaim].end_pfn = end_pfn;
+        nr_reclaim++;
+    }
+
+    uint64_t reclaimed = 0;
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&pmm_lock, &irq_flags);
+
+    for(size_t i = 0; i < nr_reclaim; i++)
+    {
+        uint64_t start_pfn = reclaim[i].start_pfn, end_pfn = reclaim[i].end_pfn;
+        if(!pmm_insert_range(start_pfn, end_pfn))
+        {
+            log_line(LOG_WARN, "%s: Too many usable ranges, ignoring 0x%llx-0x%llx", __FUNCTION__, 
+                start_pfn * PMM_PAGE_SIZE, end_pfn * PMM_PAGE_SIZE);
+            continue;
+        }
+
+        pmm_account_range(start_pfn, end_pfn);
+
+        // A section at a time, blocks never cross one
+        uint64_t pfn = start_pfn;
+        while(pfn < end_pfn)
+        {
+            uint64_t section_end = (pfn / PMM_SECTION_PAGES + 1) * PMM_SECTION_PAGES;
+            if(section_end > end_pfn) section_end = end_pfn;
+
+            if(section_is_ready(pfn / PMM_SECTION_PAGES))
             {
-                uint32_t order = PMM_MAX_ORDER - 1;
-                
-                // Find the biggest order to free blocks
-                while(order > 0)
+                while(pfn < section_end)
                 {
-                    uint64_t size = PMM_PAGE_SIZE * (1ULL << order);
-                    
-                    // Is the address aligned ?
-                    // Is the block small enough to fit in our range?
-                    if ((current_phys & (size - 1)) == 0 && (current_phys + size) <= end)
-                    {
-                        break; // Then we found a big enough block
-                    }
-                    order--; // Otherwise try it again with a lower order 
+                    uint32_t order = max_block_order(pfn, section_end);
+                    buddy_free_block(pfn, order);
+                    pfn += 1ULL << order;
                 }
-                
-                // Free the block
-                pmm_free_pages(current_phys, order);
-                
-                current_phys += (PMM_PAGE_SIZE * (1ULL << order));
+            }
+            else
+            {
+                // pmm_init_section picks the pages up from pmm_ranges
+                deferred_pages += section_end - pfn;
+                used_pages -= section_end - pfn;
+                pfn = section_end;
             }
         }
+
+        reclaimed += end_pfn - start_pfn;
     }
 
-    log_line(LOG_SUCCESS, "%s: PMM initialized:\r\n\tBuddy allocator structures size %lu bytes\r\n\tBuddy allocator start virt addr 0x%lx\r\n\tManaging %llu pages", __FUNCTION__, buddy_memmap_size, buddy_memmap, totalPages);
+    // The zones grew
+    pmm_set_watermarks();
+
+    spinlock_irq_release(&pmm_lock, &irq_flags);
+
+    log_line(LOG_SUCCESS, "%s: Reclaimed %llu KB of bootloader and ACPI memory", __FUNCTION__, (reclaimed * PMM_PAGE_SIZE) / 1024);
 }
 
 /**
  * @brief Increment the reference count on a physical page
- * 
+ * The count lives in the info word of the page and is updated with a CAS, no lock is taken
  * @param phys The physical address of the page we want to increment it's ref count
  * @note pmm_alloc already sets to 1 the allocated page
  */
 void pmm_page_inc_ref(uint64_t phys)
 {
-    uint64_t irq_flags;
-    spinlock_irq_acquire(&pmm_lock, &irq_flags);
-
     struct pmm_page *page = phys_to_page(phys);
-    
-    if(page && (page->flags & PMM_FLAG_USED))
-        page->ref_count++;
+    if(!page) return;
 
-    spinlock_irq_release(&pmm_lock, &irq_flags);
+    uint32_t info = __atomic_load_n(&page->info, __ATOMIC_RELAXED);
+    uint32_t new_info;
+    do
+    {
+        if(!(info & PMM_FLAG_USED)) return;
+
+        if((info >> PMM_INFO_REF_SHIFT) == (PMM_INFO_REF_MASK >> PMM_INFO_REF_SHIFT))
+        {
+            log_line(LOG_WARN, "%s: Reference count overflow on page 0x%llx", __FUNCTION__, phys);
+            return;
+        }
+
+        // A shared page can't be moved by rewriting a single mapping
+        new_info = (info + (1u << PMM_INFO_REF_SHIFT)) & ~PMM_FLAG_MOVABLE;
+    } while(!__atomic_compare_exchange_n(&page->info, &info, new_info, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 }
 
 /**
  * @brief Decrements the reference count on the page
- * 
+ * Only the last reference takes the buddy lock, to free the page
  * @param phys The physical address of the page we want to decrement it's ref count
  * @note if ref count reaches zero it also frees it
  */
 void pmm_page_dec_ref(uint64_t phys)
 {
-    uint64_t irq_flags;
-    spinlock_irq_acquire(&pmm_lock, &irq_flags);
-
     struct pmm_page *page = phys_to_page(phys);
-    if(page && (page->flags & PMM_FLAG_USED))
+    if(!page) return;
+
+    uint32_t info = __atomic_load_n(&page->info, __ATOMIC_RELAXED);
+    uint32_t new_info;
+    do
     {
-        page->ref_count--;
-        if(page->ref_count == 0)
-        {
-            // We have to release the lock before calling pmm_free_pages to evict deadlock
-            spinlock_irq_release(&pmm_lock, &irq_flags);
+        if(!(info & PMM_FLAG_USED)) return;
 
-            pmm_free_pages(phys, page->order);
-            return; // Return immediately after because we already released the spinlock
+        if((info >> PMM_INFO_REF_SHIFT) == 0)
+        {
+            log_line(LOG_WARN, "%s: Reference count underflow on page 0x%llx", __FUNCTION__, phys);
+            return;
         }
-    }
 
-    spinlock_irq_release(&pmm_lock, &irq_flags);
+        new_info = info - (1u << PMM_INFO_REF_SHIFT);
+    } while(!__atomic_compare_exchange_n(&page->info, &info, new_info, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    // We dropped the last reference, nobody else can reach the page anymore
+    if((new_info >> PMM_INFO_REF_SHIFT) == 0) pmm_free_addr(phys);
 }
 
 /**
@@ -427,21 +2504,77 @@ void pmm_dump_state(void)
 {
     log_line(LOG_DEBUG, "--- BUDDY ALLOCATOR STATE ---");
 
-    for (int i = 0; i < PMM_MAX_ORDER; i++)
+    for (uint32_t node = 0; node < nr_nodes; node++)
     {
-        if (free_areas[i].nr_free > 0)
+        log_line(LOG_DEBUG, "Node %u: %llu MB present; hits: %llu; misses: %llu; foreign: %llu; interleave: %llu", 
+            node, (nodes[node].present_pages * PMM_PAGE_SIZE) / 1024 / 1024, 
+            nodes[node].hits, nodes[node].misses, nodes[node].foreign, nodes[node].interleave);
+
+        for (int z = 0; z < PMM_NR_ZONES; z++)
         {
-            uint64_t block_size = (1ULL << i) * PMM_PAGE_SIZE;
-            
-            log_line(LOG_DEBUG, "Order %d (%llu KB): %llu blocks free", i, block_size / 1024, free_areas[i].nr_free);
-            
+            struct pmm_zone *zone = &zones[node][z];
+            if (!zone->present_pages) continue;
+
+            log_line(LOG_DEBUG, "  Zone %s [0x%llx-0x%llx]: %llu MB present; %llu MB free; watermarks %llu/%llu/%llu pages", 
+                zone->name, zone->start_pfn * PMM_PAGE_SIZE, zone->end_pfn * PMM_PAGE_SIZE,
+                (zone->present_pages * PMM_PAGE_SIZE) / 1024 / 1024, (zone->free_pages * PMM_PAGE_SIZE) / 1024 / 1024,
+                zone->watermark_min, zone->watermark_low, zone->watermark_high);
+            log_line(LOG_DEBUG, "    allocs: %llu; fallbacks: %llu; failures: %llu", zone->allocs, zone->fallbacks, zone->failures);
+
+            // Fragmentation index of every order, in thousandths
+            char index_line[PMM_MAX_ORDER * 8];
+            size_t written = 0;
+            for (uint32_t i = 0; i < PMM_MAX_ORDER; i++)
+            {
+                written += snprintf(index_line + written, sizeof(index_line) - written, " %lld", pmm_fragmentation_index(zone, i));
+            }
+            log_line(LOG_DEBUG, "    fragmentation index:%s", index_line);
+
+            for (int i = 0; i < PMM_MAX_ORDER; i++)
+            {
+                if (zone->free_areas[i].nr_free > 0)
+                {
+                    uint64_t block_size = (1ULL << i) * PMM_PAGE_SIZE;
+                    
+                    log_line(LOG_DEBUG, "    Order %d (%llu KB): %llu blocks free", i, block_size / 1024, zone->free_areas[i].nr_free);
+                }
+            }
         }
     }
 
+    for (int i = 0; i < PMM_PCP_MAX_CPUS; i++)
+    {
+        log_line(LOG_DEBUG, "CPU %d page cache: %llu pages; hits: %llu; refills: %llu; drains: %llu", 
+            i, pcp_caches[i].count, pcp_caches[i].hits, pcp_caches[i].refills, pcp_caches[i].drains);
+    }
+
+    uint64_t zero_requests = zero_pool.hits + zero_pool.misses;
+    log_line(LOG_DEBUG, "Zero pool: %llu/%u pages; hits: %llu; misses: %llu; hit rate: %llu%%; zeroed: %llu", 
+        zero_pool.count, PMM_ZERO_POOL_HIGH, zero_pool.hits, zero_pool.misses, 
+        zero_requests ? (zero_pool.hits * 100) / zero_requests : 0, zero_pool.zeroed);
+
+    log_line(LOG_DEBUG, "Contiguous runs: %llu allocated; %llu MB in use; %llu failures", 
+        contig_allocs, (contig_pages * PMM_PAGE_SIZE) / 1024 / 1024, contig_failures);
+    log_line(LOG_DEBUG, "Compaction: %llu attempts; %llu blocks assembled; %llu failures; %llu pages migrated", 
+        compact_attempts, compact_success, compact_failures, migrated_pages);
+    log_line(LOG_DEBUG, "Reclaim: %llu background runs; %llu direct attempts; %llu pages freed", 
+        reclaim_runs, reclaim_direct, reclaim_pages);
+    for(struct pmm_shrinker *shrinker = shrinkers; shrinker; shrinker = shrinker->next)
+    {
+        log_line(LOG_DEBUG, "  Shrinker %s: %llu pages freed", shrinker->name, shrinker->freed);
+    }
+
+#if PMM_TRACE
+    pmm_trace_dump();
+#endif
+
     log_line(LOG_DEBUG, "-----------------------------");
     log_line(LOG_DEBUG, "Total Memory: %llu MB", (totalPages * PMM_PAGE_SIZE) / 1024 / 1024);
     log_line(LOG_DEBUG, "Used Memory:  %llu MB", (used_pages * PMM_PAGE_SIZE) / 1024 / 1024);
     log_line(LOG_DEBUG, "Free Memory:  %llu MB", ((totalPages - used_pages) * PMM_PAGE_SIZE) / 1024 / 1024);
+    uint64_t ready_sections = 0;
+    for (uint64_t i = 0; i < (nr_sections + 63) / 64; i++) ready_sections += __builtin_popcountll(section_ready[i]);
+    log_line(LOG_DEBUG, "Deferred:     %llu MB (%llu sections left)", (deferred_pages * PMM_PAGE_SIZE) / 1024 / 1024, nr_sections - ready_sections);
     log_line(LOG_DEBUG, "-----------------------------");
 }
 
@@ -473,3 +2606,124 @@ uint64_t pmm_getHighestAddr(void)
 {
     return highestAddr;
 }
+
+/**
+ * @brief Measures our allocation paths and prints the cost in TSC cycles per operation
+ * 1) An allocation immediately followed by its free, the best case for each order
+ * 2) Bursts of PMM_BENCH_BURST allocations followed by their frees, forcing splits and coalescing
+ * 3) Frees in a scattered order right after the caches were flushed, where every merge check
+ *    reads the cold descriptor of a buddy
+ * 4) Single pages against pmm_alloc_bulk
+ * @param iterations How many alloc/free pairs to time for each order
+ */
+void pmm_benchmark(uint64_t iterations)
+{
+    static const uint32_t orders[] = {0, 1, 4, 9};
+    static uint64_t burst[PMM_BENCH_BURST];
+
+    if(iterations < PMM_BENCH_BURST) iterations = PMM_BENCH_BURST;
+
+    log_line(LOG_DEBUG, "--- PMM BENCHMARK (%llu iterations) ---", iterations);
+
+    for(size_t i = 0; i < sizeof(orders) / sizeof(orders[0]); i++)
+    {
+        uint32_t order = orders[i];
+
+        // Alloc + free pairs
+        uint64_t start = timer_read_tsc();
+        for(uint64_t j = 0; j < iterations; j++)
+        {
+            uint64_t phys = pmm_alloc_pages(order);
+            if(phys) pmm_free_pages(phys, order);
+        }
+        uint64_t pair_cycles = (timer_read_tsc() - start) / iterations;
+
+        // Bursts
+        uint64_t alloc_cycles = 0, free_cycles = 0, allocated = 0;
+        for(uint64_t round = 0; round < iterations / PMM_BENCH_BURST; round++)
+        {
+            start = timer_read_tsc();
+            for(size_t j = 0; j < PMM_BENCH_BURST; j++)
+            {
+                burst[j] = pmm_alloc_pages(order);
+            }
+            uint64_t middle = timer_read_tsc();
+            for(size_t j = 0; j < PMM_BENCH_BURST; j++)
+            {
+                if(burst[j]) 
+                {
+                    pmm_free_pages(burst[j], order);
+                    allocated++;
+                }
+            }
+            alloc_cycles += middle - start;
+            free_cycles += timer_read_tsc() - middle;
+        }
+
+        if(!allocated)
+        {
+            log_line(LOG_DEBUG, "Order %u: out of memory", order);
+            continue;
+        }
+
+        log_line(LOG_DEBUG, "Order %u: alloc+free %llu cycles; burst alloc %llu cycles/op; burst free %llu cycles/op", 
+            order, pair_cycles, alloc_cycles / allocated, free_cycles / allocated);
+    }
+
+    // Half the blocks first, their buddies are still allocated so every merge check fails.
+    // Then the other half, every merge succeeds. A stride prime to the count scatters the frees
+    static uint64_t scatter[PMM_BENCH_SCATTER];
+    uint64_t nr_scatter = 0;
+    while(nr_scatter < PMM_BENCH_SCATTER && (scatter[nr_scatter] = pmm_alloc_pages(PMM_BENCH_SCATTER_ORDER))) nr_scatter++;
+
+    uint64_t half = nr_scatter / 2;
+    if(half > 0)
+    {
+        uint64_t cycles[2];
+        for(uint32_t pass = 0; pass < 2; pass++)
+        {
+            cpu_flush_caches();
+            uint64_t start = timer_read_tsc();
+            for(uint64_t i = 0; i < half; i++)
+            {
+                pmm_free_pages(scatter[((i * 7919) % half) * 2 + pass], PMM_BENCH_SCATTER_ORDER);
+            }
+            cycles[pass] = (timer_read_tsc() - start) / half;
+        }
+
+        // An odd count leaves the last block out
+        if(nr_scatter % 2) pmm_free_pages(scatter[nr_scatter - 1], PMM_BENCH_SCATTER_ORDER);
+
+        log_line(LOG_DEBUG, "Order %u x%llu scattered on a cold memmap: free without merging %llu cycles/op; free with merging %llu cycles/op",
+            PMM_BENCH_SCATTER_ORDER, nr_scatter, cycles[0], cycles[1]);
+    }
+
+    // 1MB worth of single pages, one at a time and in bulk, like a heap extension
+    static uint64_t bulk[PMM_BENCH_BULK];
+    uint64_t single_cycles = 0, bulk_cycles = 0, single_pages = 0, bulk_pages = 0;
+    for(uint64_t round = 0; round < iterations / PMM_BENCH_BURST; round++)
+    {
+        uint64_t start = timer_read_tsc();
+        uint64_t got = 0;
+        while(got < PMM_BENCH_BULK && (bulk[got] = pmm_alloc_pages(0))) got++;
+        single_cycles += timer_read_tsc() - start;
+        single_pages += got;
+        pmm_free_bulk(bulk, got);
+
+        start = timer_read_tsc();
+        got = pmm_alloc_bulk(PMM_BENCH_BULK, bulk, NULL);
+        bulk_cycles += timer_read_tsc() - start;
+        bulk_pages += got;
+        pmm_free_bulk(bulk, got);
+    }
+
+    if(single_pages && bulk_pages)
+    {
+        uint64_t single_us = timer_tsc_to_us(single_cycles), bulk_us = timer_tsc_to_us(bulk_cycles);
+        log_line(LOG_DEBUG, "Order 0 x%u: single %llu cycles/page (%llu MB/s); bulk %llu cycles/page (%llu MB/s)", 
+            PMM_BENCH_BULK, single_cycles / single_pages, single_us ? (single_pages * PMM_PAGE_SIZE) / single_us : 0,
+            bulk_cycles / bulk_pages, bulk_us ? (bulk_pages * PMM_PAGE_SIZE) / bulk_us : 0);
+    }
+
+    log_line(LOG_DEBUG, "-----------------------------");
+}
\ No newline at end of file
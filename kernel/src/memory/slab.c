@@ -0,0 +1,841 @@
+#include <common/dll.h>
+#include <common/logging.h>
+#include <devices/timer.h>
+#include <memory/hhdm.h>
+#include <memory/numa.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <scheduling/lock.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Powers of two and 3 * 2^n, so no request wastes more than a third of its object.
+// The powers of two are aligned to their size, so kmalloc_aligned can use them too
+static const uint32_t slab_class_sizes[SLAB_NR_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+static const char *slab_class_names[SLAB_NR_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-48", "kmalloc-64", "kmalloc-96", "kmalloc-128", "kmalloc-192",
+    "kmalloc-256", "kmalloc-384", "kmalloc-512", "kmalloc-768", "kmalloc-1024", "kmalloc-1536", "kmalloc-2048"
+};
+
+static struct kmem_cache slab_classes[SLAB_NR_CLASSES];
+
+// The magazines come from their own cache, which has no magazines
+static struct kmem_cache magazine_cache;
+
+// The class of every size in steps of SLAB_ALIGN bytes, so a lookup is a single load
+static uint8_t slab_size_index[SLAB_MAX_SIZE / SLAB_ALIGN + 1];
+
+// Neighbouring objects of a slab go to different CPUs, no node is closer to a slab than another.
+// New slabs and the reserve blocks take turns on the nodes
+static struct numa_policy slab_policy = NUMA_POLICY_INTERLEAVE_INIT;
+
+// The emergency blocks of every CPU
+static struct slab_reserve slab_reserves[SLAB_MAX_CPUS];
+
+// Every cache, the size classes included. Caches are never destroyed, so walking it needs no lock
+static struct kmem_cache *cache_list = NULL;
+static struct spinlock_irq cache_list_lock = SPINLOCK_IRQ_INIT;
+
+#define SLAB_ROUND_UP(x, align) (((x) + (align) - 1) & ~(uint64_t)((align) - 1))
+
+/**
+ * @brief Initializes a cache and adds it to the list of caches
+ *
+ * @param cache The cache
+ * @param name Name of the cache, used for debugging
+ * @param object_size The size of every object
+ * @param align The alignment of every object, a power of two and at least SLAB_ALIGN
+ * @param ctor Optional, initializes the objects of every new slab
+ * @return true If the objects fit in a slab
+ */
+static bool slab_cache_init(struct kmem_cache *cache, const char *name, uint32_t object_size, uint32_t align, void (*ctor)(void *))
+{
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->ctor = ctor;
+    cache->offset = SLAB_ROUND_UP(sizeof(struct slab), align);
+
+    if(ctor)
+    {
+        // The free list pointer can't overwrite the constructed state, it goes after the object
+        cache->free_offset = SLAB_ROUND_UP(object_size, sizeof(void *));
+        cache->stride = SLAB_ROUND_UP(cache->free_offset + sizeof(void *), align);
+    }
+    else
+    {
+        cache->free_offset = 0;
+        cache->stride = SLAB_ROUND_UP(object_size, align);
+    }
+
+    if(cache->offset + cache->stride > SLAB_SIZE) return false;
+    cache->objects_per_slab = (SLAB_SIZE - cache->offset) / cache->stride;
+
+    dll_init(&cache->partial);
+    cache->nr_slabs = cache->nr_empty = 0;
+    cache->allocs = cache->frees = 0;
+    cache->lock = (struct spinlock_irq)SPINLOCK_IRQ_INIT;
+
+    cache->use_magazines = true;
+    for(size_t i = 0; i < SLAB_MAX_CPUS; i++)
+    {
+        cache->cpu[i].loaded = cache->cpu[i].previous = NULL;
+        cache->cpu[i].hits = 0;
+    }
+    cache->depot_full = cache->depot_empty = NULL;
+    cache->depot_nr_full = cache->depot_nr_empty = 0;
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&cache_list_lock, &irq_flags);
+    cache->next = cache_list;
+    cache_list = cache;
+    spinlock_irq_release(&cache_list_lock, &irq_flags);
+
+    return true;
+}
+
+// Where the free list pointer of an object is
+static inline void **slab_free_ptr(struct kmem_cache *cache, void *object)
+{
+    return (void **)((uint8_t *)object + cache->free_offset);
+}
+
+// The reserve of the CPU we're running on, interrupts have to be disabled
+static inline struct slab_reserve *slab_reserve_this_cpu(void)
+{
+    return &slab_reserves[0];
+}
+
+/**
+ * @brief Fills the reserve of this CPU back up
+ * @note The caller has to be able to sleep, the pmm may reclaim memory
+ */
+static void slab_reserve_refill(void)
+{
+    // An atomic allocation taking a block meanwhile sets it again
+    slab_reserve_this_cpu()->used = false;
+
+    while(slab_reserve_this_cpu()->count < SLAB_RESERVE_BLOCKS)
+    {
+        uint64_t phys = pmm_alloc_pages_policy(SLAB_ORDER, PMM_ZONE_NORMAL, &slab_policy);
+        if(!phys)
+        {
+            // The pmm is dry, the next allocations shouldn't pay for another failed reclaim
+            slab_reserve_this_cpu()->used = true;
+            slab_reserve_this_cpu()->retry_ms = timer_get_uptime_ms() + SLAB_RESERVE_RETRY_MS;
+            return;
+        }
+
+        // We may have been moved or someone else may have filled it while the pmm worked
+        uint64_t irq_flags = interrupts_save_and_disable();
+        struct slab_reserve *reserve = slab_reserve_this_cpu();
+        bool stored = reserve->count < SLAB_RESERVE_BLOCKS;
+        if(stored) reserve->blocks[reserve->count++] = phys;
+        interrupts_restore(irq_flags);
+
+        if(!stored) pmm_free_pages(phys, SLAB_ORDER);
+    }
+}
+
+/**
+ * @brief Takes a new slab from the pmm, constructs its objects and links them in the free list
+ *
+ * @param cache The cache the slab is for
+ * @param flags KMALLOC_FLAGS_ATOMIC lets the slab come from the reserve when the pmm has no memory
+ * @return struct slab* The new slab, NULL if we're out of memory
+ * @note Called without the cache lock, the pmm may reclaim memory if interrupts are enabled
+ */
+static struct slab *slab_create(struct kmem_cache *cache, uint64_t flags)
+{
+    uint64_t phys = pmm_alloc_pages_policy(SLAB_ORDER, PMM_ZONE_NORMAL, &slab_policy);
+
+    // Atomic callers run with interrupts disabled, the reserve of this CPU is all theirs
+    if(!phys && (flags & KMALLOC_FLAGS_ATOMIC))
+    {
+        struct slab_reserve *reserve = slab_reserve_this_cpu();
+        if(reserve->count)
+        {
+            phys = reserve->blocks[--reserve->count];
+            reserve->hits++;
+            reserve->used = true;
+        }
+    }
+    if(!phys) return NULL;
+
+    struct slab *slab = hhdm_physToVirt((void *)phys);
+    slab->magic = SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = cache;
+
+    // Link the objects from the first to the last
+    uint8_t *object = (uint8_t *)slab + cache->offset;
+    slab->freelist = object;
+    for(uint32_t i = 0; i < cache->objects_per_slab; i++, object += cache->stride)
+    {
+        if(cache->ctor) cache->ctor(object);
+        *slab_free_ptr(cache, object) = i + 1 < cache->objects_per_slab ? object + cache->stride : NULL;
+    }
+
+    return slab;
+}
+
+/**
+ * @brief Gives an empty slab back to the pmm
+ *
+ * @param slab The slab, already unlinked
+ */
+static void slab_destroy(struct slab *slab)
+{
+    slab->magic = 0;
+    pmm_free_pages((uint64_t)hhdm_virtToPhys(slab), SLAB_ORDER);
+}
+
+// The slab an object belongs to
+static inline struct slab *slab_of(void *object)
+{
+    return (struct slab *)((uint64_t)object & ~(SLAB_SIZE - 1));
+}
+
+// The magazines of the CPU we're running on, interrupts have to be disabled
+static inline struct kmem_cpu_cache *slab_this_cpu(struct kmem_cache *cache)
+{
+    return &cache->cpu[0];
+}
+
+/**
+ * @brief Takes an object from the slabs of a cache
+ *
+ * @param cache The cache
+ * @param flags The allocation flags, passed to slab_create
+ * @return void* The object, already constructed if the cache has a constructor. NULL if we're out of memory
+ */
+static void *slab_alloc_object(struct kmem_cache *cache, uint64_t flags)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&cache->lock, &irq_flags);
+
+    if(dll_empty(&cache->partial))
+    {
+        // Every slab is full, the pmm can sleep so we drop the lock
+        spinlock_irq_release(&cache->lock, &irq_flags);
+        struct slab *new_slab = slab_create(cache, flags);
+        if(!new_slab) return NULL;
+        spinlock_irq_acquire(&cache->lock, &irq_flags);
+
+        dll_add_after(&cache->partial, &new_slab->node);
+        cache->nr_slabs++;
+        cache->nr_empty++;
+    }
+
+    struct slab *slab = (struct slab *)cache->partial.next;
+    void *object = slab->freelist;
+    slab->freelist = *slab_free_ptr(cache, object);
+
+    if(slab->inuse++ == 0) cache->nr_empty--;
+
+    // Full slabs aren't linked anywhere until one of their objects is freed
+    if(!slab->freelist) dll_delete(&slab->node);
+
+    cache->allocs++;
+    spinlock_irq_release(&cache->lock, &irq_flags);
+    return object;
+}
+
+/**
+ * @brief Gives an object back to its slab
+ *
+ * @param cache The cache of the slab
+ * @param slab The slab of the object
+ * @param ptr The object, already checked by slab_check_object
+ */
+static void slab_free_object(struct kmem_cache *cache, struct slab *slab, void *ptr)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&cache->lock, &irq_flags);
+
+    if(slab->inuse == 0)
+    {
+        spinlock_irq_release(&cache->lock, &irq_flags);
+        log_line(LOG_WARN, "%s: Double free detected; virtual addr: 0x%llx", __FUNCTION__, ptr);
+        return;
+    }
+
+    // A full slab gets a free object, it goes back in the list
+    if(!slab->freelist) dll_add_after(&cache->partial, &slab->node);
+
+    *slab_free_ptr(cache, ptr) = slab->freelist;
+    slab->freelist = ptr;
+    cache->frees++;
+
+    if(--slab->inuse == 0)
+    {
+        dll_delete(&slab->node);
+
+        if(cache->nr_empty < SLAB_MAX_EMPTY)
+        {
+            // Keep it for the next allocations, at the tail so it's used last
+            dll_add_before(&cache->partial, &slab->node);
+            cache->nr_empty++;
+        }
+        else
+        {
+            cache->nr_slabs--;
+            slab_destroy(slab);
+        }
+    }
+
+    spinlock_irq_release(&cache->lock, &irq_flags);
+}
+
+/**
+ * @brief Checks that a pointer is the start of an object of a slab
+ *
+ * @param cache The cache the caller thinks the object belongs to, NULL to trust the slab
+ * @param ptr The pointer
+ * @return struct slab* The slab of the object, NULL if the pointer isn't valid
+ */
+static struct slab *slab_check_object(struct kmem_cache *cache, void *ptr)
+{
+    struct slab *slab = slab_of(ptr);
+    if(slab->magic != SLAB_MAGIC)
+    {
+        log_line(LOG_WARN, "%s: 0x%llx is not a slab object", __FUNCTION__, ptr);
+        return NULL;
+    }
+
+    if(cache && slab->cache != cache)
+    {
+        log_line(LOG_WARN, "%s: 0x%llx belongs to %s, not to %s", __FUNCTION__, ptr, slab->cache->name, cache->name);
+        return NULL;
+    }
+
+    cache = slab->cache;
+    if((uint64_t)ptr < (uint64_t)slab + cache->offset || ((uint64_t)ptr - (uint64_t)slab - cache->offset) % cache->stride)
+    {
+        log_line(LOG_WARN, "%s: 0x%llx is inside a %s object", __FUNCTION__, ptr, cache->name);
+        return NULL;
+    }
+
+    return slab;
+}
+
+/**
+ * @brief Takes an object from the magazines of this CPU
+ * When both magazines are empty they're exchanged for a full one of the depot
+ * @param cache The cache
+ * @return void* The object, NULL if the magazines and the depot are empty
+ */
+static void *slab_magazine_alloc(struct kmem_cache *cache)
+{
+    uint64_t irq_flags = interrupts_save_and_disable();
+    struct kmem_cpu_cache *cpu = slab_this_cpu(cache);
+    void *object = NULL;
+
+    while(true)
+    {
+        if(cpu->loaded && cpu->loaded->rounds)
+        {
+            object = cpu->loaded->objects[--cpu->loaded->rounds];
+            cpu->hits++;
+            break;
+        }
+
+        // The previous magazine is full, it becomes the loaded one
+        if(cpu->previous && cpu->previous->rounds)
+        {
+            struct slab_magazine *full = cpu->previous;
+            cpu->previous = cpu->loaded;
+            cpu->loaded = full;
+            continue;
+        }
+
+        // Both are empty, the depot may have a full one
+        struct slab_magazine *full, *spare = NULL;
+        uint64_t lock_flags;
+        spinlock_irq_acquire(&cache->lock, &lock_flags);
+
+        full = cache->depot_full;
+        if(full)
+        {
+            cache->depot_full = full->next;
+            cache->depot_nr_full--;
+
+            if(cpu->previous && cache->depot_nr_empty < SLAB_DEPOT_MAX_EMPTY)
+            {
+                cpu->previous->next = cache->depot_empty;
+                cache->depot_empty = cpu->previous;
+                cache->depot_nr_empty++;
+            }
+            else spare = cpu->previous;
+
+            cpu->previous = cpu->loaded;
+            cpu->loaded = full;
+        }
+
+        spinlock_irq_release(&cache->lock, &lock_flags);
+
+        if(spare) slab_free_object(&magazine_cache, slab_of(spare), spare);
+        if(!full) break;
+    }
+
+    interrupts_restore(irq_flags);
+    return object;
+}
+
+/**
+ * @brief Puts an object in the magazines of this CPU
+ * When both magazines are full the previous one goes to the depot, or back to the slabs
+ * if the depot already has SLAB_DEPOT_MAX_FULL magazines, and an empty one is loaded
+ * @param cache The cache
+ * @param object The object
+ * @return true If the object is in a magazine, otherwise the caller has to give it back to its slab
+ */
+static bool slab_magazine_free(struct kmem_cache *cache, void *object)
+{
+    uint64_t irq_flags = interrupts_save_and_disable();
+    struct kmem_cpu_cache *cpu = slab_this_cpu(cache);
+    bool stored = false;
+
+    while(true)
+    {
+        struct slab_magazine *loaded = cpu->loaded;
+        if(loaded && loaded->rounds < SLAB_MAGAZINE_SIZE)
+        {
+            // The only double free we can catch without touching the slab
+            if(loaded->rounds && loaded->objects[loaded->rounds - 1] == object)
+            {
+                log_line(LOG_WARN, "%s: Double free detected; virtual addr: 0x%llx", __FUNCTION__, object);
+                stored = true;
+                break;
+            }
+
+            loaded->objects[loaded->rounds++] = object;
+            cpu->hits++;
+            stored = true;
+            break;
+        }
+
+        // The previous magazine is empty, it becomes the loaded one
+        if(cpu->previous && cpu->previous->rounds == 0)
+        {
+            cpu->loaded = cpu->previous;
+            cpu->previous = loaded;
+            continue;
+        }
+
+        // Both are full, the previous one goes to the depot if there's room and we need an empty one
+        struct slab_magazine *empty = NULL;
+        uint64_t lock_flags;
+        spinlock_irq_acquire(&cache->lock, &lock_flags);
+
+        bool to_depot = cpu->previous && cache->depot_nr_full < SLAB_DEPOT_MAX_FULL;
+        if(to_depot)
+        {
+            cpu->previous->next = cache->depot_full;
+            cache->depot_full = cpu->previous;
+            cache->depot_nr_full++;
+
+            empty = cache->depot_empty;
+            if(empty)
+            {
+                cache->depot_empty = empty->next;
+                cache->depot_nr_empty--;
+            }
+        }
+
+        spinlock_irq_release(&cache->lock, &lock_flags);
+
+        if(cpu->previous && !to_depot)
+        {
+            // The depot is full, the objects of the previous magazine go back to their slabs
+            empty = cpu->previous;
+            for(uint64_t i = 0; i < empty->rounds; i++)
+            {
+                slab_free_object(cache, slab_of(empty->objects[i]), empty->objects[i]);
+            }
+            empty->rounds = 0;
+        }
+        else if(!empty)
+        {
+            // Magazines are optional, they never take from the reserve
+            empty = slab_alloc_object(&magazine_cache, 0);
+            if(!empty)
+            {
+                // The previous magazine is in the depot now
+                if(to_depot) cpu->previous = NULL;
+                break;
+            }
+            empty->rounds = 0;
+        }
+
+        cpu->previous = cpu->loaded;
+        cpu->loaded = empty;
+    }
+
+    interrupts_restore(irq_flags);
+    return stored;
+}
+
+/**
+ * @brief Gives every object sitting in the magazines of a cache back to its slabs
+ *
+ * @param cache The cache
+ * @note Only the magazines of this CPU are flushed, the others will have to be asked once SMP lands
+ */
+static void slab_flush_magazines(struct kmem_cache *cache)
+{
+    if(!cache->use_magazines) return;
+
+    struct slab_magazine *list = NULL;
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&cache->lock, &irq_flags);
+
+    struct kmem_cpu_cache *cpu = slab_this_cpu(cache);
+    struct slab_magazine *magazines[] = {cpu->loaded, cpu->previous};
+    cpu->loaded = cpu->previous = NULL;
+
+    for(size_t i = 0; i < 2; i++)
+    {
+        if(!magazines[i]) continue;
+        magazines[i]->next = list;
+        list = magazines[i];
+    }
+
+    struct slab_magazine *depots[] = {cache->depot_full, cache->depot_empty};
+    cache->depot_full = cache->depot_empty = NULL;
+    cache->depot_nr_full = cache->depot_nr_empty = 0;
+
+    for(size_t i = 0; i < 2; i++)
+    {
+        struct slab_magazine *magazine = depots[i];
+        while(magazine)
+        {
+            struct slab_magazine *next = magazine->next;
+            magazine->next = list;
+            list = magazine;
+            magazine = next;
+        }
+    }
+
+    spinlock_irq_release(&cache->lock, &irq_flags);
+
+    while(list)
+    {
+        struct slab_magazine *next = list->next;
+        for(uint64_t i = 0; i < list->rounds; i++)
+        {
+            slab_free_object(cache, slab_of(list->objects[i]), list->objects[i]);
+        }
+        slab_free_object(&magazine_cache, slab_of(list), list);
+        list = next;
+    }
+}
+
+// How many objects sit in the magazines of a cache, it's only an estimate
+static uint64_t slab_magazine_rounds(struct kmem_cache *cache)
+{
+    uint64_t rounds = cache->depot_nr_full * SLAB_MAGAZINE_SIZE;
+    for(size_t i = 0; i < SLAB_MAX_CPUS; i++)
+    {
+        if(cache->cpu[i].loaded) rounds += cache->cpu[i].loaded->rounds;
+        if(cache->cpu[i].previous) rounds += cache->cpu[i].previous->rounds;
+    }
+    return rounds;
+}
+
+/**
+ * @brief Empties the magazines and frees the empty slabs of every cache
+ *
+ * @param nr_pages How many pages we'd like to be freed
+ * @return uint64_t How many pages were freed
+ */
+static uint64_t slab_shrink_scan(uint64_t nr_pages)
+{
+    uint64_t freed = 0;
+    for(struct kmem_cache *cache = cache_list; cache && freed < nr_pages; cache = cache->next)
+    {
+        uint64_t slabs_before = cache->nr_slabs;
+        slab_flush_magazines(cache);
+
+        uint64_t irq_flags;
+        spinlock_irq_acquire(&cache->lock, &irq_flags);
+
+        // The empty slabs are at the tail
+        while(cache->nr_empty > 0)
+        {
+            struct slab *slab = (struct slab *)cache->partial.prev;
+            if(slab->inuse) break;
+
+            dll_delete(&slab->node);
+            cache->nr_empty--;
+            cache->nr_slabs--;
+
+            slab_destroy(slab);
+        }
+
+        if(slabs_before > cache->nr_slabs) freed += (slabs_before - cache->nr_slabs) << SLAB_ORDER;
+        spinlock_irq_release(&cache->lock, &irq_flags);
+    }
+
+    return freed;
+}
+
+// How many pages sit in empty slabs or could be freed by emptying the magazines
+static uint64_t slab_shrink_count(void)
+{
+    uint64_t pages = 0;
+    for(struct kmem_cache *cache = cache_list; cache; cache = cache->next)
+    {
+        pages += cache->nr_empty << SLAB_ORDER;
+        pages += slab_magazine_rounds(cache) * cache->stride / PMM_PAGE_SIZE;
+    }
+    return pages;
+}
+
+static struct pmm_shrinker slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrink_count,
+    .scan = slab_shrink_scan,
+};
+
+/**
+ * @brief Takes an object from a cache, the magazines of this CPU first and then the slabs
+ *
+ * @param cache The cache
+ * @param flags KMALLOC_FLAGS_SLEEP or KMALLOC_FLAGS_ATOMIC
+ * @return void* The object, already constructed if the cache has a constructor. NULL if we're out of memory
+ */
+static void *slab_cache_alloc(struct kmem_cache *cache, uint64_t flags)
+{
+    // With interrupts disabled nothing preempts us and the pmm doesn't reclaim, so we can't sleep
+    uint64_t irq_flags = 0;
+    if(flags & KMALLOC_FLAGS_ATOMIC)
+    {
+        irq_flags = interrupts_save_and_disable();
+    }
+    else
+    {
+        // Only after an atomic allocation dipped into the reserve
+        struct slab_reserve *reserve = slab_reserve_this_cpu();
+        if(reserve->used && timer_get_uptime_ms() >= reserve->retry_ms) slab_reserve_refill();
+    }
+
+    void *object = cache->use_magazines ? slab_magazine_alloc(cache) : NULL;
+    if(!object) object = slab_alloc_object(cache, flags);
+
+    if(flags & KMALLOC_FLAGS_ATOMIC) interrupts_restore(irq_flags);
+    return object;
+}
+
+/**
+ * @brief Gives an object back to a cache, in the magazines of this CPU if there's room
+ *
+ * @param cache The cache the caller thinks the object belongs to, NULL to trust the slab
+ * @param ptr The object
+ */
+static void slab_cache_free(struct kmem_cache *cache, void *ptr)
+{
+    struct slab *slab = slab_check_object(cache, ptr);
+    if(!slab) return;
+
+    cache = slab->cache;
+    if(cache->use_magazines && slab_magazine_free(cache, ptr)) return;
+
+    slab_free_object(cache, slab, ptr);
+}
+
+/**
+ * @brief Initializes the size classes of the slab allocator
+ * @note The pmm has to be initialized, the slabs are allocated on the first request
+ */
+void slab_init(void)
+{
+    slab_cache_init(&magazine_cache, "magazine", sizeof(struct slab_magazine), SLAB_ALIGN, NULL);
+    magazine_cache.use_magazines = false;
+
+    for(size_t i = 0; i < SLAB_NR_CLASSES; i++)
+    {
+        uint32_t size = slab_class_sizes[i];
+        slab_cache_init(&slab_classes[i], slab_class_names[i], size, (size & (size - 1)) ? SLAB_ALIGN : size, NULL);
+    }
+
+    // Every size goes to the smallest class that fits it
+    size_t class = 0;
+    for(size_t i = 0; i <= SLAB_MAX_SIZE / SLAB_ALIGN; i++)
+    {
+        while(slab_class_sizes[class] < i * SLAB_ALIGN) class++;
+        slab_size_index[i] = class;
+    }
+
+    pmm_register_shrinker(&slab_shrinker);
+
+    // Atomic allocations may need it right away
+    slab_reserve_refill();
+
+    log_line(LOG_SUCCESS, "%s: %u size classes from %u to %u bytes, %llu KB slabs", __FUNCTION__,
+        SLAB_NR_CLASSES, SLAB_MIN_SIZE, SLAB_MAX_SIZE, SLAB_SIZE / 1024);
+}
+
+/**
+ * @brief Allocates an object from the smallest size class that fits
+ *
+ * @param size The size of the object, at most SLAB_MAX_SIZE
+ * @param flags KMALLOC_FLAGS_SLEEP or KMALLOC_FLAGS_ATOMIC
+ * @return void* The object, aligned to SLAB_ALIGN. NULL if the size is too big or we're out of memory
+ */
+void *slab_alloc(size_t size, uint64_t flags)
+{
+    if(size == 0 || size > SLAB_MAX_SIZE) return NULL;
+
+    return slab_cache_alloc(&slab_classes[slab_size_index[(size + SLAB_ALIGN - 1) / SLAB_ALIGN]], flags);
+}
+
+/**
+ * @brief Allocates an object from the smallest size class that fits and is aligned enough
+ * Rounding the header of a slab up to a power of two class costs no objects, the slab is a multiple of it
+ *
+ * @param size The size of the object, at most SLAB_MAX_SIZE
+ * @param align The alignment, a power of two and at most SLAB_MAX_SIZE
+ * @param flags KMALLOC_FLAGS_SLEEP or KMALLOC_FLAGS_ATOMIC
+ * @return void* The object. NULL if no class fits or we're out of memory
+ */
+void *slab_alloc_aligned(size_t size, size_t align, uint64_t flags)
+{
+    if(size == 0 || size > SLAB_MAX_SIZE || align > SLAB_MAX_SIZE) return NULL;
+    if(size < align) size = align;
+
+    // Only the powers of two are aligned past SLAB_ALIGN, the next class always is one
+    size_t class = slab_size_index[(size + SLAB_ALIGN - 1) / SLAB_ALIGN];
+    if(align > SLAB_ALIGN && (slab_class_sizes[class] & (slab_class_sizes[class] - 1))) class++;
+
+    return slab_cache_alloc(&slab_classes[class], flags);
+}
+
+/**
+ * @brief Gives an object back to its slab
+ *
+ * @param ptr The object, returned by slab_alloc
+ */
+void slab_free(void *ptr)
+{
+    slab_cache_free(NULL, ptr);
+}
+
+/**
+ * @brief Returns how many bytes of a slab object can be used
+ *
+ * @param ptr The object
+ * @return size_t The size of its cache, 0 if ptr isn't a slab object
+ */
+size_t slab_object_size(void *ptr)
+{
+    struct slab *slab = slab_check_object(NULL, ptr);
+    return slab ? slab->cache->object_size : 0;
+}
+
+/**
+ * @brief Creates a cache for objects of a fixed size
+ *
+ * @param name Name of the cache, used for debugging. It isn't copied
+ * @param size The size of every object
+ * @param align The alignment of every object, 0 means a cache line. Rounded up to SLAB_ALIGN
+ * @param ctor Optional, called once on every object when its slab is created.
+ * The objects have to be freed in their constructed state
+ * @return struct kmem_cache* The new cache, NULL if the objects don't fit in a slab or we're out of memory
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *object))
+{
+    if(align == 0) align = KMEM_CACHE_LINE;
+    if(align < SLAB_ALIGN) align = SLAB_ALIGN;
+
+    if(size == 0 || size > SLAB_SIZE || (align & (align - 1)) || align > SLAB_SIZE / 2)
+    {
+        log_line(LOG_WARN, "%s: Invalid cache %s (%llu bytes, aligned to %llu)", __FUNCTION__, name, size, align);
+        return NULL;
+    }
+
+    struct kmem_cache *cache = slab_alloc(sizeof(struct kmem_cache), KMALLOC_FLAGS_SLEEP);
+    if(!cache) return NULL;
+
+    if(!slab_cache_init(cache, name, size, align, ctor))
+    {
+        log_line(LOG_WARN, "%s: %s objects don't fit in a slab", __FUNCTION__, name);
+        slab_free(cache);
+        return NULL;
+    }
+
+    log_line(LOG_DEBUG, "%s: %s: %llu bytes objects, %u per slab", __FUNCTION__, name, size, cache->objects_per_slab);
+    return cache;
+}
+
+/**
+ * @brief Allocates an object from a cache
+ *
+ * @param cache The cache
+ * @param flags KMALLOC_FLAGS_SLEEP, or KMALLOC_FLAGS_ATOMIC if the caller can't sleep
+ * @return void* The object, constructed if the cache has a constructor. NULL if we're out of memory
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache, uint64_t flags)
+{
+    return slab_cache_alloc(cache, flags);
+}
+
+/**
+ * @brief Gives an object back to its cache
+ *
+ * @param cache The cache the object was allocated from
+ * @param object The object, in its constructed state. NULL is ignored
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *object)
+{
+    if(!object) return;
+    slab_cache_free(cache, object);
+}
+
+/**
+ * @brief Prints the state of every cache
+ * It's a debug function
+ */
+void slab_print_caches(void)
+{
+    log_line(LOG_DEBUG, "%s: Slab caches:", __FUNCTION__);
+
+    for(size_t i = 0; i < SLAB_MAX_CPUS; i++)
+    {
+        log_line(LOG_DEBUG, "CPU %llu reserve: %llu/%u blocks; %llu slabs built from it", 
+            i, slab_reserves[i].count, SLAB_RESERVE_BLOCKS, slab_reserves[i].hits);
+    }
+
+    for(struct kmem_cache *cache = cache_list; cache; cache = cache->next)
+    {
+        if(!cache->allocs) continue;
+
+        uint64_t cached = slab_magazine_rounds(cache);
+        uint64_t hits = 0;
+        for(size_t i = 0; i < SLAB_MAX_CPUS; i++) hits += cache->cpu[i].hits;
+
+        log_line(LOG_DEBUG, "%s: %llu live objects; %llu slabs (%llu empty); %llu allocs; %llu frees; %llu in magazines (%llu hits)",
+            cache->name, cache->allocs - cache->frees - cached, cache->nr_slabs, cache->nr_empty, cache->allocs, cache->frees, cached, hits);
+    }
+}
+
+/**
+ * @brief Returns how much memory the slabs take and how much of it is allocated
+ *
+ * @param resident_bytes The bytes of every slab
+ * @param live_bytes The bytes of the allocated objects, the ones in the magazines are free
+ */
+void slab_get_usage(uint64_t *resident_bytes, uint64_t *live_bytes)
+{
+    *resident_bytes = *live_bytes = 0;
+
+    for(struct kmem_cache *cache = cache_list; cache; cache = cache->next)
+    {
+        *resident_bytes += cache->nr_slabs * SLAB_SIZE;
+        *live_bytes += (cache->allocs - cache->frees - slab_magazine_rounds(cache)) * cache->object_size;
+    }
+}
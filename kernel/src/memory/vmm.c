@@ -1,20 +1,66 @@
+#include <devices/timer.h>
 #include <interrupts/isr.h>
 #include <memory/hhdm.h>
-#include <memory/kheap.h>
 #include <memory/paging.h>
 #include <memory/pmm.h>
+#include <memory/slab.h>
 #include <memory/vmm.h>
 #include <common/logging.h>
 #include <cpu.h>
 #include <scheduling/lock.h>
+#include <scheduling/task.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <libk/string.h>
 
+extern struct thread *thread_current;
+
 // The kernel and the current virrtual address space
 static struct vm_address_space *kernel_vas = NULL, *current_vas = NULL;
 
+// Every address space, lock it before the lock of any address space
+static struct vm_address_space *vas_list = NULL;
+static struct spinlock_irq vas_list_lock = SPINLOCK_IRQ_INIT;
+
+// Address spaces and areas come from their own caches
+static struct kmem_cache *vas_cache = NULL, *area_cache = NULL;
+
+static uint64_t vmm_migrate_range(uint64_t start_phys, uint64_t end_phys);
+
+// Runs once on every address space of a new slab, they're freed unlocked and without areas
+static void vmm_address_space_ctor(void *object)
+{
+    struct vm_address_space *space = object;
+    space->lock = (struct spinlock_irq)SPINLOCK_IRQ_INIT;
+    space->region_list = NULL;
+}
+
+// Puts an address space in the list walked by the migrator
+static void vmm_link_address_space(struct vm_address_space *space)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&vas_list_lock, &irq_flags);
+
+    space->next = vas_list;
+    vas_list = space;
+
+    spinlock_irq_release(&vas_list_lock, &irq_flags);
+}
+
+// Removes an address space from the list walked by the migrator
+static void vmm_unlink_address_space(struct vm_address_space *space)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&vas_list_lock, &irq_flags);
+
+    struct vm_address_space **current = &vas_list;
+    while(*current && *current != space) current = &(*current)->next;
+    if(*current) *current = space->next;
+
+    spinlock_irq_release(&vas_list_lock, &irq_flags);
+}
+
 /**
  * @brief Our virtual memory manager initialization function
  * 1) Creates the kernel VAS
@@ -22,8 +68,16 @@ static struct vm_address_space *kernel_vas = NULL, *current_vas = NULL;
  */
 void vmm_init(void)
 {
-    // Allocate space for our struct
-    kernel_vas = kmalloc(sizeof(struct vm_address_space));
+    vas_cache = kmem_cache_create("vm_address_space", sizeof(struct vm_address_space), KMEM_CACHE_LINE, vmm_address_space_ctor);
+    area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), KMEM_CACHE_LINE, NULL);
+    if(!vas_cache || !area_cache)
+    {
+        log_line(LOG_ERROR, "%s: Cannot create the vmm caches", __FUNCTION__);
+        hcf();
+    }
+
+    // Allocate space for our struct, the lock and the region list are already initialized
+    kernel_vas = kmem_cache_alloc(vas_cache, KMALLOC_FLAGS_SLEEP);
     if(!kernel_vas)
     {
         log_line(LOG_ERROR, "%s: Cannot allocate space for kernel_vas", __FUNCTION__);
@@ -31,13 +85,16 @@ void vmm_init(void)
     }
 
     // Set the base root
-    struct spinlock_irq init_lock = SPINLOCK_IRQ_INIT;
-    kernel_vas->lock = init_lock;
     kernel_vas->pml4_phys = paging_getKernelRoot();
-    kernel_vas->region_list = NULL;
+    struct numa_policy init_policy = NUMA_POLICY_LOCAL_INIT;
+    kernel_vas->policy = init_policy;
 
     // Set the current vas as the kernel
     current_vas = kernel_vas;
+    vmm_link_address_space(kernel_vas);
+
+    // Our anonymous pages can be moved to make room for contiguous allocations
+    pmm_register_migrator(vmm_migrate_range);
 
     log_line(LOG_SUCCESS, "%s: Virtual memory manager initialized", __FUNCTION__);
 }
@@ -51,22 +108,20 @@ void vmm_init(void)
 struct vm_address_space *vmm_new_address_space(void)
 {
     // Allocate memory for a new address space
-    struct vm_address_space *new_address_space = kmalloc(sizeof(struct vm_address_space));
+    struct vm_address_space *new_address_space = kmem_cache_alloc(vas_cache, KMALLOC_FLAGS_SLEEP);
     if(!new_address_space) return NULL;
 
     // Allocate a new physical page for the pml4
     uint64_t new_pml4 = pmm_alloc(PAGING_PAGE_SIZE);
     if(!new_pml4)
     {
-        kfree(new_address_space);
+        kmem_cache_free(vas_cache, new_address_space);
         return NULL;
     }
 
-    // Set the correct fields
-    struct spinlock_irq init_lock = SPINLOCK_IRQ_INIT;
-    new_address_space->lock = init_lock;
+    // Set the correct fields, the constructor already set the lock and the empty region list
     new_address_space->pml4_phys = (uint64_t *) new_pml4;
-    new_address_space->region_list = NULL;
+    new_address_space->policy = kernel_vas->policy;
 
     // Set all the entries as non present
     uint64_t *virt_new_pml4 = hhdm_physToVirt((void *) new_pml4);
@@ -79,9 +134,137 @@ struct vm_address_space *vmm_new_address_space(void)
         virt_new_pml4[i] = virt_kernel_pml4[i];
     }
 
+    vmm_link_address_space(new_address_space);
     return new_address_space;
 }
  
+// Does the page table under a pde map anything? A huge page counts as a mapping
+static bool vmm_pde_in_use(uint64_t *pde)
+{
+    if(!pde || !(*pde & PTE_FLAG_PRESENT)) return false;
+    if(*pde & PTE_FLAG_PS) return true;
+
+    uint64_t *table = hhdm_physToVirt((void *)(*pde & PAGING_PTE_ADDR_MASK));
+    for(size_t i = 0; i < 512; i++)
+    {
+        if(table[i] & PTE_FLAG_PRESENT) return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Maps zeroed pages over a whole anonymous area, allocating them in batches
+ * Areas with VMM_FLAGS_HUGE get a 2MB page for every whole 2MB they span, while the pmm has blocks that big.
+ * If memory runs out the rest of the area is left to demand paging.
+ * The pages are allocated and zeroed with interrupts enabled, the lock is only taken to map them:
+ * where the fault handler mapped a page meanwhile ours goes back to the pmm
+ * 
+ * @param space The address space of the area, its lock must not be held
+ * @param area The area to populate, already in the area list
+ */
+static void vmm_populate(struct vm_address_space *space, struct vm_area *area)
+{
+    uint64_t *pml4_root = hhdm_physToVirt(space->pml4_phys);
+    uint64_t paging_flags = vmm_generic_to_x86_flags(area->flags);
+    uint64_t virtual = area->base;
+    uint64_t irq_flags;
+
+    // Huge areas start on a 2MB boundary, a single pde maps every 2MB
+    for(; area->flags & VMM_FLAGS_HUGE && virtual + PAGING_HUGE_PAGE_SIZE <= area->base + area->size; virtual += PAGING_HUGE_PAGE_SIZE)
+    {
+        uint64_t phys = pmm_alloc_pages_policy(VMM_HUGE_PAGE_ORDER, PMM_ZONE_NORMAL, &space->policy);
+        if(!phys) break; // Fragmented memory, the rest gets small pages
+
+        memset(hhdm_physToVirt((void *) phys), 0x00, PAGING_HUGE_PAGE_SIZE);
+
+        spinlock_irq_acquire(&space->lock, &irq_flags);
+
+        // An area that was here before may have left an empty page table, the huge page replaces it.
+        // If a fault already mapped small pages here the rest of the area gets small pages too
+        uint64_t *pde = paging_get_pde(pml4_root, virtual);
+        bool in_use = vmm_pde_in_use(pde);
+        if(!in_use)
+        {
+            if(pde && (*pde & PTE_FLAG_PRESENT)) pmm_page_dec_ref(*pde & PAGING_PTE_ADDR_MASK);
+
+            // Not movable, the migrator only moves single pages
+            paging_map_page(pml4_root, virtual, phys, paging_flags, true);
+        }
+
+        spinlock_irq_release(&space->lock, &irq_flags);
+
+        if(in_use)
+        {
+            pmm_free_pages(phys, VMM_HUGE_PAGE_ORDER);
+            break;
+        }
+    }
+
+    uint64_t pages[PMM_BULK_BATCH];
+    while(virtual < area->base + area->size)
+    {
+        uint64_t wanted = (area->base + area->size - virtual) / PAGING_PAGE_SIZE;
+        if(wanted > PMM_BULK_BATCH) wanted = PMM_BULK_BATCH;
+
+        // Anonymous memory has to be zeroed
+        uint64_t got = pmm_alloc_bulk(wanted, pages, &space->policy);
+        for(uint64_t i = 0; i < got; i++) memset(hhdm_physToVirt((void *) pages[i]), 0x00, PAGING_PAGE_SIZE);
+
+        spinlock_irq_acquire(&space->lock, &irq_flags);
+
+        for(uint64_t i = 0; i < got; i++, virtual += PAGING_PAGE_SIZE)
+        {
+            // The fault handler got here first
+            uint64_t *pte = paging_get_pte(pml4_root, virtual);
+            if(pte && (*pte & PTE_FLAG_PRESENT))
+            {
+                pmm_free_addr(pages[i]);
+                continue;
+            }
+
+            paging_map_page(pml4_root, virtual, pages[i], paging_flags, false);
+            pmm_page_set_movable(pages[i]);
+        }
+
+        spinlock_irq_release(&space->lock, &irq_flags);
+
+        if(got < wanted)
+        {
+            log_line(LOG_WARN, "%s: Out of memory, 0x%llx-0x%llx will be demand paged", __FUNCTION__, virtual, area->base + area->size);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Unmaps every page of an area, the 2MB ones of huge areas included
+ * 
+ * @param space The address space of the area, its lock has to be held
+ * @param area The area to unmap
+ */
+static void vmm_unmap_area(struct vm_address_space *space, struct vm_area *area)
+{
+    uint64_t *pml4_root = hhdm_physToVirt(space->pml4_phys);
+    uint64_t virtual = area->base;
+
+    // Every 2MB of a huge area is either a huge page or small pages if the pmm had no block
+    for(; area->flags & VMM_FLAGS_HUGE && virtual + PAGING_HUGE_PAGE_SIZE <= area->base + area->size; virtual += PAGING_HUGE_PAGE_SIZE)
+    {
+        uint64_t *pde = paging_get_pde(pml4_root, virtual);
+        if(pde && (*pde & PTE_FLAG_PRESENT) && (*pde & PTE_FLAG_PS))
+            paging_unmap_page(pml4_root, virtual, true, true);
+        else
+            paging_unmap_region(pml4_root, virtual, PAGING_HUGE_PAGE_SIZE, false, true);
+    }
+
+    paging_unmap_region(pml4_root, 
+        virtual, 
+        area->base + area->size - virtual,
+        false,
+        !(area->flags & VMM_FLAGS_MMIO)); // Free the physical page only if the mapped area is not MMIO
+}
+
 /**
  * @brief Our vmm allocator
  * This function finds an available region in the virtual address space
@@ -100,6 +283,14 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
 
     if(!space || size == 0) return NULL;
 
+    // Huge pages can't be demand paged, they're mapped right away. Areas start where a huge page can
+    uint64_t align = PAGING_PAGE_SIZE;
+    if(flags & VMM_FLAGS_HUGE)
+    {
+        flags |= VMM_FLAGS_POPULATE;
+        align = PAGING_HUGE_PAGE_SIZE;
+    }
+
     uint64_t irq_flags;
     spinlock_irq_acquire(&space->lock, &irq_flags);
 
@@ -122,7 +313,7 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
     // Search for a free space in the virtual address space
     struct vm_area *current = space->region_list;
     struct vm_area *prev = NULL;
-    uint64_t candidate = region_search_start;
+    uint64_t candidate = (region_search_start + align - 1) & ~(align - 1);
 
     while(current != NULL)
     {
@@ -134,7 +325,7 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
         }
 
         // We position ourselves after the block
-        candidate = current->base + current->size;
+        candidate = (current->base + current->size + align - 1) & ~(align - 1);
 
         // OOM virtual
         if(candidate >= region_search_end) 
@@ -147,8 +338,8 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
         current = current->next;
     }
 
-    // Allocate the new area in the kernel heap
-    struct vm_area *new_area = kmalloc(sizeof(struct vm_area));
+    // Allocate the new area from its cache, we hold a spinlock so we can't sleep
+    struct vm_area *new_area = kmem_cache_alloc(area_cache, KMALLOC_FLAGS_ATOMIC);
     if(!new_area) 
     {
         spinlock_irq_release(&space->lock, &irq_flags);
@@ -188,6 +379,14 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
 
         log_line(LOG_DEBUG, "%s: MMIO Mapped v=0x%llx -> p=0x%llx", __FUNCTION__, candidate, phys_base);
     }
+    else if(flags & VMM_FLAGS_ANON && flags & VMM_FLAGS_POPULATE)
+    {
+        // The caller is going to touch the pages anyway, skip the faults.
+        // The area is in the list already, so it can be filled without the lock
+        spinlock_irq_release(&space->lock, &irq_flags);
+        vmm_populate(space, new_area);
+        return (void *) candidate;
+    }
     else if(flags & VMM_FLAGS_ANON)
     {
         // Demanding paging
@@ -233,6 +432,27 @@ struct vm_area *vmm_get_vm_area(struct vm_address_space *space, uint64_t vaddr)
     return NULL;
 }
 
+/**
+ * @brief Returns the size of the area that starts at an address
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @param addr The first byte of the area, as vmm_alloc returned it
+ * @return uint64_t The size of the area, 0 if no area starts at addr
+ */
+uint64_t vmm_get_area_size(struct vm_address_space *space, uint64_t addr)
+{
+    if(!space) return 0;
+
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&space->lock, &irq_flags);
+
+    struct vm_area *area = vmm_get_vm_area(space, addr);
+    uint64_t size = area && area->base == addr ? area->size : 0;
+
+    spinlock_irq_release(&space->lock, &irq_flags);
+    return size;
+}
+
 /**
  * @brief Function for removing the page mapping of a block
  * 
@@ -265,13 +485,9 @@ void vmm_free(struct vm_address_space *space, uint64_t addr)
             }
 
             // Unmap the region in the page tables
-            paging_unmap_region(hhdm_physToVirt(space->pml4_phys), 
-                current->base, 
-                current->size,
-                false,
-                !(current->flags & VMM_FLAGS_MMIO)); // Free the physical page only if the mapped area is not MMIO
+            vmm_unmap_area(space, current);
 
-            kfree(current);
+            kmem_cache_free(area_cache, current);
             spinlock_irq_release(&space->lock, &irq_flags);
             return;
         }
@@ -296,6 +512,9 @@ void vmm_destroy_address_space(struct vm_address_space *space)
 {
     if(!space || space == kernel_vas) return;
 
+    // The migrator must not find it anymore
+    vmm_unlink_address_space(space);
+
     struct vm_area *current = space->region_list;
     
     // Free each area
@@ -309,8 +528,8 @@ void vmm_destroy_address_space(struct vm_address_space *space)
     // Decrement the usage of that table
     pmm_page_dec_ref((uint64_t) space->pml4_phys);
 
-    // Free the address space struct
-    kfree(space);
+    // Free the address space struct, unlocked and without areas like the constructor left it
+    kmem_cache_free(vas_cache, space);
 }
 
 /**
@@ -396,17 +615,42 @@ void vmm_page_fault_handler(struct cpu_status *context)
         hcf();
     }
 
-    // Demand paging
-    uint64_t phys_page = pmm_alloc(PAGING_PAGE_SIZE);
+    // Demand paging, the page has to be zeroed (fundamental for security)
+    // so we take it from the zero pool instead of clearing it here
+    uint64_t phys_page = pmm_alloc_zeroed(&target_vas->policy);
+
+    // Out of memory, the shrinkers get a chance to free something. Interrupts are
+    // disabled inside the handler so the pmm can't do it on its own, and we can't
+    // sleep waiting for someone else who is reclaiming
+    for(uint32_t retry = 0; !phys_page && retry < PMM_RECLAIM_RETRIES; retry++)
+    {
+        spinlock_irq_release(&target_vas->lock, &irq_flags);
+        uint64_t freed = pmm_try_reclaim(PMM_RECLAIM_BATCH);
+        spinlock_irq_acquire(&target_vas->lock, &irq_flags);
+
+        // While the lock was dropped the area could have gone away or the page been mapped
+        target_area = vmm_get_vm_area(target_vas, cr2);
+        uint64_t *pte = paging_get_pte(hhdm_physToVirt(target_vas->pml4_phys), cr2);
+        if(!target_area || (pte && (*pte & PTE_FLAG_PRESENT)))
+        {
+            spinlock_irq_release(&target_vas->lock, &irq_flags);
+            return;
+        }
+
+        if(!freed) break;
+        phys_page = pmm_alloc_zeroed(&target_vas->policy);
+    }
+
     if(!phys_page)
     {
         // TODO: Implement swap memory mechainsm so this never happens
-        log_line(LOG_ERROR, "%s: OOM Cannot allocate a page", __FUNCTION__);
-        hcf();
-    }
+        spinlock_irq_release(&target_vas->lock, &irq_flags);
+        log_line(LOG_ERROR, "%s: OOM Cannot allocate a page for 0x%llx (RIP: 0x%llx)", __FUNCTION__, cr2, context->rip);
 
-    // Zero the page, fundamental for security
-    memset(hhdm_physToVirt((void *)phys_page), 0x00, PAGING_PAGE_SIZE);
+        // Only a user thread can die here: kernel code may hold locks that would never be released
+        if(!user || !thread_current || thread_current->tid == 0) hcf();
+        task_current_thread_exit();
+    }
     
     // Map the page
     paging_map_page(hhdm_physToVirt(target_vas->pml4_phys), 
@@ -414,11 +658,154 @@ void vmm_page_fault_handler(struct cpu_status *context)
         phys_page,
         vmm_generic_to_x86_flags(target_area->flags),
         false);
+
+    // Only this mapping points to it, the migrator can move it
+    pmm_page_set_movable(phys_page);
     
     spinlock_irq_release(&target_vas->lock, &irq_flags);
     log_line(LOG_DEBUG, "%s: Recovered Fault at 0x%llx -> Alloc Phys 0x%llx", __FUNCTION__,cr2, phys_page);
 }
 
+/**
+ * @brief Finds the pte of an address for the migrator, without creating tables
+ * 
+ * @param pml4_root The pml4 of the address space
+ * @param virt The address
+ * @param next Filled with the next address worth looking at, past the whole range of a missing table
+ * @return uint64_t* The pte, NULL if no page table covers the address (or a huge page does)
+ */
+static uint64_t *vmm_migrate_find_pte(uint64_t *pml4_root, uint64_t virt, uint64_t *next)
+{
+    *next = virt + PAGING_PAGE_SIZE;
+
+    uint64_t entry = pml4_root[PAGING_GET_PML4INDEX(virt)];
+    if(!(entry & PTE_FLAG_PRESENT))
+    {
+        *next = (virt | ((1ULL << 39) - 1)) + 1;
+        return NULL;
+    }
+
+    // Huge pages aren't movable, the migrator only moves single pages
+    entry = ((uint64_t *)hhdm_physToVirt((void *)(entry & PAGING_PTE_ADDR_MASK)))[PAGING_GET_PDPRINDEX(virt)];
+    if(!(entry & PTE_FLAG_PRESENT) || (entry & PTE_FLAG_PS))
+    {
+        *next = (virt | ((1ULL << 30) - 1)) + 1;
+        return NULL;
+    }
+
+    entry = ((uint64_t *)hhdm_physToVirt((void *)(entry & PAGING_PTE_ADDR_MASK)))[PAGING_GET_PDINDEX(virt)];
+    if(!(entry & PTE_FLAG_PRESENT) || (entry & PTE_FLAG_PS))
+    {
+        *next = (virt | (PAGING_HUGE_PAGE_SIZE - 1)) + 1;
+        return NULL;
+    }
+
+    return &((uint64_t *)hhdm_physToVirt((void *)(entry & PAGING_PTE_ADDR_MASK)))[PAGING_GET_PTINDEX(virt)];
+}
+
+/**
+ * @brief Moves the anonymous pages sitting inside a physical range to new pages
+ * Registered as the pmm migrator: pmm_alloc_contig calls it to empty a range.
+ * Each page is copied and its pte rewritten with the address space locked,
+ * so with interrupts disabled nothing can write to it in between.
+ * Missing page tables are skipped as a whole, and the locks are dropped after every area
+ * or VMM_MIGRATE_SCAN ptes: the scan resumes from where it was, if its address space still exists
+ * @param start_phys The first byte of the range
+ * @param end_phys The first byte after the range
+ * @return uint64_t How many pages were moved
+ * @note The stack we're running on is skipped, the copy would miss our own writes
+ */
+static uint64_t vmm_migrate_range(uint64_t start_phys, uint64_t end_phys)
+{
+    uint64_t rsp;
+    asm volatile("mov %%rsp, %0" : "=r"(rsp));
+
+    uint64_t moved = 0;
+    bool oom = false;
+
+    // Where the scan resumes
+    uint64_t list_flags;
+    spinlock_irq_acquire(&vas_list_lock, &list_flags);
+    struct vm_address_space *space = vas_list;
+    spinlock_irq_release(&vas_list_lock, &list_flags);
+    uint64_t virt = 0;
+
+    while(space && !oom)
+    {
+        spinlock_irq_acquire(&vas_list_lock, &list_flags);
+
+        // The address space may have been destroyed while we didn't hold the list
+        struct vm_address_space *current = vas_list;
+        while(current && current != space) current = current->next;
+        if(!current)
+        {
+            spinlock_irq_release(&vas_list_lock, &list_flags);
+            break;
+        }
+
+        uint64_t irq_flags;
+        spinlock_irq_acquire(&space->lock, &irq_flags);
+
+        // The first anonymous area we haven't finished, areas are sorted by address
+        struct vm_area *area = space->region_list;
+        while(area && (!(area->flags & VMM_FLAGS_ANON) || area->base + area->size <= virt
+            || (rsp >= area->base && rsp < area->base + area->size))) area = area->next;
+
+        if(!area)
+        {
+            spinlock_irq_release(&space->lock, &irq_flags);
+            space = space->next;
+            virt = 0;
+            spinlock_irq_release(&vas_list_lock, &list_flags);
+            continue;
+        }
+
+        uint64_t *pml4_root = hhdm_physToVirt(space->pml4_phys);
+        uint64_t end = area->base + area->size;
+        if(virt < area->base) virt = area->base;
+
+        for(uint32_t scanned = 0; virt < end && scanned < VMM_MIGRATE_SCAN && !oom; )
+        {
+            uint64_t next;
+            uint64_t *pte = vmm_migrate_find_pte(pml4_root, virt, &next);
+            uint64_t current_virt = virt;
+
+            // Past the top of the address space the next address wraps around
+            virt = next > virt ? next : end;
+            if(!pte) continue;
+            scanned++;
+
+            if(!(*pte & PTE_FLAG_PRESENT)) continue;
+
+            uint64_t old_phys = *pte & PAGING_PTE_ADDR_MASK;
+            if(old_phys < start_phys || old_phys >= end_phys || !pmm_page_is_movable(old_phys)) continue;
+
+            uint64_t new_phys = pmm_alloc_pages_policy(0, PMM_ZONE_NORMAL, &space->policy);
+            if(!new_phys)
+            {
+                oom = true;
+                break;
+            }
+
+            memcpy(hhdm_physToVirt((void *) new_phys), hhdm_physToVirt((void *) old_phys), PAGING_PAGE_SIZE);
+
+            // Keep the flags, only the frame changes
+            *pte = new_phys | (*pte & ~PAGING_PTE_ADDR_MASK);
+            asm volatile("invlpg (%0)" :: "r" (current_virt) : "memory");
+
+            pmm_page_set_movable(new_phys);
+            pmm_page_dec_ref(old_phys);
+            moved++;
+        }
+
+        // Interrupts get a chance before the next batch
+        spinlock_irq_release(&space->lock, &irq_flags);
+        spinlock_irq_release(&vas_list_lock, &list_flags);
+    }
+
+    return moved;
+}
+
 /**
  * @brief Switch the current address space
  * 
@@ -444,4 +831,44 @@ void vmm_switch_address_space(struct vm_address_space *space)
 struct vm_address_space* vmm_get_kernel_vas()
 {
     return kernel_vas;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Measures the cost of creating and destroying areas, like a process does with its mappings
+ * Bursts of VMM_BENCH_BURST one page anonymous areas are allocated and then freed
+ * @param iterations How many areas to create and destroy
+ */
+void vmm_benchmark(uint64_t iterations)
+{
+    static void *burst[VMM_BENCH_BURST];
+
+    if(iterations < VMM_BENCH_BURST) iterations = VMM_BENCH_BURST;
+
+    uint64_t alloc_cycles = 0, free_cycles = 0, allocated = 0;
+    for(uint64_t round = 0; round < iterations / VMM_BENCH_BURST; round++)
+    {
+        uint64_t start = timer_read_tsc();
+        for(size_t i = 0; i < VMM_BENCH_BURST; i++)
+        {
+            burst[i] = vmm_alloc(kernel_vas, PAGING_PAGE_SIZE, VMM_FLAGS_READ | VMM_FLAGS_WRITE | VMM_FLAGS_ANON, 0);
+        }
+        uint64_t middle = timer_read_tsc();
+        for(size_t i = 0; i < VMM_BENCH_BURST; i++)
+        {
+            if(!burst[i]) continue;
+            vmm_free(kernel_vas, (uint64_t)burst[i]);
+            allocated++;
+        }
+        alloc_cycles += middle - start;
+        free_cycles += timer_read_tsc() - middle;
+    }
+
+    if(!allocated)
+    {
+        log_line(LOG_DEBUG, "%s: Out of memory", __FUNCTION__);
+        return;
+    }
+
+    log_line(LOG_DEBUG, "%s: %llu areas; alloc %llu cycles/op; free %llu cycles/op", __FUNCTION__,
+        allocated, alloc_cycles / allocated, free_cycles / allocated);
+}
@@ -4,31 +4,6 @@
 #include <stddef.h>
 #include <stdint.h>
 
-static inline uint64_t interrupts_save_and_disable(void) 
-{
-    uint64_t flags;
-    asm volatile (
-        "pushfq\n\t"        // push RFLAGS
-        "pop %0\n\t"        // pop RFLAGS in flags
-        "cli"               // Disables interrupts
-        : "=r" (flags)
-        :
-        : "memory"
-    );
-    return flags;
-}
-
-static inline void interrupts_restore(uint64_t flags) 
-{
-    asm volatile (
-        "push %0\n\t"       // push the old RFLAGS
-        "popfq"             // pops into RFLAGS
-        :
-        : "r" (flags)
-        : "memory", "cc"
-    );
-}
-
 /**
  * @brief Acquisition function for a struct spinlock_irq
  * This function is blocking and it's safe for use in ISR's
@@ -113,6 +88,23 @@ void mutex_acquire(struct mutex *mutex)
     scheduler_yield();
 }
 
+/**
+ * @brief Takes the mutex only if it's free, it never sleeps
+ * @param mutex Pointer to the mutex
+ * @return true If we took the mutex
+ */
+bool mutex_try_acquire(struct mutex *mutex)
+{
+    uint64_t irq_flags;
+    spinlock_irq_acquire(&mutex->internal_lock, &irq_flags);
+
+    bool taken = !mutex->is_locked;
+    if(taken) mutex->is_locked = true;
+
+    spinlock_irq_release(&mutex->internal_lock, &irq_flags);
+    return taken;
+}
+
 /**
  * @brief Realising function for the mutex
  * @param mutex 
@@ -2,7 +2,7 @@
 #include <cpu.h>
 #include <devices/timer.h>
 #include <interrupts/isr.h>
-#include <memory/kheap.h>
+#include <memory/slab.h>
 #include <memory/vmm.h>
 #include <scheduling/lock.h>
 #include <scheduling/scheduler.h>
@@ -20,22 +20,25 @@ struct task *task_list = NULL;
 
 struct spinlock_irq scheduler_lock = SPINLOCK_IRQ_INIT;
 
+extern struct kmem_cache *task_cache;
+extern struct kmem_cache *thread_cache;
+
 /**
  * @brief Initializes the scheduler, simply creates an idle task and thread
  * This task is the main kernel task (or idle task)
  */
 void scheduler_init()
 {
+    task_init_caches();
+
     // We don't need to call task_create because the idle task already exists
-    struct task *idle = kmalloc(sizeof(struct task));
+    struct task *idle = kmem_cache_alloc(task_cache, KMALLOC_FLAGS_SLEEP);
     if(!idle)
     {
         log_line(LOG_ERROR, "%s: Cannot allocate the idle task struct", __FUNCTION__);
         hcf();
     }
 
-    memset(idle, 0, sizeof(struct task));
-    
     // Set the default values for the task
     idle->pid = 0;
     strcpy(idle->name, "Idle");
@@ -47,20 +50,21 @@ void scheduler_init()
     task_list = idle;
 
     // Create the idle thread
-    struct thread *idle_thread = kmalloc(sizeof(struct thread));
+    struct thread *idle_thread = kmem_cache_alloc(thread_cache, KMALLOC_FLAGS_SLEEP);
     if(!idle_thread)
     {
-        kfree(idle);
+        kmem_cache_free(task_cache, idle);
         log_line(LOG_ERROR, "%s: Cannot allocate the idle thread struct", __FUNCTION__);
         hcf();
     }
 
-    memset(idle_thread, 0, sizeof(struct thread));
-
-    // Set the default values for the thread
+    // Set the default values for the thread, its context is saved on the first interrupt
     idle_thread->tid = 0;
+    idle_thread->context = NULL;
     idle_thread->state = THREAD_RUNNING;
     idle_thread->ticks_remaining = THREAD_INITIAL_TICKS;
+    idle_thread->wake_time = 0;
+    idle_thread->next_waiter = NULL;
 
     // Link all the pieces
     idle->threads = idle_thread;
@@ -1,17 +1,18 @@
 #include <common/logging.h>
+#include <cpu.h>
 #include <devices/timer.h>
 #include <interrupts/isr.h>
 #include <scheduling/lock.h>
 #include <scheduling/task.h>
 #include <memory/gdt/gdt.h>
-#include <memory/kheap.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
 #include <memory/vmm.h>
 #include <scheduling/scheduler.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <libk/string.h>
-#include <libk/string.h>
 
 extern struct task *task_current;
 extern struct thread *thread_current;
@@ -22,6 +23,26 @@ extern struct spinlock_irq scheduler_lock;
 uint64_t next_pid = 1;
 uint64_t next_tid = 1;
 
+// Tasks and threads come from their own caches, every field is set on creation
+struct kmem_cache *task_cache = NULL;
+struct kmem_cache *thread_cache = NULL;
+
+/**
+ * @brief Creates the caches of the task and thread structs
+ * @note Has to be called before creating any task, the heap has to be initialized
+ */
+void task_init_caches(void)
+{
+    task_cache = kmem_cache_create("task", sizeof(struct task), KMEM_CACHE_LINE, NULL);
+    thread_cache = kmem_cache_create("thread", sizeof(struct thread), KMEM_CACHE_LINE, NULL);
+
+    if(!task_cache || !thread_cache)
+    {
+        log_line(LOG_ERROR, "%s: Cannot create the task caches", __FUNCTION__);
+        hcf();
+    }
+}
+
 /**
  * @brief Creates a new kernel task/process
  * 
@@ -31,15 +52,13 @@ uint64_t next_tid = 1;
 struct task *task_create(const char *name)
 {
     // Allocate space for the new kernel task struct
-    struct task *new_task = kmalloc(sizeof(struct task));
+    struct task *new_task = kmem_cache_alloc(task_cache, KMALLOC_FLAGS_SLEEP);
     if(!new_task)
     {
         return NULL;
     }
 
-    // We set it to zero
-    memset(new_task, 0, sizeof(struct task));
-
+    // Objects from the cache aren't zeroed, every field is set here
     strcpy(new_task->name, name);
     new_task->vas = vmm_get_kernel_vas();
     new_task->pid = next_pid++; // we have 2^64 possible pids, i won't check if we overflow :)
@@ -84,25 +103,22 @@ struct thread *task_create_thread(struct task *task, void (*entry_point)())
     if(!task || !entry_point) return NULL;
 
     // Allocate space for our thread struct
-    struct thread *new_thread = kmalloc(sizeof(struct thread));
+    struct thread *new_thread = kmem_cache_alloc(thread_cache, KMALLOC_FLAGS_SLEEP);
     if(!new_thread)
     {
         return NULL;
     }
 
-    // We zero the newly created thead structure
-    memset(new_thread, 0x00, sizeof(struct thread));
-
     // We allocate a new area for the stack of the thread
     void *new_stack_bottom = vmm_alloc(
         vmm_get_kernel_vas(), 
         THREAD_INITIAL_STACK_SIZE, 
-        VMM_FLAGS_READ | VMM_FLAGS_WRITE | VMM_FLAGS_ANON, // Note that the stack is NOT executable
+        VMM_FLAGS_READ | VMM_FLAGS_WRITE | VMM_FLAGS_ANON | VMM_FLAGS_POPULATE, // Note that the stack is NOT executable
         false);
 
     if(!new_stack_bottom)
     {
-        kfree(new_thread);
+        kmem_cache_free(thread_cache, new_thread);
         return NULL;
     }
 
@@ -133,6 +149,8 @@ struct thread *task_create_thread(struct task *task, void (*entry_point)())
     new_thread->state = THREAD_READY;
     new_thread->ticks_remaining = THREAD_INITIAL_TICKS;
     new_thread->tid = next_tid++; // we have 2^64 possible tids, i won't check if we overflow :)
+    new_thread->wake_time = 0;
+    new_thread->next_waiter = NULL;
 
     uint64_t irq_flags;
     spinlock_irq_acquire(&scheduler_lock, &irq_flags);
@@ -249,10 +267,11 @@ void kernel_idle_thread()
         {
             log_line(LOG_DEBUG, "%s: Reaping TID %lld", __FUNCTION__, thread_to_delete->tid);
             vmm_free(stack_to_clean, thread_to_delete->context->rsp);
-            kfree(thread_to_delete);
+            kmem_cache_free(thread_cache, thread_to_delete);
         }
-        else 
+        else if(!pmm_zero_pool_refill(PMM_ZERO_POOL_BATCH) && !pmm_compact_idle())
         {
+            // Nothing to reap, the zero pool is full and memory isn't fragmented
             asm volatile ("hlt");
         }
     }
@@ -274,4 +293,15 @@ void thread_sleep(uint64_t ms)
     spinlock_irq_release(&scheduler_lock, &irq_flags);
 
     scheduler_yield();
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Wakes up a sleeping thread at the next timer tick
+ * It takes no lock, so it can be called with any other lock held
+ * 
+ * @param thread The thread to wake up
+ */
+void thread_wake(struct thread *thread)
+{
+    if(thread->state == THREAD_SLEEPING) thread->wake_time = 0;
+}